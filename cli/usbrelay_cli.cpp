@@ -0,0 +1,1425 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+/**
+  Утилита командной строки для управления платой USB-реле.
+
+  Разовый режим: команда передается в аргументах, плата захватывается на время
+  исполнения одной команды.
+    usbrelay-cli [options] on 2
+
+  Потоковый режим: команды читаются построчно из stdin (параметр --stream) или
+  из файла сценария (параметр --script), плата остается захваченной до конца
+  потока команд. Для каждой строки выводится номер строки, результат и время
+  исполнения:
+    <line> ok <msec> [output]
+    <line> error <msec> <message>
+
+  Обмен с платой в разовом и потоковом режимах можно записать в файл  (пара-
+  метр --record) и воспроизвести без платы (параметр --replay, см. Replay-
+  Transport). При воспроизведении выводится количество расхождений с записью,
+  при наличии расхождений утилита завершается с кодом 1.
+    usbrelay-cli --record exchange.rec on 2
+    usbrelay-cli --replay exchange.rec --replay-speed 0 on 2
+
+  Режим самопроверки: план команд переключения (см. RelayBoard::planCommands())
+  сравнивается с минимальным планом, найденным полным перебором, для всех пар
+  состояний плат на 1, 2, 4 и 8 реле.
+    usbrelay-cli self-check
+
+  Режим замера перечисления устройств: поиск и захват плат  выполняется  на
+  имитируемой шине (см. SimBus) с заданным количеством посторонних устройств
+  и плат реле. Выводится время подключения платы, количество обращений к
+  устройствам и количество выделений памяти на одно подключение  (счетчик
+  выделений доступен при сборке со свойством allocCount в qbs-файле).
+    usbrelay-cli bench-enum [devices] [boards] [delay_usec]
+
+  Режим замера задержки команд: команды post() исполняются на имитируемой
+  плате при нагрузке на все процессоры. Выводится распределение задержки от
+  постановки команды в очередь до подтверждения нового состояния (см. поле
+  StateChange::latency) и количество выделений памяти на одну команду. Если
+  заданы пороги задержки p99.9 и выделений памяти на команду, результат про-
+  веряется, при превышении порога утилита завершается с кодом 1.
+    usbrelay-cli bench-latency [commands] [stress_threads] [priority] [cpu]
+                               [max_p999_ms] [max_allocs]
+
+  Режим нагрузочной проверки: несколько потоков  выполняют  случайные  команды
+  переключения и чтения состояний имитируемой платы. Время вызова и возврата
+  операций фиксируется по steady_clock, полученная история проверяется на ли-
+  неаризуемость относительно журнала состояний имитируемой платы (см. SimBus::
+  stateLog()), с учетом порядка операций разных потоков во времени. Отдельно
+  проверяется согласованность истории изменений драйвера (см. StateHistory).
+  Выводится количество нарушений и пропускная способность. Для поиска гонок
+  утилиту следует собрать с ThreadSanitizer (свойство tsan в qbs-файлах).
+    usbrelay-cli bench-stress [threads] [seconds]
+*/
+
+#include "usb_relay.h"
+#include "usb_relay_board.h"
+#include "usb_relay_trace.h"
+#include "usb_transport_replay.h"
+#include "usb_transport_sim.h"
+
+#include "shared/logger/logger.h"
+
+#include <QtCore>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Счетчик выделений памяти для режимов bench-enum и bench-latency. Счетчик
+// включается при сборке с макросом USB_RELAY_ALLOC_COUNT (свойство allocCount
+// в qbs-файле) и предназначен только для замеров: учитываются все вызовы
+// malloc/calloc/realloc, в том числе из libusb и из operator new. Функции
+// замещают реализацию glibc и передают вызов ее внутренним точкам входа, что
+// несовместимо с санитайзерами, перехватывающими те же функции
+#if defined(__SANITIZE_THREAD__) || defined(__SANITIZE_ADDRESS__)
+#undef USB_RELAY_ALLOC_COUNT
+#endif
+
+#ifdef USB_RELAY_ALLOC_COUNT
+static const bool allocCountEnabled = true;
+static std::atomic<quint64> allocCount = {0};
+
+extern "C" {
+void* __libc_malloc(size_t);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+
+void* malloc(size_t size) noexcept
+{
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept
+{
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* p, size_t size) noexcept
+{
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+} // extern "C"
+#else
+static const bool allocCountEnabled = false;
+static const quint64 allocCount = 0;
+#endif
+
+static const char* usageText =
+R"(Usage: usbrelay-cli [options] [command [args]]
+
+Options:
+  -s, --serial <serial>   Attach only the board with given serial
+  -t, --timeout <msec>    Board attach timeout (default 5000)
+  -i, --stream            Read commands from stdin
+  -f, --script <file>     Read commands from script file
+  -e, --stop-on-error     Stop stream processing at the first failed command
+  -v, --verbose           Print driver log to stdout
+  --record <file>         Record the USB exchange with the board to file
+  --replay <file>         Replay a recorded USB exchange instead of using
+                          a board, exit code 1 on mismatches
+  --replay-speed <factor> Replay speed factor (default 1, 0 - no delays)
+  -h, --help              Show this help
+
+Commands:
+  on <n|all>              Turn relay on
+  off <n|all>             Turn relay off
+  group <mask> <values>   Change several relays at once (bit 0 is relay 1)
+  tx <n>=<on|off> ...     Change several relays all-or-nothing, roll back
+                          to the previous states if verification fails
+  cas <expected> <values> Change all relays to values only if current states
+                          equal expected, print actual states on conflict
+  at <msec> <on|off> <n|all>
+                          Switch relay msec milliseconds from now and print
+                          the issue time error and transfer duration
+  get [n]                 Print relay states
+  info                    Print product, serial and relay count
+  serial <value>          Change board serial
+  sleep <msec>            Pause command processing
+
+Self-check and benchmark (no board required):
+  self-check              Compare the command planner with an exhaustive
+                          search over all relay state transitions
+  bench-enum [devices] [boards] [delay_usec]
+                          Attach boards on a simulated bus with given number
+                          of foreign devices (default 500) and relay boards
+                          (default 32), delay_usec - simulated duration of
+                          one device access (default 0)
+  bench-latency [commands] [stress_threads] [priority] [cpu]
+                [max_p999_ms] [max_allocs]
+                          Measure post() command latency on a simulated board
+                          (default 10000 commands) while stress_threads busy
+                          threads load the CPUs (default: number of CPUs).
+                          priority > 0 enables real-time mode of the worker
+                          thread with given SCHED_FIFO priority, cpu - CPU
+                          for the worker thread (default -1, no affinity).
+                          With max_p999_ms and/or max_allocs (allocations per
+                          command) the result is checked and the exit code is
+                          1 if a threshold is exceeded
+  Allocation counts are reported only when built with the allocCount
+  qbs property (not available with sanitizers).
+  bench-stress [threads] [seconds]
+                          Run random toggles and reads from several threads
+                          (default 8) against a simulated board for given
+                          time (default 5) and check the observed histories
+                          for linearizability against the simulated board
+)";
+
+struct Options
+{
+    QString serial;
+    int attachTimeout = {5000};
+    QString script;
+    bool stream = {false};
+    bool stopOnError = {false};
+    bool verbose = {false};
+    QString record;
+    QString replay;
+    double replaySpeed = {1.0};
+    QStringList command;
+};
+
+// Последнее сообщение об ошибке, полученное через сигнал failChange()
+static QString failMessage;
+
+static bool parseOptions(const QStringList& args, Options& options)
+{
+    for (int i = 1; i < args.count(); ++i)
+    {
+        const QString& arg = args[i];
+        auto value = [&](QString& out) -> bool
+        {
+            if (i + 1 >= args.count())
+            {
+                fprintf(stderr, "Option %s requires a value\n", qPrintable(arg));
+                return false;
+            }
+            out = args[++i];
+            return true;
+        };
+
+        if (arg == "-s" || arg == "--serial")
+        {
+            if (!value(options.serial))
+                return false;
+        }
+        else if (arg == "-t" || arg == "--timeout")
+        {
+            QString timeout;
+            if (!value(timeout))
+                return false;
+            bool ok;
+            options.attachTimeout = timeout.toInt(&ok);
+            if (!ok || options.attachTimeout < 0)
+            {
+                fprintf(stderr, "Invalid timeout: %s\n", qPrintable(timeout));
+                return false;
+            }
+        }
+        else if (arg == "-f" || arg == "--script")
+        {
+            if (!value(options.script))
+                return false;
+        }
+        else if (arg == "-i" || arg == "--stream")
+            options.stream = true;
+        else if (arg == "-e" || arg == "--stop-on-error")
+            options.stopOnError = true;
+        else if (arg == "-v" || arg == "--verbose")
+            options.verbose = true;
+        else if (arg == "--record")
+        {
+            if (!value(options.record))
+                return false;
+        }
+        else if (arg == "--replay")
+        {
+            if (!value(options.replay))
+                return false;
+        }
+        else if (arg == "--replay-speed")
+        {
+            QString speed;
+            if (!value(speed))
+                return false;
+            bool ok;
+            options.replaySpeed = speed.toDouble(&ok);
+            if (!ok || options.replaySpeed < 0)
+            {
+                fprintf(stderr, "Invalid replay speed: %s\n", qPrintable(speed));
+                return false;
+            }
+        }
+        else if (arg == "-h" || arg == "--help")
+            return false;
+        else if (arg.startsWith("-") && arg != "-")
+        {
+            fprintf(stderr, "Unknown option: %s\n", qPrintable(arg));
+            return false;
+        }
+        else
+        {
+            options.command = args.mid(i);
+            break;
+        }
+    }
+
+    bool streamMode = options.stream || !options.script.isEmpty();
+    if (streamMode == !options.command.isEmpty())
+    {
+        fprintf(stderr, "Either a command or --stream/--script must be given\n");
+        return false;
+    }
+    if (!options.record.isEmpty() && !options.replay.isEmpty())
+    {
+        fprintf(stderr, "Options --record and --replay are mutually exclusive\n");
+        return false;
+    }
+    return true;
+}
+
+// Номер реле: 1..8 или "all" (соответствует 0, см. Relay::toggle())
+static bool parseRelayNumber(const QString& arg, int& relayNumber)
+{
+    if (arg == "all")
+    {
+        relayNumber = 0;
+        return true;
+    }
+    bool ok;
+    relayNumber = arg.toInt(&ok);
+    return (ok && relayNumber >= 1);
+}
+
+// Маска: десятичное, шестнадцатеричное (0x..) или двоичное (0b..) число
+static bool parseMask(const QString& arg, quint8& mask)
+{
+    bool ok;
+    uint val;
+    if (arg.startsWith("0b"))
+        val = arg.mid(2).toUInt(&ok, 2);
+    else
+        val = arg.toUInt(&ok, 0);
+
+    mask = quint8(val);
+    return (ok && val <= 0xFF);
+}
+
+static QString statesString(const QVector<int>& states)
+{
+    QString result;
+    for (int i = 0; i < states.count(); ++i)
+    {
+        if (i)
+            result += " ";
+        result += QString::number(states[i]);
+    }
+    return result;
+}
+
+// Исполняет команду. В случае успеха в output записывается результат команды
+// (может быть пустым), в случае ошибки - сообщение об ошибке
+static bool execute(usb::Relay& relay, const QStringList& tokens, QString& output)
+{
+    output.clear();
+    failMessage.clear();
+
+    const QString cmd = tokens.value(0).toLower();
+    const int argc = tokens.count() - 1;
+
+    if ((cmd == "on" || cmd == "off") && argc == 1)
+    {
+        int relayNumber;
+        if (!parseRelayNumber(tokens[1], relayNumber))
+        {
+            output = "Invalid relay number: " + tokens[1];
+            return false;
+        }
+        if (!relay.toggle(relayNumber, (cmd == "on")))
+        {
+            output = failMessage;
+            return false;
+        }
+        return true;
+    }
+    if (cmd == "at" && argc == 3)
+    {
+        // Переключение через delay мс от момента вызова. Выводится отклонение
+        // начала USB-транзакции от заданного момента и длительность транзакции
+        bool ok;
+        double delay = tokens[1].toDouble(&ok);
+        if (!ok || delay < 0)
+        {
+            output = "Invalid delay: " + tokens[1];
+            return false;
+        }
+        const QString state = tokens[2].toLower();
+        if (state != "on" && state != "off")
+        {
+            output = "Invalid relay state: " + tokens[2];
+            return false;
+        }
+        int relayNumber;
+        if (!parseRelayNumber(tokens[3], relayNumber))
+        {
+            output = "Invalid relay number: " + tokens[3];
+            return false;
+        }
+        quint64 deadline = usb::trace::now() + quint64(delay * 1000000);
+        usb::Relay::TimedResult result =
+            relay.toggleAt(relayNumber, (state == "on"), deadline);
+        if (!result.success)
+        {
+            output = failMessage;
+            return false;
+        }
+        output = QString("issue_error_us %1 transfer_us %2")
+                 .arg(result.issueError() / 1000.0, 0, 'f', 1)
+                 .arg((result.completeTime - result.issueTime) / 1000.0, 0, 'f', 1);
+        return true;
+    }
+    if (cmd == "group" && argc == 2)
+    {
+        quint8 mask, values;
+        if (!parseMask(tokens[1], mask) || !parseMask(tokens[2], values))
+        {
+            output = "Invalid group mask";
+            return false;
+        }
+        if (!relay.toggleGroup(mask, values))
+        {
+            output = failMessage;
+            return false;
+        }
+        return true;
+    }
+    if (cmd == "tx" && argc >= 1)
+    {
+        usb::Relay::Transaction transaction = relay.begin();
+        for (int i = 1; i <= argc; ++i)
+        {
+            // Формат изменения: <n>=<on|off>
+            QStringList change = tokens[i].split('=');
+            int relayNumber;
+            const QString state = change.value(1).toLower();
+            if (change.count() != 2
+                || !parseRelayNumber(change[0], relayNumber) || relayNumber == 0
+                || (state != "on" && state != "off")
+                || !transaction.set(relayNumber, (state == "on")))
+            {
+                output = "Invalid transaction change: " + tokens[i];
+                return false;
+            }
+        }
+        if (!relay.commit(transaction))
+        {
+            output = failMessage;
+            return false;
+        }
+        return true;
+    }
+    if (cmd == "cas" && argc == 2)
+    {
+        quint8 expected, values;
+        if (!parseMask(tokens[1], expected) || !parseMask(tokens[2], values))
+        {
+            output = "Invalid states mask";
+            return false;
+        }
+        quint8 actual = 0;
+        switch (relay.compareAndSet(expected, values, &actual))
+        {
+            case usb::Relay::CasResult::Success:
+                return true;
+            case usb::Relay::CasResult::Conflict:
+                output = QString("Conflict, actual states 0x%1")
+                         .arg(actual, 2, 16, QChar('0'));
+                return false;
+            default:
+                output = failMessage;
+                return false;
+        }
+    }
+    if (cmd == "get" && argc <= 1)
+    {
+        QVector<int> states = relay.states();
+        if (argc == 0)
+        {
+            output = statesString(states);
+            return true;
+        }
+        int relayNumber;
+        if (!parseRelayNumber(tokens[1], relayNumber)
+            || relayNumber > states.count())
+        {
+            output = "Invalid relay number: " + tokens[1];
+            return false;
+        }
+        output = (relayNumber == 0)
+                 ? statesString(states)
+                 : QString::number(states[relayNumber - 1]);
+        return true;
+    }
+    if (cmd == "info" && argc == 0)
+    {
+        output = QString("%1 %2 %3")
+                 .arg(relay.product()).arg(relay.serial()).arg(relay.count());
+        return true;
+    }
+    if (cmd == "serial" && argc == 1)
+    {
+        if (!relay.setSerial(tokens[1]))
+        {
+            output = "Failed set serial";
+            return false;
+        }
+        return true;
+    }
+    if (cmd == "sleep" && argc == 1)
+    {
+        bool ok;
+        int msec = tokens[1].toInt(&ok);
+        if (!ok || msec < 0)
+        {
+            output = "Invalid sleep interval: " + tokens[1];
+            return false;
+        }
+        QThread::msleep(msec);
+        return true;
+    }
+    output = "Unknown command or wrong arguments: " + tokens.join(" ");
+    return false;
+}
+
+// Минимальное количество команд для перевода реле из состояния prevStates
+// в expectStates, найденное полным перебором (поиск в ширину по состояниям
+// платы). Промежуточные состояния не должны затрагивать реле, состояние ко-
+// торых не меняется
+template<int N>
+static int minCommands(quint8 prevStates, quint8 expectStates)
+{
+    const quint8 allMask = usb::RelayBoard<N>::AllMask;
+    const quint8 fixed = quint8(~(prevStates ^ expectStates)) & allMask;
+
+    int distance[256];
+    std::fill(distance, distance + 256, -1);
+    int queue[256];
+    int head = 0, tail = 0;
+
+    distance[prevStates] = 0;
+    queue[tail++] = prevStates;
+    while (head < tail)
+    {
+        const int states = queue[head++];
+        if (states == expectStates)
+            return distance[states];
+
+        int next[2 + 2 * N];
+        int nextCount = 0;
+        next[nextCount++] = allMask; // 0xFE
+        next[nextCount++] = 0;       // 0xFC
+        for (int i = 0; i < N; ++i)
+        {
+            next[nextCount++] = states | (1 << i);  // 0xFF
+            next[nextCount++] = states & ~(1 << i); // 0xFD
+        }
+        for (int i = 0; i < nextCount; ++i)
+        {
+            if (((next[i] ^ prevStates) & fixed) != 0 || distance[next[i]] >= 0)
+                continue;
+            distance[next[i]] = distance[states] + 1;
+            queue[tail++] = next[i];
+        }
+    }
+    return -1;
+}
+
+// Проверяет RelayBoard<N>::planCommands() для всех пар состояний, возвращает
+// количество расхождений
+template<int N>
+static int selfCheckBoard()
+{
+    typedef usb::RelayBoard<N> Board;
+    const usb::ActiveBoardOps* ops = usb::boardOps(N);
+
+    int errors = 0;
+    for (int prev = 0; prev <= Board::AllMask; ++prev)
+        for (int expect = 0; expect <= Board::AllMask; ++expect)
+        {
+            quint8 commands[8][2];
+            const int count = Board::planCommands(quint8(prev), quint8(expect), commands);
+
+            // Исполнение плана на модели платы
+            const quint8 fixed = quint8(~(prev ^ expect)) & Board::AllMask;
+            bool valid = (count <= 8);
+            int states = prev;
+            for (int i = 0; valid && i < count; ++i)
+            {
+                const quint8 bit = Board::mask(commands[i][1]);
+                switch (commands[i][0])
+                {
+                    case 0xFE: states = Board::AllMask; valid = (i == 0); break;
+                    case 0xFC: states = 0;              valid = (i == 0); break;
+                    case 0xFF: states |= bit;  valid = (bit && commands[i][1]); break;
+                    case 0xFD: states &= ~bit; valid = (bit && commands[i][1]); break;
+                    default:   valid = false;
+                }
+                if (((states ^ prev) & fixed) != 0)
+                    valid = false;
+            }
+            const int minCount = minCommands<N>(quint8(prev), quint8(expect));
+
+            // Таблица BoardOps должна давать тот же план, что и шаблон
+            bool sameOps = true;
+            if (ops)
+            {
+                quint8 opsCommands[8][2];
+                const int opsCount = ops->planCommands(quint8(prev), quint8(expect), opsCommands);
+                sameOps = (opsCount == count)
+                          && (memcmp(opsCommands, commands, sizeof(commands[0]) * count) == 0);
+            }
+
+            if (!valid || states != expect || count != minCount || !sameOps)
+            {
+                if (errors < 10)
+                    fprintf(stderr, "Relays %d: plan %02X -> %02X failed"
+                                    " (commands %d, minimum %d%s%s)\n",
+                            N, prev, expect, count, minCount,
+                            (valid && states == expect) ? "" : ", wrong result",
+                            sameOps ? "" : ", BoardOps mismatch");
+                ++errors;
+            }
+        }
+    return errors;
+}
+
+static int runSelfCheck()
+{
+    int errors = 0;
+    errors += selfCheckBoard<1>();
+    errors += selfCheckBoard<2>();
+    errors += selfCheckBoard<4>();
+    errors += selfCheckBoard<8>();
+
+    fprintf(stdout, "Command planning: %d mismatch(es) in %d state pairs\n",
+            errors, 2*2 + 4*4 + 16*16 + 256*256);
+    return (errors == 0) ? 0 : 1;
+}
+
+static int runBenchEnum(const QStringList& args)
+{
+    using namespace std::chrono;
+
+    bool ok1 = true, ok2 = true, ok3 = true;
+    const int devices = (args.count() > 1) ? args[1].toInt(&ok1) : 500;
+    const int boards  = (args.count() > 2) ? args[2].toInt(&ok2) : 32;
+    const int delay   = (args.count() > 3) ? args[3].toInt(&ok3) : 0;
+    if (!ok1 || !ok2 || !ok3 || devices < 0 || boards < 1 || delay < 0)
+    {
+        fputs(usageText, stderr);
+        return 2;
+    }
+
+    // Платы распределяются равномерно среди посторонних устройств
+    std::shared_ptr<usb::SimBus> bus {new usb::SimBus};
+    QStringList serials;
+    const int total = devices + boards;
+    for (int i = 0, board = 0; i < total; ++i)
+    {
+        if (board < boards && (i + 1) * boards / total > board)
+        {
+            QString serial = QString("B%1").arg(board, 4, 10, QChar('0'));
+            bus->addRelayBoard(serial, 8);
+            serials.append(serial);
+            ++board;
+        }
+        else
+            bus->addDevice(0x1000 + (i % 0x100), 0x2000 + i);
+    }
+    bus->setTransferDelay(delay);
+
+    fprintf(stdout, "Simulated bus: %d devices (%d relay boards)"
+                    ", access delay %d usec\n", bus->count(), boards, delay);
+
+    // Платы подключаются в обратном порядке: для каждой  платы  перечисление
+    // проходит через все предшествующие ей незахваченные платы
+    std::vector<std::unique_ptr<usb::Relay>> relays;
+    QVector<double> attachTimes;
+    quint64 allocs = 0;
+    bus->resetStats();
+
+    for (int i = serials.count() - 1; i >= 0; --i)
+    {
+        relays.emplace_back(new usb::Relay);
+        usb::Relay* relay = relays.back().get();
+        relay->setTransport(new usb::SimTransport(bus));
+        relay->setAttachSerial(serials[i]);
+        relay->init();
+
+        std::atomic<qint64> attachTime = {0};
+        QObject::connect(relay, &usb::Relay::attached,
+                         [&attachTime]()
+                         {
+                             attachTime = steady_clock::now().time_since_epoch().count();
+                         });
+
+        quint64 allocStart = allocCount;
+        steady_clock::time_point start = steady_clock::now();
+        relay->start();
+
+        while (attachTime == 0)
+        {
+            if (steady_clock::now() - start > seconds(10))
+            {
+                fprintf(stderr, "Failed attach board %s\n", qPrintable(serials[i]));
+                for (std::unique_ptr<usb::Relay>& relay : relays)
+                    relay->stop();
+                return 1;
+            }
+            QThread::usleep(100);
+        }
+        allocs += allocCount - allocStart;
+
+        steady_clock::time_point finish {steady_clock::duration(qint64(attachTime))};
+        attachTimes.append(duration_cast<microseconds>(finish - start).count() / 1000.0);
+        QObject::disconnect(relay, &usb::Relay::attached, nullptr, nullptr);
+    }
+
+    usb::SimBus::Stats stats = bus->stats();
+    for (std::unique_ptr<usb::Relay>& relay : relays)
+        relay->stop();
+
+    double sum = 0, minTime = attachTimes[0], maxTime = attachTimes[0];
+    for (double time : attachTimes)
+    {
+        sum += time;
+        minTime = qMin(minTime, time);
+        maxTime = qMax(maxTime, time);
+    }
+    const double n = attachTimes.count();
+
+    fprintf(stdout, "Attach time, ms:  min %.3f  avg %.3f  max %.3f\n",
+            minTime, sum / n, maxTime);
+    fprintf(stdout, "Per attach:  device lists %.1f  opens %.1f"
+                    "  string descriptors %.1f  control transfers %.1f"
+                    "  claims %.1f",
+            stats.deviceLists / n, stats.opens / n, stats.stringDescriptors / n,
+            stats.controlTransfers / n, stats.claims / n);
+    if (allocCountEnabled)
+        fprintf(stdout, "  allocations %.1f\n", allocs / n);
+    else
+        fprintf(stdout, "  allocations n/a\n");
+    return 0;
+}
+
+static int runBenchLatency(const QStringList& args)
+{
+    using namespace std::chrono;
+
+    bool ok1 = true, ok2 = true, ok3 = true, ok4 = true, ok5 = true, ok6 = true;
+    const int commands = (args.count() > 1) ? args[1].toInt(&ok1) : 10000;
+    const int stress   = (args.count() > 2) ? args[2].toInt(&ok2)
+                                            : int(std::thread::hardware_concurrency());
+    const int priority = (args.count() > 3) ? args[3].toInt(&ok3) : 0;
+    const int cpu      = (args.count() > 4) ? args[4].toInt(&ok4) : -1;
+
+    // Пороги проверки, отрицательное значение - проверка не выполняется
+    const double maxP999   = (args.count() > 5) ? args[5].toDouble(&ok5) : -1;
+    const double maxAllocs = (args.count() > 6) ? args[6].toDouble(&ok6) : -1;
+    if (!ok1 || !ok2 || !ok3 || !ok4 || !ok5 || !ok6
+        || commands < 1 || stress < 0 || priority < 0)
+    {
+        fputs(usageText, stderr);
+        return 2;
+    }
+
+    std::shared_ptr<usb::SimBus> bus {new usb::SimBus};
+    bus->addRelayBoard("LAT01", 8);
+
+    usb::Relay relay;
+    relay.setTransport(new usb::SimTransport(bus));
+    relay.setQueueCapacity(usb::Relay::CommandRingSize);
+    if (priority > 0)
+    {
+        usb::Relay::RealtimeConfig config;
+        config.enabled = true;
+        config.priority = priority;
+        config.cpu = cpu;
+        relay.setRealtime(config);
+    }
+    relay.init();
+
+    std::atomic_bool attached = {false};
+    QObject::connect(&relay, &usb::Relay::attached, [&attached]() {attached = true;});
+    relay.start();
+
+    steady_clock::time_point start = steady_clock::now();
+    while (!attached)
+    {
+        if (steady_clock::now() - start > seconds(10))
+        {
+            fprintf(stderr, "Failed attach simulated board\n");
+            relay.stop();
+            return 1;
+        }
+        QThread::usleep(100);
+    }
+
+    std::atomic_bool stressStop = {false};
+    std::vector<std::thread> stressThreads;
+    for (int i = 0; i < stress; ++i)
+        stressThreads.emplace_back([&stressStop]()
+        {
+            volatile quint64 counter = 0;
+            while (!stressStop.load(std::memory_order_relaxed))
+                counter = counter + 1;
+        });
+
+    fprintf(stdout, "Commands: %d, stress threads: %d, real-time: %s\n",
+            commands, stress, (priority > 0) ? "on" : "off");
+
+    // Записи истории вычитываются пакетами, размер пакета меньше емкости
+    // кольцевого буфера истории
+    const int batch = usb::StateHistory::Capacity / 4;
+    QVector<quint32> latencies;
+    latencies.reserve(commands);
+    relay.history().drain();
+
+    quint64 allocs = 0;
+    quint64 allocStart = allocCount;
+    quint64 version = relay.stateVersion();
+    int failed = 0;
+
+    for (int i = 0; i < commands; ++i)
+    {
+        relay.post(1, (i % 2) == 0);
+        quint64 newVersion = relay.waitForChange(version, 1000);
+        if (newVersion == version)
+            ++failed;
+        version = newVersion;
+
+        if ((i + 1) % batch == 0 || i + 1 == commands)
+        {
+            allocs += allocCount - allocStart;
+            for (const usb::StateChange& change : relay.history().drain())
+                if (change.tag != usb::Relay::ExternalTag && change.latency != 0)
+                    latencies.append(change.latency);
+            allocStart = allocCount;
+        }
+    }
+
+    stressStop = true;
+    for (std::thread& thread : stressThreads)
+        thread.join();
+
+    usb::Relay::Stats stats = relay.stats();
+    relay.stop();
+
+    if (latencies.isEmpty())
+    {
+        fprintf(stderr, "No command latencies recorded\n");
+        return 1;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) -> double
+    {
+        int index = qMin(int(latencies.count() * p), latencies.count() - 1);
+        return latencies[index] / 1000.0;
+    };
+    double sum = 0;
+    for (quint32 latency : latencies)
+        sum += latency;
+
+    fprintf(stdout, "Command latency, ms:  min %.3f  avg %.3f  p99 %.3f"
+                    "  p99.9 %.3f  max %.3f\n",
+            latencies.first() / 1000.0, sum / latencies.count() / 1000.0,
+            percentile(0.99), percentile(0.999), latencies.last() / 1000.0);
+    fprintf(stdout, "Timeouts %d  failures %llu  retries %llu",
+            failed, (unsigned long long)stats.commandFailures,
+            (unsigned long long)stats.retries);
+    if (allocCountEnabled)
+        fprintf(stdout, "  allocations per command %.2f\n", double(allocs) / commands);
+    else
+        fprintf(stdout, "  allocations per command n/a\n");
+
+    bool passed = true;
+    if (maxP999 >= 0 && percentile(0.999) > maxP999)
+    {
+        fprintf(stdout, "FAIL: p99.9 latency %.3f ms exceeds %.3f ms\n",
+                percentile(0.999), maxP999);
+        passed = false;
+    }
+    if (maxAllocs >= 0)
+    {
+        if (!allocCountEnabled)
+        {
+            fprintf(stdout, "FAIL: allocation threshold given, but allocation"
+                            " counting is not built in\n");
+            passed = false;
+        }
+        else if (double(allocs) / commands > maxAllocs)
+        {
+            fprintf(stdout, "FAIL: %.2f allocations per command exceeds %.2f\n",
+                    double(allocs) / commands, maxAllocs);
+            passed = false;
+        }
+    }
+    if (maxP999 >= 0 || maxAllocs >= 0)
+        fprintf(stdout, "%s\n", (passed) ? "PASS" : "FAIL");
+    return (passed) ? 0 : 1;
+}
+
+// Операция, выполненная потоком в режиме bench-stress
+struct StressOp
+{
+    enum Type : quint8 {Write, Read};
+
+    Type    type;
+    bool    success;
+    quint8  mask;     // Write: маска изменяемых реле
+    quint8  values;   // Write: требуемые состояния; Read: прочитанные состояния
+    int     tag;      // Write: уникальный идентификатор операции
+    quint64 before;   // Версия состояний до вызова
+    quint64 after;    // Версия состояний после возврата (Read: прочитанная
+                      // вместе с состояниями)
+    quint64 invoke;   // Время вызова и возврата по steady_clock, нс. Не
+    quint64 response; // зависят от учета версий в драйвере
+};
+
+static quint64 stressClock()
+{
+    using namespace std::chrono;
+    return quint64(duration_cast<nanoseconds>(
+                   steady_clock::now().time_since_epoch()).count());
+}
+
+static int runBenchStress(const QStringList& args)
+{
+    using namespace std::chrono;
+
+    bool ok1 = true, ok2 = true;
+    const int threads = (args.count() > 1) ? args[1].toInt(&ok1) : 8;
+    const int seconds = (args.count() > 2) ? args[2].toInt(&ok2) : 5;
+    if (!ok1 || !ok2 || threads < 1 || threads > 127 || seconds < 1)
+    {
+        fputs(usageText, stderr);
+        return 2;
+    }
+
+    const QString serial = "STR01";
+    std::shared_ptr<usb::SimBus> bus {new usb::SimBus};
+    bus->addRelayBoard(serial, 8);
+
+    usb::Relay relay;
+    relay.setTransport(new usb::SimTransport(bus));
+    relay.setPollInterval(1, 10);
+    relay.init();
+
+    std::atomic_bool attached = {false};
+    QObject::connect(&relay, &usb::Relay::attached, [&attached]() {attached = true;});
+    relay.start();
+
+    steady_clock::time_point start = steady_clock::now();
+    while (!attached)
+    {
+        if (steady_clock::now() - start > std::chrono::seconds(10))
+        {
+            fprintf(stderr, "Failed attach simulated board\n");
+            relay.stop();
+            return 1;
+        }
+        QThread::usleep(100);
+    }
+
+    // Начальное состояние и вычитка истории, накопленной при подключении.
+    // Журнал имитируемой платы включается до запуска рабочих потоков
+    quint64 initVersion;
+    const QVector<int> initStates = relay.states(&initVersion);
+    relay.history().drain();
+    bus->setStateLog(true);
+
+    // История изменений состояний вычитывается отдельным потоком, чтобы
+    // кольцевой буфер не переполнялся
+    std::atomic_bool stop = {false};
+    std::atomic_bool collectorStop = {false};
+    QVector<usb::StateChange> history;
+    quint64 historyLost = 0;
+    std::thread collector([&]()
+    {
+        while (true)
+        {
+            bool last = collectorStop;
+            quint64 lost = 0;
+            history += relay.history().drain(&lost);
+            historyLost += lost;
+            if (last)
+                break;
+            QThread::usleep(100);
+        }
+    });
+
+    std::vector<std::vector<StressOp>> ops (threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+        workers.emplace_back([&, t]()
+        {
+            std::mt19937 random {quint32(t + 1)};
+            std::vector<StressOp>& log = ops[t];
+            int seq = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                StressOp op;
+                const int kind = int(random() % 100);
+                if (kind < 45)
+                {
+                    op.type = StressOp::Write;
+                    op.tag = (t + 1) << 24 | (++seq & 0xFFFFFF);
+                    op.invoke = stressClock();
+                    op.before = relay.stateVersion();
+                    if (kind < 10)
+                    {
+                        int relayNumber = int(random() % 9);
+                        bool value = random() & 1;
+                        op.mask = (relayNumber == 0) ? 0xFF
+                                                     : quint8(1U << (relayNumber - 1));
+                        op.values = value ? op.mask : 0;
+                        op.success = relay.toggle(relayNumber, value, op.tag);
+                    }
+                    else
+                    {
+                        op.mask = quint8(random() | 1);
+                        op.values = quint8(random());
+                        op.success = relay.toggleGroup(op.mask, op.values, op.tag);
+                    }
+                    op.after = relay.stateVersion();
+                    op.response = stressClock();
+                }
+                else if (kind < 99)
+                {
+                    op.type = StressOp::Read;
+                    op.invoke = stressClock();
+                    op.before = relay.stateVersion();
+                    QVector<int> states = relay.states(&op.after);
+                    op.response = stressClock();
+                    op.values = 0;
+                    for (int i = 0; i < states.count(); ++i)
+                        if (states[i])
+                            op.values |= quint8(1U << i);
+                    op.success = (states.count() == 8);
+                }
+                else
+                {
+                    // Запись серийного номера выполняет обмен с платой
+                    // параллельно с командами переключения
+                    relay.setSerial(serial);
+                    continue;
+                }
+                log.push_back(op);
+            }
+        });
+
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    stop = true;
+    for (std::thread& worker : workers)
+        worker.join();
+    collectorStop = true;
+    collector.join();
+
+    const double elapsed =
+        duration_cast<microseconds>(steady_clock::now() - start).count() / 1e6;
+    relay.stop();
+
+    int violations = 0;
+    int historyViolations = 0;
+    auto violation = [](int& counter, const char* message, const char* unit,
+                        quint64 value)
+    {
+        if (counter++ < 10)
+            fprintf(stderr, "Violation: %s (%s %llu)\n",
+                    message, unit, (unsigned long long)value);
+    };
+
+    // Линеаризуемость проверяется по журналу имитируемой платы и по времени
+    // вызова/возврата операций, без опоры на версии и историю драйвера.
+    // Каждой успешной операции сопоставляется позиция в журнале: состояние
+    // платы, действовавшее в какой-либо момент между вызовом и возвратом,
+    // и удовлетворяющее операции (чтение - совпадает с прочитанным, запись -
+    // содержит записанные значения). Если операция A завершилась до вызова
+    // операции B (в любых потоках), позиция B не может быть меньше позиции A.
+    // Выбирается наименьшая допустимая позиция, поэтому ошибка  фиксируется
+    // только если допустимой позиции не существует
+    const QVector<usb::SimBus::StateRecord> timeline = bus->stateLog();
+    auto position = [&timeline](quint64 time) -> int
+    {
+        auto it = std::upper_bound(timeline.begin(), timeline.end(), time,
+            [](quint64 t, const usb::SimBus::StateRecord& r) {return t < r.time;});
+        return qMax(int(it - timeline.begin()) - 1, 0);
+    };
+
+    std::vector<const StressOp*> realtime;
+    for (const std::vector<StressOp>& log : ops)
+        for (const StressOp& op : log)
+            if (op.success)
+                realtime.push_back(&op);
+    std::sort(realtime.begin(), realtime.end(),
+              [](const StressOp* a, const StressOp* b) {return a->invoke < b->invoke;});
+
+    typedef std::pair<quint64, int> Completed; // Время возврата, позиция
+    std::priority_queue<Completed, std::vector<Completed>,
+                        std::greater<Completed>> completed;
+    int floor = 0;
+    for (const StressOp* op : realtime)
+    {
+        while (!completed.empty() && completed.top().first < op->invoke)
+        {
+            floor = qMax(floor, completed.top().second);
+            completed.pop();
+        }
+        auto satisfied = [op](quint8 states)
+        {
+            return (op->type == StressOp::Read)
+                   ? states == op->values
+                   : ((states ^ op->values) & op->mask) == 0;
+        };
+
+        const int lo = position(op->invoke);
+        const int hi = position(op->response);
+        int found = -1;
+        for (int p = qMax(lo, floor); p <= hi && found < 0; ++p)
+            if (satisfied(timeline[p].states))
+                found = p;
+
+        if (found < 0)
+        {
+            bool inInterval = false;
+            for (int p = lo; p <= hi && !inInterval; ++p)
+                inInterval = satisfied(timeline[p].states);
+
+            const quint64 at = (op->invoke - timeline[0].time) / 1000;
+            if (inInterval)
+                violation(violations, "operation observes a state older than"
+                          " an operation completed before its call", "usec", at);
+            else if (op->type == StressOp::Read)
+                violation(violations, "read states were not current during"
+                          " the call", "usec", at);
+            else
+                violation(violations, "write has no linearization point"
+                          " during the call", "usec", at);
+            continue;
+        }
+        completed.push({op->response, found});
+    }
+
+    // Согласованность истории изменений драйвера (см. StateHistory) с версиями
+    // состояний и с журналом платы. Версия initVersion соответствует началу
+    // проверки, последующие версии восстанавливаются по истории изменений
+    quint8 initMask = 0;
+    for (int i = 0; i < initStates.count(); ++i)
+        if (initStates[i])
+            initMask |= quint8(1U << i);
+
+    QVector<quint8> statesAt {initMask};
+    QHash<int, quint64> tagVersion;
+    for (const usb::StateChange& change : history)
+    {
+        if (change.version != initVersion + quint64(statesAt.count()))
+        {
+            violation(historyViolations, "history is not contiguous",
+                      "version", change.version);
+            break;
+        }
+        if (change.oldStates != statesAt.last())
+            violation(historyViolations, "history record does not continue"
+                      " previous state", "version", change.version);
+        statesAt.append(change.newStates);
+        tagVersion.insert(change.tag, change.version);
+    }
+    if (!timeline.isEmpty() && statesAt.last() != timeline.last().states)
+        violation(historyViolations, "final history state differs from board",
+                  "version", initVersion + quint64(statesAt.count()) - 1);
+
+    const quint64 lastVersion = initVersion + quint64(statesAt.count()) - 1;
+    auto stateAt = [&](quint64 version) -> int
+    {
+        if (version < initVersion || version > lastVersion)
+            return -1;
+        return statesAt[int(version - initVersion)];
+    };
+
+    quint64 writes = 0, reads = 0, failures = 0;
+    for (const std::vector<StressOp>& log : ops)
+    {
+        quint64 prevRead = initVersion;
+        for (const StressOp& op : log)
+        {
+            if (!op.success)
+            {
+                ++failures;
+                continue;
+            }
+            if (op.type == StressOp::Read)
+            {
+                // Версия, прочитанная вместе с состояниями, соответствует им,
+                // не меньше версии до вызова и не убывает
+                ++reads;
+                if (op.after < op.before || op.after < prevRead)
+                    violation(historyViolations, "read version goes back in time",
+                              "version", op.after);
+                if (stateAt(op.after) != op.values)
+                    violation(historyViolations, "read states do not match history",
+                              "version", op.after);
+                prevRead = op.after;
+                continue;
+            }
+
+            // Запись операции в истории находится между версиями до вызова
+            // и после возврата
+            ++writes;
+            if (tagVersion.contains(op.tag))
+            {
+                quint64 version = tagVersion[op.tag];
+                if (version <= op.before || version > op.after)
+                    violation(historyViolations, "write is outside of its call"
+                              " interval", "version", version);
+                else if (((stateAt(version) ^ op.values) & op.mask) != 0)
+                    violation(historyViolations, "write result does not match"
+                              " request", "version", version);
+            }
+        }
+    }
+
+    fprintf(stdout, "Threads %d  time %.1f s  writes %llu  reads %llu"
+                    "  state changes %d\n",
+            threads, elapsed, (unsigned long long)writes,
+            (unsigned long long)reads, statesAt.count() - 1);
+    fprintf(stdout, "Throughput, ops/s:  writes %.0f  reads %.0f  total %.0f\n",
+            writes / elapsed, reads / elapsed, (writes + reads) / elapsed);
+    fprintf(stdout, "Failed operations %llu  history records lost %llu"
+                    "  history violations %d  linearizability violations %d\n",
+            (unsigned long long)failures, (unsigned long long)historyLost,
+            historyViolations, violations);
+
+    return (violations == 0 && historyViolations == 0
+            && historyLost == 0 && failures == 0) ? 0 : 1;
+}
+
+static bool attach(usb::Relay& relay, const Options& options)
+{
+    relay.setAttachSerial(options.serial);
+    if (!relay.init())
+        return false;
+
+    relay.start();
+
+    QElapsedTimer timer;
+    timer.start();
+    while (!relay.isAttached())
+    {
+        if (timer.elapsed() > options.attachTimeout)
+        {
+            fprintf(stderr, "Failed attach USB relay board%s\n",
+                    options.serial.isEmpty()
+                        ? ""
+                        : qPrintable(" with serial " + options.serial));
+            return false;
+        }
+        QThread::msleep(10);
+    }
+    return true;
+}
+
+static int runStream(usb::Relay& relay, const Options& options)
+{
+    QFile file;
+    if (options.script.isEmpty() || options.script == "-")
+    {
+        if (!file.open(stdin, QIODevice::ReadOnly))
+            return 1;
+    }
+    else
+    {
+        file.setFileName(options.script);
+        if (!file.open(QIODevice::ReadOnly))
+        {
+            fprintf(stderr, "Failed open script file %s: %s\n",
+                    qPrintable(options.script), qPrintable(file.errorString()));
+            return 1;
+        }
+    }
+
+    int result = 0;
+    int lineNumber = 0;
+    QElapsedTimer timer;
+
+    while (!file.atEnd())
+    {
+        QString line = QString::fromUtf8(file.readLine()).trimmed();
+        ++lineNumber;
+
+        if (line.isEmpty() || line.startsWith("#"))
+            continue;
+        if (line == "quit" || line == "exit")
+            break;
+
+        QStringList tokens = line.split(QRegularExpression("\\s+"));
+
+        timer.start();
+        QString output;
+        bool success = execute(relay, tokens, output);
+        double msec = timer.nsecsElapsed() / 1000000.0;
+
+        fprintf(stdout, "%d %s %.3f%s%s\n", lineNumber,
+                success ? "ok" : "error", msec,
+                output.isEmpty() ? "" : " ", qPrintable(output));
+        fflush(stdout);
+
+        if (!success)
+        {
+            result = 1;
+            if (options.stopOnError)
+                break;
+        }
+    }
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app {argc, argv};
+
+    if (app.arguments().value(1) == "self-check")
+        return runSelfCheck();
+
+    if (app.arguments().value(1) == "bench-enum")
+    {
+        alog::logger().start();
+        int result = runBenchEnum(app.arguments().mid(1));
+        alog::stop();
+        return result;
+    }
+    if (app.arguments().value(1) == "bench-latency")
+    {
+        alog::logger().start();
+        int result = runBenchLatency(app.arguments().mid(1));
+        alog::stop();
+        return result;
+    }
+    if (app.arguments().value(1) == "bench-stress")
+    {
+        alog::logger().start();
+        int result = runBenchStress(app.arguments().mid(1));
+        alog::stop();
+        return result;
+    }
+
+    Options options;
+    if (!parseOptions(app.arguments(), options))
+    {
+        fputs(usageText, stderr);
+        return 2;
+    }
+
+    alog::logger().start();
+    if (options.verbose)
+        alog::logger().addSaverStdOut(alog::Level::Debug);
+
+    usb::Relay relay;
+    QObject::connect(&relay, &usb::Relay::failChange,
+                     [](int, const QString& errorMessage, int)
+                     {
+                         failMessage = errorMessage;
+                     });
+
+    // Транспорт переходит во владение relay, указатель используется для
+    // получения итогов воспроизведения
+    usb::ReplayTransport* replay = nullptr;
+    if (!options.record.isEmpty())
+    {
+        usb::RecordTransport* record =
+            new usb::RecordTransport(new usb::LibusbTransport, options.record);
+        relay.setTransport(record);
+        if (!record->isRecording())
+        {
+            fprintf(stderr, "Failed open record file %s\n", qPrintable(options.record));
+            alog::stop();
+            return 1;
+        }
+    }
+    else if (!options.replay.isEmpty())
+    {
+        replay = new usb::ReplayTransport(options.replay, options.replaySpeed);
+        relay.setTransport(replay);
+        if (!replay->isLoaded())
+        {
+            fprintf(stderr, "Failed load replay file %s\n", qPrintable(options.replay));
+            alog::stop();
+            return 1;
+        }
+    }
+
+    int result = 1;
+    if (attach(relay, options))
+    {
+        if (options.command.isEmpty())
+        {
+            result = runStream(relay, options);
+        }
+        else
+        {
+            QString output;
+            result = execute(relay, options.command, output) ? 0 : 1;
+            if (!output.isEmpty())
+                fprintf(result ? stderr : stdout, "%s\n", qPrintable(output));
+        }
+    }
+
+    relay.stop();
+    relay.deinit();
+
+    if (replay)
+    {
+        fprintf(stderr, "Replay: %d of %d records, %d mismatches\n",
+                replay->position(), replay->count(), replay->mismatches());
+        if (replay->mismatches() != 0)
+            result = 1;
+    }
+
+    alog::logger().flush();
+    alog::logger().waitingFlush();
+    alog::stop();
+    return result;
+}
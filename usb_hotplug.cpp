@@ -0,0 +1,177 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#include "usb_hotplug.h"
+#include "usb_relay.h"
+
+#include "shared/logger/logger.h"
+#include "shared/logger/format.h"
+#include "shared/qt/logger_operators.h"
+
+#define log_error_m   alog::logger().error   (alog_line_location, "UsbHotplug")
+#define log_warn_m    alog::logger().warn    (alog_line_location, "UsbHotplug")
+#define log_info_m    alog::logger().info    (alog_line_location, "UsbHotplug")
+#define log_verbose_m alog::logger().verbose (alog_line_location, "UsbHotplug")
+#define log_debug_m   alog::logger().debug   (alog_line_location, "UsbHotplug")
+#define log_debug2_m  alog::logger().debug2  (alog_line_location, "UsbHotplug")
+
+#define USB_RELAY_VENDOR_ID      0x16c0
+#define USB_RELAY_DEVICE_ID      0x05df
+
+namespace usb {
+
+HotplugMonitor::~HotplugMonitor()
+{
+    stopMonitor();
+}
+
+bool HotplugMonitor::subscribe(Relay* relay, int busNumber, int deviceNumber)
+{
+    QMutexLocker locker {&_lock}; (void) locker;
+
+    if (_context == nullptr && !startMonitor())
+        return false;
+
+    for (Subscriber& s : _subscribers)
+        if (s.relay == relay)
+        {
+            s.busNumber = busNumber;
+            s.deviceNumber = deviceNumber;
+            return true;
+        }
+
+    _subscribers.append({relay, busNumber, deviceNumber});
+    return true;
+}
+
+void HotplugMonitor::unsubscribe(Relay* relay)
+{
+    QMutexLocker locker {&_lock}; (void) locker;
+
+    for (int i = 0; i < _subscribers.count(); ++i)
+        if (_subscribers[i].relay == relay)
+        {
+            _subscribers.remove(i);
+            break;
+        }
+}
+
+bool HotplugMonitor::startMonitor()
+{
+    libusb_context* context;
+    int res = libusb_init(&context);
+    if (res != LIBUSB_SUCCESS)
+    {
+        log_error_m << "Failed libusb init"
+                    << ". Error code: " << res
+                    << ". Detail: " << libusb_error_name(res);
+        return false;
+    }
+
+    res = libusb_hotplug_register_callback(
+                context, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_NO_FLAGS,
+                USB_RELAY_VENDOR_ID, USB_RELAY_DEVICE_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+                deviceLeft, this, &_callbackHandle);
+    if (res != LIBUSB_SUCCESS)
+    {
+        log_error_m << "Failed register hotplug callback"
+                    << ". Error code: " << res
+                    << ". Detail: " << libusb_error_name(res);
+        libusb_exit(context);
+        return false;
+    }
+
+    _context = context;
+    start();
+    return true;
+}
+
+void HotplugMonitor::stopMonitor()
+{
+    stop();
+
+    libusb_context* context = _context.exchange(nullptr);
+    if (context)
+    {
+        libusb_hotplug_deregister_callback(context, _callbackHandle);
+        libusb_exit(context);
+    }
+}
+
+void HotplugMonitor::run()
+{
+    log_verbose_m << "Started";
+
+    while (true)
+    {
+        CHECK_QTHREADEX_STOP
+
+        // Ожидание прерывается функцией threadStopEstablished()
+        timeval tv = {60, 0};
+        int res = libusb_handle_events_timeout_completed(_context, &tv, nullptr);
+        if (res != LIBUSB_SUCCESS && res != LIBUSB_ERROR_INTERRUPTED)
+        {
+            log_error_m << "Failed handle USB events"
+                        << ". Error code: " << res
+                        << ". Detail: " << libusb_error_name(res);
+            msleep(100);
+        }
+    }
+
+    log_verbose_m << "Stopped";
+}
+
+void HotplugMonitor::threadStopEstablished()
+{
+    if (libusb_context* context = _context)
+        libusb_interrupt_event_handler(context);
+}
+
+int LIBUSB_CALL HotplugMonitor::deviceLeft(libusb_context*, libusb_device* device,
+                                           libusb_hotplug_event, void* userData)
+{
+    HotplugMonitor* monitor = static_cast<HotplugMonitor*>(userData);
+
+    int busNumber = libusb_get_bus_number(device);
+    int deviceNumber = libusb_get_device_address(device);
+
+    QMutexLocker locker {&monitor->_lock}; (void) locker;
+    for (const Subscriber& s : monitor->_subscribers)
+        if (s.busNumber == busNumber && s.deviceNumber == deviceNumber)
+        {
+            log_verbose_m << log_format(
+                "USB device %?/%? left", busNumber, deviceNumber);
+            s.relay->deviceLeft();
+        }
+
+    return 0; // Callback-функция остается зарегистрированной
+}
+
+HotplugMonitor& hotplugMonitor()
+{
+    return safe::singleton<HotplugMonitor>();
+}
+
+} // namespace usb
@@ -0,0 +1,88 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#pragma once
+
+#include "shared/defmac.h"
+#include "shared/safe_singleton.h"
+#include "shared/qt/qthreadex.h"
+
+#include <QtCore>
+#include <atomic>
+#include <libusb-1.0/libusb.h>
+
+namespace usb {
+
+class Relay;
+
+/**
+  Отслеживание отключения плат реле от USB-порта. Использует механизм hotplug
+  библиотеки libusb, события обрабатываются в отдельном потоке  (один  поток
+  на процесс, запускается при первой подписке). При отключении  устройства
+  подписанный на него экземпляр Relay уведомляется немедленно, без ожидания
+  ошибок обмена с устройством
+*/
+class HotplugMonitor : public QThreadEx
+{
+public:
+    // Подписывает relay на событие отключения устройства с адресом
+    // busNumber/deviceNumber
+    bool subscribe(Relay* relay, int busNumber, int deviceNumber);
+    void unsubscribe(Relay* relay);
+
+private:
+    Q_OBJECT
+    HotplugMonitor() = default;
+    ~HotplugMonitor();
+    DISABLE_DEFAULT_COPY(HotplugMonitor)
+
+    bool startMonitor();
+    void stopMonitor();
+
+    void run() override;
+    void threadStopEstablished() override;
+
+    static int LIBUSB_CALL deviceLeft(libusb_context*, libusb_device*,
+                                      libusb_hotplug_event, void* userData);
+
+private:
+    struct Subscriber
+    {
+        Relay* relay;
+        int    busNumber;
+        int    deviceNumber;
+    };
+    QVector<Subscriber> _subscribers;
+    mutable QMutex _lock;
+
+    std::atomic<libusb_context*> _context = {nullptr};
+    libusb_hotplug_callback_handle _callbackHandle = {0};
+
+    template<typename T, int> friend T& safe::singleton();
+};
+
+HotplugMonitor& hotplugMonitor();
+
+} // namespace usb
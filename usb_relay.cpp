@@ -24,14 +24,30 @@
 *****************************************************************************/
 
 #include "usb_relay.h"
+#include "usb_relay_board.h"
+#include "usb_hotplug.h"
+#include "usb_relay_reactor.h"
+#include "usb_relay_trace.h"
 
 #include "shared/utils.h"
 #include "shared/logger/logger.h"
 #include "shared/logger/format.h"
 #include "shared/qt/logger_operators.h"
 
+#include <chrono>
+#include <future>
+#include <limits>
+#include <random>
+#include <errno.h>
+#include <poll.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 
 #define log_error_m   alog::logger().error   (alog_line_location, "UsbRelay")
 #define log_warn_m    alog::logger().warn    (alog_line_location, "UsbRelay")
@@ -49,17 +65,73 @@
 #define USB_CONTINUOUS_ERRORS_1  3
 #define USB_CONTINUOUS_ERRORS_2  5
 
+#define TIMED_SPIN_WINDOW        200*1000  // Активное ожидание, нс
+
+#define PROBE_THREADS            8       // Потоков для параллельного опроса плат
+#define PROBE_CACHE_TTL          10*1000 // Время жизни результата опроса, мс
+
 namespace usb {
 
 // Допустимый диапазон имен  [USBRelay1...USBRelay8]
 static const char* baseProductName = "USBRelay";
 
+// Устройства, захваченные экземплярами Relay текущего процесса. Ключ: номер
+// шины и адрес устройства на шине
+static QMutex claimedDevicesLock;
+static QSet<int> claimedDevices;
+
+// Ожидание момента time (нс, см. trace::now()). Часы steady_clock в Linux
+// соответствуют CLOCK_MONOTONIC
+static void sleepUntil(quint64 time)
+{
+    timespec ts;
+    ts.tv_sec = time_t(time / 1000000000);
+    ts.tv_nsec = long(time % 1000000000);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+}
+
+// Признаки рабочего потока, переведенного в режим реального времени (см.
+// Relay::applyRealtime()). Команды в таком потоке исполняются без записи в
+// лог, сигналы эмитируются только при RealtimeConfig::emitSignals
+static thread_local bool realtimeThread = false;
+static thread_local bool realtimeSignals = false;
+
+static int deviceKey(int busNumber, int deviceNumber)
+{
+    return (busNumber << 8) | deviceNumber;
+}
+
+// Результаты опроса плат при перечислении устройств. Позволяют экземплярам
+// Relay не открывать повторно платы с несовпадающим серийным номером. Ключ:
+// номер шины и адрес устройства на шине
+static QMutex probeCacheLock;
+static QHash<int, Relay::ProbeResult> probeCache;
+
+Relay::Relay()
+{
+    for (int i = 0; i < CommandRingSize; ++i)
+        _commandRing[i].seq.store(quint64(i), std::memory_order_relaxed);
+
+    for (int i = 0; i < LatencyBuckets; ++i)
+        _transferLatency[i].store(0, std::memory_order_relaxed);
+
+    _eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_eventFd < 0)
+        log_error_m << "Failed create eventfd. Error: " << strerror(errno);
+}
+
+Relay::~Relay()
+{
+    if (_eventFd >= 0)
+        close(_eventFd);
+}
+
 bool Relay::init(const QVector<int>& states)
 {
     QMutexLocker locker {&_threadLock}; (void) locker;
 
     _initStates = states;
-    int res = libusb_init(&_context);
+    int res = _transport->init();
     if (res != LIBUSB_SUCCESS)
     {
         log_error_m << "Failed libusb init"
@@ -72,11 +144,296 @@ bool Relay::init(const QVector<int>& states)
 
 void Relay::deinit()
 {
-    if (_context)
+    _transport->deinit();
+}
+
+void Relay::setTransport(Transport* transport)
+{
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    _transport.reset(transport);
+}
+
+int Relay::pollInterval() const
+{
+    return pollSuspended() ? 0 : int(_pollInterval);
+}
+
+void Relay::setPollInterval(int minMsec, int maxMsec)
+{
+    _pollIntervalMin = qMax(minMsec, 10);
+    _pollIntervalMax = qMax(maxMsec, int(_pollIntervalMin));
+    _pollInterval = int(_pollIntervalMin);
+}
+
+void Relay::resetPollInterval()
+{
+    if (_pollInterval != _pollIntervalMin)
+    {
+        _pollInterval = int(_pollIntervalMin);
+        wakeWorker();
+    }
+}
+
+void Relay::wakeWorker()
+{
+    if (RelayReactor* reactor = _reactor.load(std::memory_order_acquire))
+    {
+        reactor->wake();
+        return;
+    }
+    if (_eventFd < 0)
+        return;
+
+    quint64 val = 1;
+    if (write(_eventFd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+        log_error_m << "Failed write to eventfd. Error: " << strerror(errno);
+}
+
+void Relay::waitWorker(int timeout)
+{
+    if (_eventFd < 0)
+    {
+        msleep((timeout < 0) ? 10 : timeout);
+        return;
+    }
+
+    pollfd pfd = {_eventFd, POLLIN, 0};
+    int res = ::poll(&pfd, 1, timeout);
+    if (res < 0 && errno != EINTR)
+    {
+        log_error_m << "Failed wait worker events. Error: " << strerror(errno);
+        msleep((timeout < 0) ? 10 : timeout);
+        return;
+    }
+    if (res > 0)
+    {
+        quint64 val;
+        while (read(_eventFd, &val, sizeof(val)) > 0) {}
+    }
+}
+
+// Сигналы, подключение к которым требует опроса состояний платы
+static bool pollSignal(const QMetaMethod& signal)
+{
+    return signal == QMetaMethod::fromSignal(&Relay::changed)
+           || signal == QMetaMethod::fromSignal(&Relay::attached)
+           || signal == QMetaMethod::fromSignal(&Relay::detached);
+}
+
+void Relay::connectNotify(const QMetaMethod& signal)
+{
+    // Блокировка не используется: connect() может вызываться из обработчика
+    // сигнала changed(), эмитируемого под _threadLock
+    if (pollSignal(signal) && _pollSubscribers++ == 0)
+    {
+        _pollInterval = int(_pollIntervalMin);
+        wakeWorker();
+    }
+}
+
+void Relay::disconnectNotify(const QMetaMethod& signal)
+{
+    // Для disconnect() без указания сигнала параметр signal невалиден, в этом
+    // случае счетчик не изменяется и опрос продолжается
+    if (!pollSignal(signal))
+        return;
+
+    int subscribers = _pollSubscribers;
+    while (subscribers > 0
+           && !_pollSubscribers.compare_exchange_weak(subscribers, subscribers - 1))
+    {}
+}
+
+void Relay::setQueueCapacity(int value)
+{
+    _queueCapacity = qBound(1, value, int(CommandRingSize));
+}
+
+void Relay::setDesired(quint8 mask, quint8 values)
+{
+    quint16 desired = _desired;
+    quint16 update;
+    do {
+        quint8 states = (quint8(desired) & ~mask) | (values & mask);
+        quint8 enforce = quint8(desired >> 8) | mask;
+        update = quint16(enforce) << 8 | states;
+    } while (!_desired.compare_exchange_weak(desired, update));
+
+    wakeWorker();
+}
+
+void Relay::setIdempotentMode(int maxAge, bool emitChanged)
+{
+    _idempotentMaxAge = qMax(maxAge, 0);
+    _idempotentEmitChanged = emitChanged;
+}
+
+bool Relay::idempotentHit(quint8 mask, quint8 values) const
+{
+    const int maxAge = _idempotentMaxAge;
+    if (maxAge == 0 || _statesVerifiedAt == 0)
+        return false;
+
+    if (((_states ^ values) & mask) != 0)
+        return false;
+
+    return (trace::now() - _statesVerifiedAt) <= quint64(maxAge) * 1000000;
+}
+
+bool Relay::setPolicy(int relayNumber, Policy policy)
+{
+    if (relayNumber > 8)
+    {
+        log_error_m << log_format(
+            "Failed set policy for relay number %?. Number out of range [1..8]",
+            relayNumber);
+        return false;
+    }
+
+    const quint8 mask = (relayNumber <= 0) ? 0xFF : quint8(1U << (relayNumber - 1));
+
+    quint16 desired = _desired;
+    quint16 update;
+    do {
+        quint8 enforce = quint8(desired >> 8);
+        if (policy == Policy::Enforce)
+            enforce |= mask;
+        else
+            enforce &= ~mask;
+        update = quint16(enforce) << 8 | quint8(desired);
+    } while (!_desired.compare_exchange_weak(desired, update));
+
+    wakeWorker();
+    return true;
+}
+
+Relay::RetryPolicy Relay::retryPolicy() const
+{
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    return _retryPolicy;
+}
+
+void Relay::setRetryPolicy(const RetryPolicy& policy)
+{
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    _retryPolicy = policy;
+    _retryPolicy.maxAttempts = qMax(policy.maxAttempts, 1);
+    _retryPolicy.deadline = qMax(policy.deadline, 0);
+    _retryPolicy.backoffBase = qMax(policy.backoffBase, 1);
+    _retryPolicy.backoffMax = qMax(policy.backoffMax, _retryPolicy.backoffBase);
+}
+
+Relay::RealtimeConfig Relay::realtime() const
+{
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    return _realtime;
+}
+
+void Relay::setRealtime(const RealtimeConfig& config)
+{
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    _realtime = config;
+    _realtime.priority = qBound(sched_get_priority_min(SCHED_FIFO), config.priority,
+                                sched_get_priority_max(SCHED_FIFO));
+    _realtime.stackPrefault = qMax(config.stackPrefault, 0);
+}
+
+void Relay::applyRealtime()
+{
+    RealtimeConfig config;
+    { //Block for QMutexLocker
+        QMutexLocker locker {&_threadLock}; (void) locker;
+        config = _realtime;
+    }
+    _realtimeActive = false;
+    if (!config.enabled)
+        return;
+
+    if (config.lockMemory)
+    {
+        // Память, освобожденная через free(), не возвращается системе,
+        // чтобы повторные выделения не приводили к отказам страниц
+        mallopt(M_TRIM_THRESHOLD, -1);
+        mallopt(M_MMAP_MAX, 0);
+
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+            log_warn_m << "Failed lock process memory. Error: " << strerror(errno);
+    }
+
+    // Предварительное выделение страниц стека
+    if (config.stackPrefault > 0)
+    {
+        volatile char* stack = (volatile char*)alloca(config.stackPrefault);
+        for (int i = 0; i < config.stackPrefault; i += 4096)
+            stack[i] = 0;
+    }
+
+    if (config.cpu >= 0)
     {
-        libusb_exit(_context);
-        _context = nullptr;
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(config.cpu, &cpuSet);
+        int res = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+        if (res != 0)
+            log_warn_m << log_format("Failed set CPU affinity to %?. Error: %?",
+                                     config.cpu, strerror(res));
     }
+
+    sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = config.priority;
+    int res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (res != 0)
+    {
+        log_warn_m << log_format("Failed set SCHED_FIFO priority %?. Error: %?"
+                                 ". Perhaps need CAP_SYS_NICE or RLIMIT_RTPRIO",
+                                 config.priority, strerror(res));
+        return;
+    }
+    _realtimeActive = true;
+    log_info_m << log_format("Real-time mode: SCHED_FIFO priority %?, CPU %?",
+                             config.priority, config.cpu);
+
+    realtimeThread = true;
+    realtimeSignals = config.emitSignals;
+}
+
+Relay::Stats Relay::stats() const
+{
+    Stats stats;
+
+    char serial[9] = {0};
+    quint64 serialPacked = _serialPacked;
+    memcpy(serial, &serialPacked, sizeof(serialPacked));
+    stats.serial = QString::fromLatin1(serial);
+
+    stats.attached = _deviceInitialized;
+    stats.count = _count;
+    stats.states = _states;
+    stats.stateVersion = _stateVersion;
+    stats.backlog = _backlog;
+    stats.pollInterval = pollInterval();
+
+    stats.attaches = _attaches;
+    stats.detaches = _detaches;
+    stats.transfers = _transfers;
+    stats.transferErrors = _transferErrors;
+    stats.commandFailures = _commandFailures;
+    for (int i = 0; i < LatencyBuckets; ++i)
+        stats.transferLatency[i] = _transferLatency[i];
+    stats.transferLatencySum = _transferLatencySum;
+
+    stats.retries = _retries;
+    stats.retriesRecovered = _retriesRecovered;
+    stats.retriesExhausted = _retriesExhausted;
+    stats.commandsRejected = _commandsRejected;
+    stats.commandsSkipped = _commandsSkipped;
+
+    stats.converged = _converged;
+    stats.reconcileCorrections = _reconcileCorrections;
+    stats.reconcileFailures = _reconcileFailures;
+    stats.convergenceTime = _convergenceTime;
+    return stats;
 }
 
 QString Relay::product() const
@@ -114,6 +471,17 @@ bool Relay::setSerial(const QString& value)
         }
     }
 
+    // Обмен с платой выполняется под блокировкой, иначе транзакции могут
+    // чередоваться с транзакциями рабочего потока и команд toggle()
+    CommandScope commandScope {this}; (void) commandScope;
+    QMutexLocker locker {&_threadLock}; (void) locker;
+
+    if (!_deviceInitialized)
+    {
+        log_error_m << "Failed set USB relay serial. Device not initialized";
+        return false;
+    }
+
     char buff[8] = {0};
     int  buffSize = sizeof(buff);
 
@@ -121,13 +489,15 @@ bool Relay::setSerial(const QString& value)
     for (int i = 1; i <= serialLen; ++i)
         buff[i] = val[i - 1];
 
-    int res = libusb_control_transfer(_deviceHandle,
+    trace::Span span {"SET_REPORT", trace::Category::Transfer, this, 0xFA};
+    int res = controlTransfer(
                                 LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_ENDPOINT_OUT,
                                 USBRQ_HID_SET_REPORT,
                                 0, // value
                                 0, // index
                                 (uchar*)buff, buffSize,
                                 REPORT_REQUEST_TIMEOUT);
+    span.finish();
     if (res != buffSize)
     {
         alog::Line logLine =
@@ -157,9 +527,14 @@ bool Relay::setSerial(const QString& value)
     QString serial = QString::fromLatin1(buff);
     log_verbose_m << "USB relay new serial: " << serial;
 
-    QMutexLocker locker {&_threadLock}; (void) locker;
+    { //Block for QMutexLocker
+        QMutexLocker locker {&probeCacheLock}; (void) locker;
+        int key = deviceKey(_usbBusNumber, _usbDeviceNumber);
+        if (probeCache.contains(key))
+            probeCache[key].serial = serial;
+    }
 
-    _serial = serial;
+    setSerialInternal(serial);
     return true;
 }
 
@@ -177,244 +552,519 @@ void Relay::setAttachSerial(const QString& val)
 
 int Relay::count() const
 {
-    QMutexLocker locker {&_threadLock}; (void) locker;
     return _count;
 }
 
-bool Relay::claimDevice()
+bool Relay::probeDevice(Transport* transport, const DeviceInfo& device,
+                        ProbeResult& probe,
+                        const std::function<bool (const ProbeResult&)>& keepOpen)
 {
-    int res;
-    bool deviceFound = false;
+    trace::Span span {"probe", trace::Category::Transfer, this, device.deviceNumber};
+
+    probe = ProbeResult();
+    probe.time = trace::now();
 
-    libusb_device** devList;
-    ssize_t devCount = libusb_get_device_list(0, &devList);
+    int res = transport->open(device);
+    if (res != LIBUSB_SUCCESS)
+    {
+        log_error_m << "Failed open USB device "
+                    << utl::formatMessage("%03d/%03d", device.busNumber, device.deviceNumber)
+                    << ". Error code: " << res
+                    << ". Detail: " << libusb_error_name(res);
+        return false;
+    }
 
     #define USB_DEV_CLOSE { \
-        libusb_close(_deviceHandle); \
-        _deviceHandle = nullptr; \
+        transport->close(); \
         log_verbose_m << "USB device closed"; }
 
-    for (ssize_t i = 0; i < devCount; ++i)
+    /** TODO Аналог num_children в linusb-1.0 не найден **
+    if (device->num_children != 0)
     {
-        CHECK_QTHREADEX_STOP
+        log_error_m << "Children not supported. USB interface will be closed";
+        USB_CLOSE;
+        continue;
+    } */
+
+    char buff[128];
+    res = transport->stringDescriptor(device.iManufacturer, buff, sizeof(buff));
+    if (res < LIBUSB_SUCCESS)
+    {
+        log_error_m << "Failed get manufacturer description"
+                    << ". Error code: " << res
+                    << ". Detail: " << libusb_error_name(res);
+        USB_DEV_CLOSE;
+        return false;
+    }
+    log_verbose_m << "USB manufacturer: " << buff;
 
-        libusb_device* device = devList[i];
-        libusb_device_descriptor descript;
-        res = libusb_get_device_descriptor(device, &descript);
-        if (res != LIBUSB_SUCCESS)
-        {
-            log_error_m << "Failed get device descriptor"
-                        << ". Error code: " << res
-                        << ". Detail: " << libusb_error_name(res);
-            continue;
-        }
+    res = transport->stringDescriptor(device.iProduct, buff, sizeof(buff));
+    if (res < LIBUSB_SUCCESS)
+    {
+        log_error_m << "Failed get product description"
+                    << ". Error code: " << res
+                    << ". Detail: " << libusb_error_name(res);
+        USB_DEV_CLOSE;
+        return false;
+    }
+    QString product = QString::fromLatin1(buff);
+    log_verbose_m << "USB product: " << product;
 
-        if (descript.idVendor == USB_RELAY_VENDOR_ID
-            && descript.idProduct == USB_RELAY_DEVICE_ID)
-        {
-            deviceFound = true;
-            _usbBusNumber = libusb_get_bus_number(device);
-            _usbDeviceNumber = libusb_get_device_address(device);
+    int len = strlen(baseProductName);
+    if (strncmp(buff, baseProductName, len) != 0)
+    {
+        log_error_m << log_format(
+            "The base name of product must be %?"
+            ". USB device will be closed", baseProductName);
+        USB_DEV_CLOSE;
+        return false;
+    }
+    if (strlen(buff) != size_t(len + 1))
+    {
+        log_error_m << log_format(
+            "The base product name does not contain a product index"
+            ". USB device will be closed", baseProductName);
+        USB_DEV_CLOSE;
+        return false;
+    }
 
-            log_info_m << "USB device found on bus "
-                       << utl::formatMessage("%03d/%03d", _usbBusNumber, _usbDeviceNumber);
+    int relayCount = int(buff[len]) - int('0');
+    if (boardOps(relayCount) == nullptr)
+    {
+        log_error_m << log_format(
+            "Unsupported number of relays: %?"
+            ". USB device will be closed", relayCount);
+        USB_DEV_CLOSE;
+        return false;
+    }
+    log_verbose_m << "USB relay count: " << relayCount;
+
+    // Чтение серийного номера
+    memset(buff, 0, 8);
+    quint64 start = trace::now();
+    res = transport->controlTransfer(LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_ENDPOINT_IN,
+                                     USBRQ_HID_GET_REPORT,
+                                     0, // value
+                                     0, // index
+                                     (uchar*)buff, 8,
+                                     REPORT_REQUEST_TIMEOUT);
+    accountTransfer(qint64(trace::now() - start) / 1000, res);
+    if (res != 8)
+    {
+        alog::Line logLine =
+            log_error_m << "Failed send message to USB interface";
+        if (res < 0)
+            logLine << ". Error code: " << res
+                    << ". Detail: " << libusb_error_name(res);
+        USB_DEV_CLOSE;
+        return false;
+    }
 
-            res = libusb_open(device, &_deviceHandle);
-            if (res != LIBUSB_SUCCESS)
-            {
-                log_error_m << "Failed open USB device"
-                            << ". Error code: " << res
-                            << ". Detail: " << libusb_error_name(res);
+    const int serialLen = 5;
+    for (int i = 0; i < serialLen; ++i)
+    {
+        uchar ch = uchar(buff[i]);
+        if ((ch <= 0x20) || (ch >= 0x7F))
+        {
+            log_error_m << log_format(
+                "Incorrect USB relay serial. Symbol index: %?; code: %?",
+                i, int(ch));
+        }
+    }
+    if (buff[serialLen + 1] != 0)
+    {
+        log_error_m << "Bad USB relay serial string";
+        USB_DEV_CLOSE;
+        return false;
+    }
+    buff[serialLen] = 0;
 
-                _deviceHandle = nullptr;
-                continue;
-            }
-            log_verbose_m << "USB device is open";
+    probe.valid = true;
+    probe.product = product;
+    probe.serial = QString::fromLatin1(buff);
+    probe.relayCount = relayCount;
+    probe.states = quint8(buff[7]);
+    log_verbose_m << "USB relay serial: " << probe.serial;
 
-            /** TODO Аналог num_children в linusb-1.0 не найден **
-            if (device->num_children != 0)
-            {
-                log_error_m << "Children not supported. USB interface will be closed";
-                USB_CLOSE;
-                continue;
-            } */
+    if (keepOpen && keepOpen(probe))
+        return true;
 
-            char buff[128];
-            res = libusb_get_string_descriptor_ascii(
-                                        _deviceHandle, descript.iManufacturer,
-                                        (uchar*)buff, sizeof(buff));
-            if (res < LIBUSB_SUCCESS)
-            {
-                log_error_m << "Failed get manufacturer description"
-                            << ". Error code: " << res
-                            << ". Detail: " << libusb_error_name(res);
-                USB_DEV_CLOSE;
-                continue;
-            }
-            log_verbose_m << "USB manufacturer: " << buff;
+    USB_DEV_CLOSE;
+    #undef USB_DEV_CLOSE
 
-            res = libusb_get_string_descriptor_ascii(
-                                        _deviceHandle, descript.iProduct,
-                                        (uchar*)buff, sizeof(buff));
-            if (res < LIBUSB_SUCCESS)
-            {
-                log_error_m << "Failed get product description"
-                            << ". Error code: " << res
-                            << ". Detail: " << libusb_error_name(res);
-                USB_DEV_CLOSE;
-                continue;
-            }
-            QString product = QString::fromLatin1(buff);
-            log_verbose_m << "USB product: " << product;
+    return true;
+}
 
-            int len = strlen(baseProductName);
-            if (strncmp(buff, baseProductName, len) != 0)
-            {
-                log_error_m << log_format(
-                    "The base name of product must be %?"
-                    ". USB device will be closed", baseProductName);
-                USB_DEV_CLOSE;
-                continue;
-            }
-            if (strlen(buff) != size_t(len + 1))
-            {
-                log_error_m << log_format(
-                    "The base product name does not contain a product index"
-                    ". USB device will be closed", baseProductName);
-                USB_DEV_CLOSE;
-                continue;
-            }
+int Relay::probeDevices(const QVector<DeviceInfo>& devices,
+                        const QString& attachSerial)
+{
+    if (devices.isEmpty())
+        return -1;
 
-            int relayCount = int(buff[len]) - int('0');
-            QSet<int> countCheck {1, 2, 4, 8};
-            if (!countCheck.contains(relayCount))
-            {
-                log_error_m << log_format(
-                    "The number of relays must be one of values  [1, 2, 4, 8]"
-                    "Current value %?. USB device will be closed", relayCount);
-                USB_DEV_CLOSE;
-                continue;
-            }
-            log_verbose_m << "USB relay count: " << relayCount;
+    QVector<ProbeResult> probes;
+    probes.resize(devices.count());
+    QVector<bool> probed;
+    probed.fill(false, devices.count());
+
+    // Плата с подходящим серийным номером остается открытой, чтобы при захвате
+    // не открывать ее повторно. Выбирается первая такая плата
+    std::atomic_bool kept = {false};
+    auto keepOpen = [&](const ProbeResult& probe) -> bool
+    {
+        if (!attachSerial.isEmpty() && attachSerial != probe.serial)
+            return false;
+        bool expected = false;
+        return kept.compare_exchange_strong(expected, true);
+    };
+    int keptIndex = -1;
+
+    // Вспомогательные транспорты для параллельного опроса. Один из них
+    // используется текущим потоком
+    std::vector<std::unique_ptr<Transport>> transports;
+    if (devices.count() > 1)
+    {
+        int threads = qMin(devices.count(), PROBE_THREADS);
+        for (int i = 0; i < threads; ++i)
+        {
+            Transport* transport = _transport->createProbe();
+            if (transport == nullptr)
+                break;
+            transports.emplace_back(transport);
+        }
+    }
 
-            // Чтение состояний реле и серийного номера
-            int states = readStates(buff, 8);
-            if (states < 0)
+    if (transports.size() < 2)
+    {
+        // После того как плата оставлена открытой, _transport не может исполь-
+        // зоваться для опроса. Оставшиеся устройства будут опрошены при следую-
+        // щем поиске
+        for (int i = 0; i < devices.count(); ++i)
+        {
+            if (threadStop())
+                break;
+            probeDevice(_transport.get(), devices[i], probes[i], keepOpen);
+            probed[i] = true;
+            if (_transport->isOpen())
             {
-                USB_DEV_CLOSE;
-                continue;
+                keptIndex = i;
+                break;
             }
-
-            const int serialLen = 5;
-            for (int i = 0; i < serialLen; ++i)
+        }
+    }
+    else
+    {
+        std::atomic_int next = {0};
+        std::atomic<Transport*> keptTransport = {nullptr};
+        auto worker = [&](Transport* transport)
+        {
+            for (int i = next++; i < devices.count(); i = next++)
             {
-                uchar ch = uchar(buff[i]);
-                if ((ch <= 0x20) || (ch >= 0x7F))
+                if (threadStop())
+                    break;
+                probeDevice(transport, devices[i], probes[i], keepOpen);
+                probed[i] = true;
+                if (transport->isOpen())
                 {
-                    log_error_m << log_format(
-                        "Incorrect USB relay serial. Symbol index: %?; code: %?",
-                        i, int(ch));
+                    // Транспорт удерживает плату и больше не используется
+                    keptIndex = i;
+                    keptTransport = transport;
+                    break;
                 }
             }
-            if (buff[serialLen + 1] != 0)
-            {
-                log_error_m << "Bad USB relay serial string";
-                USB_DEV_CLOSE;
-                continue;
-            }
+        };
 
-            QString serial = QString::fromLatin1(buff);
-            log_verbose_m << "USB relay serial: " << serial;
+        std::vector<std::future<void>> futures;
+        for (size_t i = 1; i < transports.size(); ++i)
+            futures.push_back(std::async(std::launch::async, worker,
+                                         transports[i].get()));
+        worker(transports[0].get());
 
-            { //Block for QMutexLocker
-                QMutexLocker locker {&_threadLock}; (void) locker;
-                if (!_attachSerial.isEmpty())
-                {
-                    if (_attachSerial != serial)
-                    {
-                        log_verbose_m << log_format(
-                            "USB relay serial (%?) not match attach-serial (%?)",
-                            serial, _attachSerial);
-                        USB_DEV_CLOSE;
-                        continue;
-                    }
-                    log_verbose_m << "USB relay serial to match attach-serial";
-                }
-            }
+        for (std::future<void>& future : futures)
+            future.wait();
 
-            libusb_config_descriptor* config;
-            res = libusb_get_active_config_descriptor(device, &config);
-            if (res != LIBUSB_SUCCESS)
+        if (Transport* transport = keptTransport)
+            if (!_transport->takeDevice(transport))
             {
-                log_error_m << "Failed libusb_get_active_config_descriptor"
-                            << ". Error code: " << res
-                            << ". Detail: " << libusb_error_name(res);
-                USB_DEV_CLOSE;
-                continue;
+                transport->close();
+                keptIndex = -1;
             }
+    }
 
-            res = libusb_set_auto_detach_kernel_driver(_deviceHandle, 1);
-            if (res != LIBUSB_SUCCESS)
+    QMutexLocker locker {&probeCacheLock}; (void) locker;
+    for (int i = 0; i < devices.count(); ++i)
+        if (probed[i])
+            probeCache[deviceKey(devices[i].busNumber, devices[i].deviceNumber)] = probes[i];
+
+    return keptIndex;
+}
+
+bool Relay::openDevice(const DeviceInfo& device, const ProbeResult& probe,
+                       bool opened)
+{
+    _usbBusNumber = device.busNumber;
+    _usbDeviceNumber = device.deviceNumber;
+
+    int res;
+    if (!opened)
+    {
+        res = _transport->open(device);
+        if (res != LIBUSB_SUCCESS)
+        {
+            log_error_m << "Failed open USB device"
+                        << ". Error code: " << res
+                        << ". Detail: " << libusb_error_name(res);
+            return false;
+        }
+    }
+    log_verbose_m << "USB device is open";
+
+    #define USB_DEV_CLOSE { \
+        _transport->close(); \
+        log_verbose_m << "USB device closed"; }
+
+    int states = probe.states;
+    if (!opened)
+    {
+        // Чтение состояний реле и проверка серийного номера: с момента опроса
+        // серийный номер мог быть изменен
+        char buff[8] = {0};
+        states = readStates(buff, 8);
+        if (states < 0)
+        {
+            USB_DEV_CLOSE;
+            return false;
+        }
+        buff[5] = 0;
+        if (QString::fromLatin1(buff) != probe.serial)
+        {
+            log_verbose_m << log_format(
+                "USB relay serial changed since probe (%? -> %?)",
+                probe.serial, QString::fromLatin1(buff));
+            USB_DEV_CLOSE;
+            return false;
+        }
+    }
+
+    res = _transport->checkActiveConfig();
+    if (res != LIBUSB_SUCCESS)
+    {
+        log_error_m << "Failed libusb_get_active_config_descriptor"
+                    << ". Error code: " << res
+                    << ". Detail: " << libusb_error_name(res);
+        USB_DEV_CLOSE;
+        return false;
+    }
+
+    res = _transport->setAutoDetachKernelDriver(true);
+    if (res != LIBUSB_SUCCESS)
+    {
+        log_error_m << "Failed set auto_detach_kernel_driver flag"
+                    << ". Error code: " << res
+                    << ". Detail: " << libusb_error_name(res);
+        USB_DEV_CLOSE;
+        return false;
+    }
+
+    const int intfNumber = 0;
+    res = _transport->claimInterface(intfNumber);
+    if (res != LIBUSB_SUCCESS)
+    {
+        log_error_m << "Failed claim USB interface " << intfNumber
+                    << ". Error code: " << res
+                    << ". Detail: " << libusb_error_name(res)
+                    << ". Perhaps need to create a UDEV rule to access the device";
+        USB_DEV_CLOSE;
+        return false;
+    }
+    log_verbose_m << log_format("USB interface %? claimed", intfNumber);
+
+    #undef USB_DEV_CLOSE
+
+    { //Block for QMutexLocker
+        QMutexLocker locker {&_threadLock}; (void) locker;
+        _product = probe.product;
+        setSerialInternal(probe.serial);
+        _lastPollTime = 0;
+        updateStates(quint8(states), ExternalTag);
+        _lastPollTime = trace::now();
+        _board = boardOps(probe.relayCount);
+        _count = probe.relayCount;
+
+        QVariant vstat;
+        vstat.setValue(statesInternal());
+        log_verbose_m << "USB relay states: " << vstat;
+    }
+    return true;
+}
+
+bool Relay::claimDevice()
+{
+    QVector<DeviceInfo> devices;
+    int res = _transport->deviceList(devices);
+    if (res < 0)
+    {
+        log_error_m << "Failed get USB device list"
+                    << ". Error code: " << res
+                    << ". Detail: " << libusb_error_name(res);
+        return false;
+    }
+
+    // Платы, не захваченные другими экземплярами Relay текущего процесса
+    QVector<DeviceInfo> candidates;
+    QSet<int> present;
+    for (const DeviceInfo& device : devices)
+    {
+        if (device.vendorId != USB_RELAY_VENDOR_ID
+            || device.productId != USB_RELAY_DEVICE_ID)
+            continue;
+
+        int key = deviceKey(device.busNumber, device.deviceNumber);
+        present.insert(key);
+
+        QMutexLocker locker {&claimedDevicesLock}; (void) locker;
+        if (!claimedDevices.contains(key))
+            candidates.append(device);
+    }
+
+    // Опрос плат, отсутствующих в кэше. Устаревшие записи и записи для
+    // отключенных плат удаляются
+    QVector<DeviceInfo> probeList;
+    { //Block for QMutexLocker
+        QMutexLocker locker {&probeCacheLock}; (void) locker;
+        const quint64 now = trace::now();
+        for (int key : probeCache.keys())
+            if (!present.contains(key)
+                || now - probeCache[key].time > quint64(PROBE_CACHE_TTL) * 1000000)
+                probeCache.remove(key);
+
+        for (const DeviceInfo& device : candidates)
+            if (!probeCache.contains(deviceKey(device.busNumber, device.deviceNumber)))
+                probeList.append(device);
+    }
+    QString attachSerial;
+    { //Block for QMutexLocker
+        QMutexLocker locker {&_threadLock}; (void) locker;
+        attachSerial = _attachSerial;
+    }
+
+    if (!probeList.isEmpty())
+        log_debug_m << log_format("Probe %? of %? USB relay device(s)",
+                                  probeList.count(), candidates.count());
+    int keptIndex = probeDevices(probeList, attachSerial);
+
+    // Плата, оставленная открытой при опросе, захватывается первой
+    if (keptIndex >= 0)
+    {
+        const DeviceInfo device = probeList[keptIndex];
+        for (int i = 0; i < candidates.count(); ++i)
+            if (candidates[i].index == device.index)
             {
-                log_error_m << "Failed set auto_detach_kernel_driver flag"
-                            << ". Error code: " << res
-                            << ". Detail: " << libusb_error_name(res);
-                USB_DEV_CLOSE;
-                continue;
+                candidates.removeAt(i);
+                break;
             }
+        candidates.prepend(device);
+    }
 
-            const int intfNumber = 0;
-            res = libusb_claim_interface(_deviceHandle, intfNumber);
-            if (res != LIBUSB_SUCCESS)
+    bool deviceFound = false;
+    for (const DeviceInfo& device : candidates)
+    {
+        // Открытая при опросе плата закрывается, если ее захват не состоялся
+        const bool opened = (keptIndex >= 0);
+        keptIndex = -1;
+
+        if (threadStop())
+        {
+            if (opened)
+                _transport->close();
+            break;
+        }
+
+        const int key = deviceKey(device.busNumber, device.deviceNumber);
+
+        ProbeResult probe;
+        { //Block for QMutexLocker
+            QMutexLocker locker {&probeCacheLock}; (void) locker;
+            if (probeCache.contains(key))
+                probe = probeCache[key];
+        }
+
+        // Устройства, не прошедшие опрос, повторно опрашиваются только после
+        // истечения срока хранения результата в кэше
+        if (!probe.valid)
+        {
+            if (opened)
+                _transport->close();
+            continue;
+        }
+
+        if (!attachSerial.isEmpty() && attachSerial != probe.serial)
+        {
+            log_debug2_m << log_format(
+                "USB relay serial (%?) not match attach-serial (%?)",
+                probe.serial, attachSerial);
+            if (opened)
+                _transport->close();
+            continue;
+        }
+
+        // Резервирование платы до захвата интерфейса, чтобы другие экземпляры
+        // Relay не пытались захватить ее одновременно
+        { //Block for QMutexLocker
+            QMutexLocker locker {&claimedDevicesLock}; (void) locker;
+            if (claimedDevices.contains(key))
             {
-                log_error_m << "Failed claim USB interface " << intfNumber
-                            << ". Error code: " << res
-                            << ". Detail: " << libusb_error_name(res)
-                            << ". Perhaps need to create a UDEV rule to access the device";
-                USB_DEV_CLOSE;
+                if (opened)
+                    _transport->close();
                 continue;
             }
-            log_verbose_m << log_format("USB interface %? claimed", intfNumber);
-
-            { //Block for QMutexLocker
-                QMutexLocker locker {&_threadLock}; (void) locker;
-                _product = product;
-                _serial = serial;
-                _states = quint8(states);
-                _count = relayCount;
-
-                QVariant vstat;
-                vstat.setValue(statesInternal());
-                log_verbose_m << "USB relay states: " << vstat;
-            }
+            claimedDevices.insert(key);
+        }
+
+        deviceFound = true;
+        log_info_m << "USB device found on bus "
+                   << utl::formatMessage("%03d/%03d", device.busNumber, device.deviceNumber);
 
-            libusb_free_device_list(devList, true);
+        if (openDevice(device, probe, opened))
+        {
+            _transport->freeDeviceList();
             return true;
         }
-    }
 
-    #undef USB_DEV_CLOSE
+        { //Block for QMutexLocker
+            QMutexLocker locker {&claimedDevicesLock}; (void) locker;
+            claimedDevices.remove(key);
+        }
+        { //Block for QMutexLocker
+            QMutexLocker locker {&probeCacheLock}; (void) locker;
+            probeCache.remove(key);
+        }
+    }
 
-    /* Free the libusb device list freeing unused devices */
-    libusb_free_device_list(devList, true);
+    _transport->freeDeviceList();
 
     if (deviceFound)
         log_debug_m << "Device failed initialize";
     else
         log_debug_m << "Device not found";
 
-    _deviceHandle = nullptr;
     return false;
 }
 
 void Relay::releaseDevice(bool deviceDetached)
 {
-    if (_deviceHandle)
+    hotplugMonitor().unsubscribe(this);
+
+    // Закрытие устройства и сброс параметров платы выполняются под блокиров-
+    // кой, чтобы не прервать транзакцию команды, исполняемой в другом потоке
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    _deviceInitialized = false;
+
+    if (_transport->isOpen())
     {
         if (!deviceDetached)
         {
             const int intfNumber = 0;
-            int res = libusb_release_interface(_deviceHandle, intfNumber);
+            int res = _transport->releaseInterface(intfNumber);
             if (res != LIBUSB_SUCCESS)
                 log_error_m << "Failed release USB interface " << intfNumber
                             << ". Error code: " << res
@@ -422,22 +1072,282 @@ void Relay::releaseDevice(bool deviceDetached)
             else
                 log_verbose_m << log_format("USB interface %? released", intfNumber);
         }
-        libusb_close(_deviceHandle);
+        _transport->close();
         log_verbose_m << "USB device closed";
+
+        QMutexLocker locker {&claimedDevicesLock}; (void) locker;
+        claimedDevices.remove(deviceKey(_usbBusNumber, _usbDeviceNumber));
     }
-    _deviceHandle = nullptr;
-    _deviceInitialized = false;
     _usbContinuousErrors = 0;
     _usbLastErrorCode = 0;
     _product.clear();
-    _serial.clear();
+    setSerialInternal(QString());
+    _statesVerifiedAt = 0;
+    _board = nullptr;
     _count = 0;
+
+    // Потоки, ожидающие в waitForChange(), завершают ожидание
+    _stateCond.wakeAll();
+}
+
+int Relay::claimRetryTimeout(quint32 claimAttempts)
+{
+    if (claimAttempts > 40)
+        return 15;
+    if (claimAttempts > 20)
+        return 10;
+    return 2;
+}
+
+bool Relay::attachDevice()
+{
+    _deviceInitialized = false;
+    _deviceLeft = false;
+    if (!claimDevice())
+    {
+        releaseDevice(false);
+        return false;
+    }
+    _deviceInitialized = true;
+
+    // Если hotplug недоступен, отключение устройства определяется по ошибкам
+    // обмена (см. detachRequired())
+    if (_transport->hotplugCapable())
+        hotplugMonitor().subscribe(this, _usbBusNumber, _usbDeviceNumber);
+
+    { //Block for QMutexLocker
+        QMutexLocker locker(&_threadLock); (void) locker;
+        if (!_initStates.isEmpty())
+        {
+            if (_initStates.count() > _count)
+                _initStates.resize(_count);
+
+            // Начальные состояния применяются одной группой, см. planCommands()
+            quint8 mask = 0;
+            quint8 values = 0;
+            for (int i = 0; i < _initStates.count(); ++i)
+            {
+                mask |= quint8(1U << i);
+                if (_initStates[i])
+                    values |= quint8(1U << i);
+            }
+            if (((_states ^ values) & mask) != 0)
+            {
+                _commandStart = trace::now();
+                toggleGroupInternal(mask, values, 0);
+            }
+
+            _initStates.clear();
+
+            QVariant vstat;
+            vstat.setValue(statesInternal());
+            log_verbose_m << "USB init relay states: " << vstat;
+        }
+    }
+
+    ++_attaches;
+    log_info_m << "USB relay emit signal 'attached'";
+    { //Block for trace::Span
+        trace::Span span {"attached", trace::Category::Signal, this};
+        emit attached();
+    }
+    return true;
+}
+
+void Relay::detachDevice(bool deviceDetached)
+{
+    ++_detaches;
+    log_info_m << "USB relay emit signal 'detached'";
+    { //Block for trace::Span
+        trace::Span span {"detached", trace::Category::Signal, this};
+        emit detached();
+    }
+
+    releaseDevice(deviceDetached);
+
+    // Команды, оставшиеся в очереди, завершаются с ошибкой
+    processCommands();
+}
+
+bool Relay::detachRequired() const
+{
+    if (_deviceLeft)
+        return true;
+
+    if (_usbContinuousErrors >= USB_CONTINUOUS_ERRORS_1
+        && _usbLastErrorCode == LIBUSB_ERROR_NO_DEVICE)
+        return true;
+
+    return (_usbContinuousErrors >= USB_CONTINUOUS_ERRORS_2);
+}
+
+void Relay::deviceLeft()
+{
+    log_info_m << "USB relay removed from USB port";
+
+    // Флаг _deviceInitialized сбрасывается сразу, чтобы новые команды
+    // завершались с ошибкой без обращения к устройству
+    _deviceLeft = true;
+    _deviceInitialized = false;
+
+    // Прерываем выполняющийся обмен с устройством, иначе рабочий поток
+    // остается заблокированным до истечения таймаута запроса
+    _transport->interrupt();
+    wakeWorker();
+}
+
+void Relay::pollStates()
+{
+    // Опрос пропускается, если есть команды, ожидающие исполнения
+    if (_commandsActive > 0)
+        return;
+
+    trace::Span pollSpan {"poll", trace::Category::Poll, this};
+    trace::Span lockSpan {"lock", trace::Category::Lock, this};
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    lockSpan.finish();
+
+    if (_commandsActive > 0 || _backlog > 0)
+        return;
+
+    char buff[8] = {0};
+    int states = readStatesPreemptible(buff, sizeof(buff));
+    if (states < 0)
+        return;
+
+    pollCompleted(quint8(states));
+}
+
+void Relay::pollCompleted(quint8 states)
+{
+    if (_states == states)
+    {
+        _lastPollTime = trace::now();
+        _statesVerifiedAt = _lastPollTime;
+        _pollInterval = qMin(_pollInterval * 2, int(_pollIntervalMax));
+        return;
+    }
+
+    externalChange(states);
+    _lastPollTime = trace::now();
+    _pollInterval = int(_pollIntervalMin);
+}
+
+void Relay::externalChange(quint8 states)
+{
+    log_debug_m << log_format(
+        "USB relay state was changed from outside"
+        ". Old value: %?. New value: %?", int(_states), int(states));
+
+    const quint8 prevStates = _states;
+    updateStates(states, ExternalTag);
+
+    trace::Span span {"changed", trace::Category::Signal, this};
+    for (int i = 0; i < _count; ++i)
+        if ((prevStates ^ _states) & (1U << i))
+            emit changed(i + 1, ExternalTag);
+}
+
+bool Relay::popCommand(Command& command)
+{
+    CommandSlot& slot = _commandRing[_dequeuePos & (CommandRingSize - 1)];
+    if (slot.seq.load(std::memory_order_acquire) != _dequeuePos + 1)
+        return false;
+
+    command = slot.command;
+    slot.seq.store(_dequeuePos + CommandRingSize, std::memory_order_release);
+    ++_dequeuePos;
+    --_backlog;
+    return true;
+}
+
+void Relay::processCommands()
+{
+    while (_backlog > 0)
+    {
+        trace::Span lockSpan {"lock", trace::Category::Lock, this};
+        QMutexLocker locker {&_threadLock}; (void) locker;
+        lockSpan.finish();
+
+        Command cmd;
+        if (!popCommand(cmd))
+        {
+            // Производитель зарезервировал место в очереди, но еще не опубли-
+            // ковал команду, либо отказался от резерва
+            locker.unlock();
+            sched_yield();
+            continue;
+        }
+
+        trace::Span span {"command", trace::Category::Command, this, cmd.relayNumber};
+        retryCommand(locker, cmd.postTime, [&]() {
+            return toggleInternal(cmd.relayNumber, cmd.value, cmd.tag);
+        });
+    }
+}
+
+void Relay::reconcile()
+{
+    if (enforceMask() == 0 || !_deviceInitialized)
+        return;
+
+    trace::Span lockSpan {"lock", trace::Category::Lock, this};
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    lockSpan.finish();
+
+    const quint16 desired = _desired;
+    const quint8 states = quint8(desired);
+    const quint8 enforce = quint8(desired >> 8) & _board->allMask;
+    const quint64 now = trace::now();
+
+    quint8 diff = (_states ^ states) & enforce;
+    if (diff != 0)
+    {
+        if (_divergedSince == 0)
+        {
+            _divergedSince = now;
+            _converged = false;
+        }
+
+        // После неудачной корректировки повтор выполняется не ранее чем через
+        // минимальный интервал опроса
+        if (now < _reconcileAfter)
+            return;
+
+        log_debug_m << log_format(
+            "Reconcile relay states. Current: %?. Desired: %?. Mask: %?",
+            int(_states), int(states), int(diff));
+
+        ++_reconcileCorrections;
+        trace::Span span {"reconcile", trace::Category::Command, this, diff};
+        if (!toggleGroupInternal(diff, states, ReconcileTag))
+        {
+            ++_reconcileFailures;
+            _reconcileAfter = trace::now() + quint64(_pollIntervalMin) * 1000000;
+            return;
+        }
+        _reconcileAfter = 0;
+        diff = (_states ^ states) & enforce;
+    }
+
+    if (diff == 0 && _divergedSince != 0)
+    {
+        _convergenceTime = (trace::now() - _divergedSince) / 1000;
+        _divergedSince = 0;
+        _converged = true;
+        log_verbose_m << log_format(
+            "Relay states converged in %? us", quint64(_convergenceTime));
+    }
 }
 
 void Relay::run()
 {
+    using namespace std::chrono;
+
     log_info_m << "Started";
 
+    applyRealtime();
+
     quint32 claimAttempts = 0;
     bool deviceDetached = false;
 
@@ -446,92 +1356,76 @@ void Relay::run()
         if (threadStop())
             break;
 
-        _deviceInitialized = false;
-        if (!claimDevice())
+        if (!attachDevice())
         {
-            releaseDevice(false);
-            int timeout = 2;
-            if (claimAttempts > 40)
-                timeout = 15;
-            else if (claimAttempts > 20)
-                timeout = 10;
-
-            sleep(timeout);
+            // Во время ожидания повторного захвата команды, поставленные
+            // в очередь, завершаются с ошибкой (см. toggleInternal())
+            steady_clock::time_point claimTime =
+                steady_clock::now() + seconds(claimRetryTimeout(claimAttempts));
             claimAttempts++;
+            while (!threadStop())
+            {
+                processCommands();
+                qint64 timeout = duration_cast<milliseconds>(
+                                    claimTime - steady_clock::now()).count();
+                if (timeout <= 0)
+                    break;
+                waitWorker(int(timeout));
+            }
             CHECK_QTHREADEX_STOP
             continue;
         }
         claimAttempts = 0;
         deviceDetached = false;
-        _deviceInitialized = true;
-
-        { //Block for QMutexLocker
-            QMutexLocker locker(&_threadLock); (void) locker;
-            if (!_initStates.isEmpty())
-            {
-                if (_initStates.count() > _count)
-                    _initStates.resize(_count);
 
-                QVector<int> states = statesInternal();
-                for (int i = 0; i < _count; ++i)
-                    if (_initStates[i] != states[i])
-                        toggleInternal(i + 1, _initStates[i], 0);
+        // После подключения платы реле в режиме Enforce приводятся к требуемому
+        // состоянию без ожидания очередного цикла опроса
+        reconcile();
 
-                _initStates.clear();
-
-                QVariant vstat;
-                vstat.setValue(statesInternal());
-                log_verbose_m << "USB init relay states: " << vstat;
-            }
-        }
-
-        log_info_m << "USB relay emit signal 'attached'";
-        emit attached();
+        steady_clock::time_point lastPoll = steady_clock::now();
 
         while (true)
         {
             CHECK_QTHREADEX_STOP
 
-            if (_usbContinuousErrors >= USB_CONTINUOUS_ERRORS_1
-                && _usbLastErrorCode == LIBUSB_ERROR_NO_DEVICE)
-            {
-                deviceDetached = true;
-                break;
-            }
-            if (_usbContinuousErrors >= USB_CONTINUOUS_ERRORS_2)
+            if (detachRequired())
             {
                 deviceDetached = true;
                 break;
             }
 
-            { //Block for QMutexLocker
-                QMutexLocker locker(&_threadLock); (void) locker;
-                _threadCond.wait(&_threadLock, 200);
+            if (_backlog == 0 && !_deviceLeft)
+            {
+                if (pollSuspended())
+                {
+                    waitWorker(-1);
+                }
+                else
+                {
+                    steady_clock::time_point pollTime =
+                        lastPoll + milliseconds(_pollInterval);
+                    qint64 timeout = duration_cast<milliseconds>(
+                                        pollTime - steady_clock::now()).count();
+                    if (timeout > 0)
+                        waitWorker(int(timeout));
+                }
             }
             if (threadStop())
                 continue;
 
-            { //Block for QMutexLocker
-                QMutexLocker locker {&_threadLock}; (void) locker;
-                char buff[8] = {0};
-                int states = readStates(buff, sizeof(buff));
-                if (states < 0)
-                    continue;
+            processCommands();
 
-                if (_states != quint8(states))
-                {
-                    log_debug_m << log_format(
-                        "USB relay state was changed from outside"
-                        ". Old value: %?. New value: %?", int(_states), states);
-                    _states = quint8(states);
-                }
+            if (!pollSuspended()
+                && steady_clock::now() >= lastPoll + milliseconds(_pollInterval))
+            {
+                pollStates();
+                lastPoll = steady_clock::now();
             }
-        } // while (true)
 
-        log_info_m << "USB relay emit signal 'detached'";
-        emit detached();
+            reconcile();
+        } // while (true)
 
-        releaseDevice(deviceDetached);
+        detachDevice(deviceDetached);
 
     } // while (true)
 
@@ -542,34 +1436,92 @@ void Relay::run()
 
 void Relay::threadStopEstablished()
 {
-    QMutexLocker locker {&_threadLock}; (void) locker;
-    _threadCond.wakeAll();
+    wakeWorker();
+
+    // Без захвата блокировки пробуждение может быть пропущено, в этом
+    // случае ожидание в waitForChange() завершит releaseDevice()
+    _stateCond.wakeAll();
 }
 
-int Relay::readStates(char* buff, int buffSize)
+int Relay::controlTransfer(quint8 requestType, quint8 request,
+                           quint16 value, quint16 index,
+                           uchar* data, quint16 length, uint timeout)
 {
-    int res = libusb_control_transfer(_deviceHandle,
-                                LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_ENDPOINT_IN,
+    quint64 start = trace::now();
+    int res = _transport->controlTransfer(requestType, request, value, index,
+                                          data, length, timeout);
+    accountTransfer(qint64(trace::now() - start) / 1000, res);
+    return res;
+}
+
+void Relay::accountTransfer(qint64 latencyUsec, int result)
+{
+    ++_transfers;
+
+    // Запросы, прерванные командой переключения, ошибкой не считаются
+    if (result == LIBUSB_ERROR_INTERRUPTED)
+        return;
+
+    if (result < 0)
+    {
+        ++_transferErrors;
+        return;
+    }
+
+    int bucket = 0;
+    while (bucket < LatencyBuckets - 1 && latencyUsec > LatencyBounds[bucket])
+        ++bucket;
+
+    _transferLatency[bucket].fetch_add(1, std::memory_order_relaxed);
+    _transferLatencySum.fetch_add(quint64(latencyUsec), std::memory_order_relaxed);
+}
+
+void Relay::accountTransfer(const Transport::AsyncTransfer& transfer)
+{
+    using namespace std::chrono;
+    qint64 latency = duration_cast<microseconds>(
+                         transfer.completeTime - transfer.submitTime).count();
+    accountTransfer(latency, transfer.result);
+}
+
+void Relay::setSerialInternal(const QString& serial)
+{
+    _serial = serial;
+
+    quint64 serialPacked = 0;
+    QByteArray val = serial.toLatin1();
+    memcpy(&serialPacked, val.constData(), qMin(val.length(), int(sizeof(serialPacked))));
+    _serialPacked = serialPacked;
+}
+
+int Relay::readStates(char* buff, int buffSize)
+{
+    trace::Span span {"GET_REPORT", trace::Category::Transfer, this};
+    int res = controlTransfer(
+                                LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_ENDPOINT_IN,
                                 USBRQ_HID_GET_REPORT,
                                 0, // value
                                 0, // index
                                 (uchar*)buff, buffSize,
                                 REPORT_REQUEST_TIMEOUT);
+    span.finish();
     if (res != buffSize)
     {
+        ++_usbContinuousErrors;
+        if (res < 0)
+            _usbLastErrorCode = res;
+        if (realtimeThread)
+            return -1;
+
         alog::Line logLine =
             log_error_m << "Failed send message to USB interface";
         if (res < 0)
-        {
-            _usbLastErrorCode = res;
             logLine << ". Error code: " << res
                     << ". Detail: " << libusb_error_name(res);
-        }
-        ++_usbContinuousErrors;
         return -1;
     }
 
-    if (alog::logger().level() >= alog::Level::Debug)
+    if (!realtimeThread && alog::logger().level() >= alog::Level::Debug)
     {
         if (_usbContinuousErrors != 0)
             log_debug_m << "USB continuous errors: " << int(_usbContinuousErrors);
@@ -579,18 +1531,167 @@ int Relay::readStates(char* buff, int buffSize)
     return quint8(buff[7]); // Байт 7 содержит битовые флаги состояний реле
 }
 
-QVector<int> Relay::states() const
+int Relay::readStatesPreemptible(char* buff, int buffSize)
+{
+    trace::Span span {"GET_REPORT poll", trace::Category::Transfer, this};
+
+    Transport::AsyncTransfer transfer;
+    transfer.requestType = LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_ENDPOINT_IN;
+    transfer.request = USBRQ_HID_GET_REPORT;
+    transfer.length = quint8(qMin(buffSize, int(sizeof(transfer.data))));
+
+    bool cancelled = false;
+    int res = _transport->submit(transfer, REPORT_REQUEST_TIMEOUT);
+    if (res == LIBUSB_SUCCESS)
+    {
+        // Ожидание выполняется короткими интервалами, чтобы поступившая
+        // команда прерывала опрос без ожидания таймаута запроса
+        while (!transfer.completed)
+        {
+            if (!cancelled && (_commandsActive > 0 || _backlog > 0 || _deviceLeft))
+            {
+                _transport->cancel(transfer);
+                cancelled = true;
+            }
+            _transport->handleEvents(transfer, 5);
+        }
+    }
+    accountTransfer(transfer);
+    _transport->release(transfer);
+    span.finish();
+
+    // Результат LIBUSB_ERROR_INTERRUPTED означает отмену запроса, а не сбой
+    // обмена, независимо от того, отменен ли запрос в этом вызове: при вос-
+    // произведении записи (см. ReplayTransport) запрос завершается записанным
+    // результатом сразу, без вызова cancel()
+    if (transfer.result == LIBUSB_ERROR_INTERRUPTED)
+    {
+        log_debug2_m << "USB relay poll preempted by command";
+        return -2;
+    }
+
+    res = transfer.result;
+    if (res != transfer.length)
+    {
+        alog::Line logLine =
+            log_error_m << "Failed send message to USB interface";
+        if (res < 0)
+        {
+            _usbLastErrorCode = res;
+            logLine << ". Error code: " << res
+                    << ". Detail: " << libusb_error_name(res);
+        }
+        ++_usbContinuousErrors;
+        return -1;
+    }
+    memcpy(buff, transfer.data, transfer.length);
+
+    _usbContinuousErrors = 0;
+    _usbLastErrorCode = 0;
+    return quint8(buff[7]); // Байт 7 содержит битовые флаги состояний реле
+}
+
+bool Relay::writeCommand(quint8 cmd1, quint8 cmd2)
+{
+    char buff[8] = {0};
+    int  buffSize = sizeof(buff);
+
+    buff[0] = cmd1;
+    buff[1] = cmd2;
+
+    trace::Span span {"SET_REPORT", trace::Category::Transfer, this, cmd1};
+    int res = controlTransfer(
+                                LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_ENDPOINT_OUT,
+                                USBRQ_HID_SET_REPORT,
+                                0, // value
+                                0, // index
+                                (uchar*)buff, buffSize,
+                                REPORT_REQUEST_TIMEOUT);
+    span.finish();
+    if (res != buffSize)
+    {
+        alog::Line logLine =
+            log_error_m << "Failed send message to USB interface";
+        if (res < 0)
+        {
+            _usbLastErrorCode = res;
+            logLine << ". Error code: " << res
+                    << ". Detail: " << libusb_error_name(res);
+        }
+        ++_usbContinuousErrors;
+        return false;
+    }
+    return true;
+}
+
+QVector<int> Relay::states(quint64* version) const
 {
     QMutexLocker locker {&_threadLock}; (void) locker;
+    if (version)
+        *version = _stateVersion;
     return statesInternal();
 }
 
+quint64 Relay::waitForChange(quint64 sinceVersion, int timeout)
+{
+    using namespace std::chrono;
+
+    // Быстрая проверка без захвата блокировки
+    if (_stateVersion != sinceVersion)
+        return _stateVersion;
+
+    const steady_clock::time_point deadline =
+        steady_clock::now() + milliseconds(qMax(timeout, 0));
+
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    while (_stateVersion == sinceVersion)
+    {
+        // Плата отключена или рабочий поток останавливается: изменений
+        // состояний не будет
+        if (!_deviceInitialized || threadStop())
+            break;
+
+        if (timeout < 0)
+        {
+            _stateCond.wait(&_threadLock);
+            continue;
+        }
+        qint64 remain =
+            duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+        if (remain <= 0)
+            break;
+        _stateCond.wait(&_threadLock, (unsigned long)remain);
+    }
+    return _stateVersion;
+}
+
+void Relay::updateStates(quint8 states, int tag)
+{
+    _statesVerifiedAt = trace::now();
+    if (_states == states)
+        return;
+
+    StateChange change;
+    change.timestamp = trace::now();
+    change.tag = tag;
+    change.oldStates = _states;
+    change.newStates = states;
+
+    quint64 start = (tag == ExternalTag) ? _lastPollTime : _commandStart;
+    if (start != 0 && start < change.timestamp)
+        change.latency = quint32(qMin<quint64>((change.timestamp - start) / 1000,
+                                               std::numeric_limits<quint32>::max()));
+    _states = states;
+    change.version = ++_stateVersion;
+    _history.record(change);
+    _stateCond.wakeAll();
+}
+
 QVector<int> Relay::statesInternal() const
 {
     QVector<int> st;
-    st.resize(_count);
-    for (int i = 0; i < _count; ++i)
-        st[i] = bool(_states & (1U << i));
+    if (_board)
+        _board->unpack(_states, st);
 
     return st;
 }
@@ -601,44 +1702,136 @@ QVector<int> Relay::statesInternal() const
 
 bool Relay::toggle(int relayNumber, bool value, int tag)
 {
+    const quint64 start = trace::now();
+    CommandScope commandScope {this}; (void) commandScope;
+    trace::Span lockSpan {"lock", trace::Category::Lock, this};
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    lockSpan.finish();
+    return retryCommand(locker, start, [&]() {
+        return toggleInternal(relayNumber, value, tag);
+    });
+}
+
+bool Relay::post(int relayNumber, bool value, int tag)
+{
+    // Резервирование места в очереди. Размер кольца не меньше _queueCapacity,
+    // поэтому успешный резерв гарантирует наличие свободной ячейки
+    int backlog = _backlog.fetch_add(1, std::memory_order_acq_rel);
+    if (backlog >= _queueCapacity)
+    {
+        _backlog.fetch_sub(1, std::memory_order_acq_rel);
+        ++_commandsRejected;
+        log_warn_m << log_format(
+            "Failed post command for relay %?. Command queue is full (%?)",
+            relayNumber, backlog);
+        return false;
+    }
+
+    quint64 pos = _enqueuePos.fetch_add(1, std::memory_order_relaxed);
+    CommandSlot& slot = _commandRing[pos & (CommandRingSize - 1)];
+
+    // Ячейка может быть еще не освобождена потребителем, если он извлек из
+    // нее команду, но не успел обновить поле seq
+    while (slot.seq.load(std::memory_order_acquire) != pos)
+        sched_yield();
+
+    slot.command = {relayNumber, tag, value, trace::now()};
+    slot.seq.store(pos + 1, std::memory_order_release);
+
+    // Рабочий поток обрабатывает очередь до опустошения, поэтому пробуждение
+    // требуется только при добавлении команды в пустую очередь
+    if (backlog == 0)
+        wakeWorker();
+    return true;
+}
+
+Relay::TimedResult Relay::toggleAt(int relayNumber, bool value, quint64 deadline,
+                                   int tag)
+{
+    TimedResult result;
+    result.deadline = deadline;
+
+    // Ожидание выполняется без захвата блокировки, рабочий поток и другие
+    // команды на это время не задерживаются. Активная команда приостанавли-
+    // вает фоновый опрос (см. pollStates()), поэтому к моменту переключения
+    // блокировка свободна, если нет конкурирующих команд
+    CommandScope commandScope {this}; (void) commandScope;
+
+    if (deadline > trace::now() + TIMED_SPIN_WINDOW)
+        sleepUntil(deadline - TIMED_SPIN_WINDOW);
+    while (trace::now() < deadline) {}
+
+    trace::Span lockSpan {"lock", trace::Category::Lock, this};
     QMutexLocker locker {&_threadLock}; (void) locker;
-    return toggleInternal(relayNumber, value, tag);
+    lockSpan.finish();
+
+    _commandStart = deadline;
+    result.success = toggleInternal(relayNumber, value, tag, &result);
+
+    if (result.issueTime != 0)
+        log_debug_m << log_format(
+            "Timed toggle of relay %?: issue error %? us, transfer %? us",
+            relayNumber, result.issueError() / 1000,
+            qint64(result.completeTime - result.issueTime) / 1000);
+    return result;
 }
 
-bool Relay::toggleInternal(int relayNumber, bool value, int tag)
+bool Relay::toggleInternal(int relayNumber, bool value, int tag,
+                           TimedResult* timed)
 {
     if (!_deviceInitialized)
     {
+        if (realtimeThread)
+            return failRealtime(relayNumber, tag, false);
+
         alog::Line logLine =
             log_error_m << "Failed toggle relay. Device not initialized";
-        emit failChange(relayNumber, logLine.impl->buff.c_str(), tag);
+        failChangeInternal(relayNumber, logLine.impl->buff.c_str(), tag, false);
         return false;
     }
 
-    int relayCount = _count;
-    if (relayNumber > relayCount)
+    const ActiveBoardOps* board = _board;
+    if (relayNumber > board->count)
     {
+        if (realtimeThread)
+            return failRealtime(relayNumber, tag, false);
+
         alog::Line logLine = log_error_m << log_format(
             "Failed toggle relay number %?. Number out of range [1..%?]",
             relayNumber, count());
 
-        emit failChange(relayNumber, logLine.impl->buff.c_str(), tag);
+        failChangeInternal(relayNumber, logLine.impl->buff.c_str(), tag, false);
         return false;
     }
 
+    // Для команд toggleAt() проверка не выполняется:  транзакция  должна
+    // состояться в заданный момент
+    if (timed == nullptr)
+    {
+        const quint8 mask = board->mask(qMax(relayNumber, 0));
+        if (idempotentHit(mask, value ? mask : 0))
+        {
+            ++_commandsSkipped;
+            if (_idempotentEmitChanged && (!realtimeThread || realtimeSignals))
+                emit changed(qMax(relayNumber, 0), tag);
+            return true;
+        }
+    }
+
     char buff[8];
     int  buffSize = sizeof(buff);
 
     quint8 cmd1 = 0;
     quint8 cmd2 = 0;
     quint8 expectStates = 0;
+    quint8 checkMask = 0xFF;
 
     if (relayNumber <= 0)
     {
         if (value == true)
         {
             cmd1 = 0xFE; // Включить все реле
-            expectStates = (1U << relayCount) - 1;
+            expectStates = board->allMask;
         }
         else
         {
@@ -647,18 +1840,32 @@ bool Relay::toggleInternal(int relayNumber, bool value, int tag)
         }
         relayNumber = 0;
     }
+    else if (timed)
+    {
+        // Для команды toggleAt() предварительное чтение состояний не выпол-
+        // няется, чтобы не задерживать отправку команды. Результат проверяет-
+        // ся только для переключаемого реле
+        checkMask = board->mask(relayNumber);
+        expectStates = _states;
+    }
     else
     {
         memset(buff, 0, buffSize);
         int states = readStates(buff, buffSize);
         if (states < 0)
         {
+            if (realtimeThread)
+                return failRealtime(relayNumber, tag, true);
+
             alog::Line logLine = log_error_m << "Failed get relays current state";
-            emit failChange(relayNumber, logLine.impl->buff.c_str(), tag);
+            failChangeInternal(relayNumber, logLine.impl->buff.c_str(), tag, true);
             return false;
         }
         expectStates = quint8(states);
+    }
 
+    if (relayNumber > 0)
+    {
         if (value == true)
         {
             cmd1 = 0xFF; // Включить реле по номеру
@@ -675,58 +1882,1014 @@ bool Relay::toggleInternal(int relayNumber, bool value, int tag)
     memset(buff, 0, sizeof(buff));
     buff[0] = cmd1;
     buff[1] = cmd2;
-    int res = libusb_control_transfer(_deviceHandle,
+
+    if (timed)
+        timed->issueTime = trace::now();
+
+    trace::Span span {"SET_REPORT", trace::Category::Transfer, this, cmd1};
+    int res = controlTransfer(
                                 LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_ENDPOINT_OUT,
                                 USBRQ_HID_SET_REPORT,
                                 0, // value
                                 0, // index
                                 (uchar*)buff, buffSize,
                                 REPORT_REQUEST_TIMEOUT);
+    span.finish();
+    if (timed)
+        timed->completeTime = trace::now();
     if (res != buffSize)
     {
+        ++_usbContinuousErrors;
+        if (res < 0)
+            _usbLastErrorCode = res;
+        if (realtimeThread)
+            return failRealtime(relayNumber, tag, true);
+
         alog::Line logLine =
             log_error_m << "Failed send message to USB interface";
         if (res < 0)
-        {
-            _usbLastErrorCode = res;
             logLine << ". Error code: " << res
                     << ". Detail: " << libusb_error_name(res);
-        }
-        ++_usbContinuousErrors;
-        emit failChange(relayNumber, logLine.impl->buff.c_str(), tag);
+        failChangeInternal(relayNumber, logLine.impl->buff.c_str(), tag, true);
         return false;
     }
 
     int states = readStates(buff, buffSize);
     if (states < 0)
     {
+        if (realtimeThread)
+            return failRealtime(relayNumber, tag, true);
+
         alog::Line logLine = log_error_m << "Failed get relays current state";
-        emit failChange(relayNumber, logLine.impl->buff.c_str(), tag);
+        failChangeInternal(relayNumber, logLine.impl->buff.c_str(), tag, true);
         return false;
     }
-    _states = quint8(states);
+    updateStates(quint8(states), tag);
 
-    if (_states != expectStates)
+    if ((_states ^ expectStates) & checkMask)
     {
+        if (realtimeThread)
+            return failRealtime(relayNumber, tag, true);
+
         alog::Line logLine = log_error_m << "Failed set relays to new state";
-        emit failChange(relayNumber, logLine.impl->buff.c_str(), tag);
+        failChangeInternal(relayNumber, logLine.impl->buff.c_str(), tag, true);
         return false;
     }
 
-    if (relayNumber <= 0)
-        log_verbose_m << log_format(
-            "USB all relay turn %?", (value) ? "ON" : "OFF");
-    else
-        log_verbose_m << log_format(
-            "USB relay %? turn %?", relayNumber, (value) ? "ON" : "OFF");
+    if (!realtimeThread)
+    {
+        if (relayNumber <= 0)
+            log_verbose_m << log_format(
+                "USB all relay turn %?", (value) ? "ON" : "OFF");
+        else
+            log_verbose_m << log_format(
+                "USB relay %? turn %?", relayNumber, (value) ? "ON" : "OFF");
+    }
 
-    emit changed(relayNumber, tag);
+    if (!realtimeThread || realtimeSignals)
+    {
+        trace::Span span {"changed", trace::Category::Signal, this, relayNumber};
+        emit changed(relayNumber, tag);
+    }
+    resetPollInterval();
 
     _usbContinuousErrors = 0;
     _usbLastErrorCode = 0;
     return true;
 }
 
+bool Relay::toggleGroup(quint8 mask, quint8 values, int tag)
+{
+    const quint64 start = trace::now();
+    CommandScope commandScope {this}; (void) commandScope;
+    trace::Span lockSpan {"lock", trace::Category::Lock, this};
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    lockSpan.finish();
+    return retryCommand(locker, start, [&]() {
+        return toggleGroupInternal(mask, values, tag);
+    });
+}
+
+bool Relay::retryCommand(QMutexLocker& locker, quint64 start,
+                         const std::function<bool()>& command)
+{
+    using namespace std::chrono;
+
+    const RetryPolicy policy = _retryPolicy;
+    const steady_clock::time_point deadline =
+        steady_clock::now() + milliseconds(policy.deadline);
+
+    // Счетчик ошибок обмена учитывает только окончательный результат команды,
+    // неудачные попытки, за которыми следует повтор, в нем не отражаются
+    const int continuousErrors = _usbContinuousErrors;
+
+    for (int attempt = 0;; ++attempt)
+    {
+        _commandStart = start;
+        _failDeferrable = (attempt + 1 < policy.maxAttempts);
+        _failDeferred = false;
+        bool success = command();
+        _failDeferrable = false;
+
+        if (success)
+        {
+            if (attempt > 0)
+                ++_retriesRecovered;
+            return true;
+        }
+        if (!_failDeferred)
+        {
+            // Логическая ошибка или последняя попытка, сигнал уже эмитирован
+            if (attempt > 0)
+                ++_retriesExhausted;
+            return false;
+        }
+
+        int delay = retryDelay(policy, attempt);
+
+        if (policy.deadline > 0
+            && steady_clock::now() + milliseconds(delay) >= deadline)
+        {
+            if (attempt > 0)
+                ++_retriesExhausted;
+            ++_commandFailures;
+            if (realtimeThread)
+            {
+                if (realtimeSignals)
+                    emit failChange(_failRelayNumber, QString(), _failTag);
+                return false;
+            }
+            log_error_m << log_format(
+                "Command retry deadline (%? ms) expired after %? attempt(s)",
+                policy.deadline, attempt + 1);
+            emit failChange(_failRelayNumber, _failMessage, _failTag);
+            return false;
+        }
+
+        ++_retries;
+        _usbContinuousErrors = continuousErrors;
+        if (!realtimeThread)
+            log_debug_m << log_format(
+                "Command failed (attempt %? of %?). Retry after %? ms",
+                attempt + 1, policy.maxAttempts, delay);
+
+        locker.unlock();
+        msleep(delay);
+        locker.relock();
+    }
+}
+
+int Relay::retryDelay(const RetryPolicy& policy, int attempt)
+{
+    // Генератор для выбора паузы между попытками. Отдельный экземпляр на поток,
+    // чтобы не требовалась синхронизация
+    thread_local std::mt19937 random {std::random_device{}()};
+
+    qint64 backoff = qint64(policy.backoffBase) << qMin(attempt, 30);
+    backoff = qMin(backoff, qint64(policy.backoffMax));
+    return std::uniform_int_distribution<int>{0, int(backoff)}(random);
+}
+
+bool Relay::failRealtime(int relayNumber, int tag, bool transient)
+{
+    if (transient && _failDeferrable)
+    {
+        _failDeferred = true;
+        _failRelayNumber = relayNumber;
+        _failTag = tag;
+        return false;
+    }
+    ++_commandFailures;
+    if (realtimeSignals)
+        emit failChange(relayNumber, QString(), tag);
+    return false;
+}
+
+void Relay::failChangeInternal(int relayNumber, const QString& errorMessage,
+                               int tag, bool transient)
+{
+    if (transient && _failDeferrable)
+    {
+        _failDeferred = true;
+        _failRelayNumber = relayNumber;
+        _failTag = tag;
+        _failMessage = errorMessage;
+        return;
+    }
+    ++_commandFailures;
+    emit failChange(relayNumber, errorMessage, tag);
+}
+
+bool Relay::toggleGroupInternal(quint8 mask, quint8 values, int tag)
+{
+    if (!_deviceInitialized)
+    {
+        alog::Line logLine =
+            log_error_m << "Failed toggle relay group. Device not initialized";
+        failChangeInternal(0, logLine.impl->buff.c_str(), tag, false);
+        return false;
+    }
+
+    if (mask & ~_board->allMask)
+    {
+        alog::Line logLine = log_error_m << log_format(
+            "Failed toggle relay group. Mask %? out of range of relay count %?",
+            int(mask), int(_count));
+        failChangeInternal(0, logLine.impl->buff.c_str(), tag, false);
+        return false;
+    }
+
+    if (idempotentHit(mask, values))
+    {
+        ++_commandsSkipped;
+        if (_idempotentEmitChanged)
+            for (int i = 0; i < _count; ++i)
+                if (mask & (1U << i))
+                    emit changed(i + 1, tag);
+        return true;
+    }
+
+    char buff[8] = {0};
+    int states = readStates(buff, sizeof(buff));
+    if (states < 0)
+    {
+        alog::Line logLine = log_error_m << "Failed get relays current state";
+        failChangeInternal(0, logLine.impl->buff.c_str(), tag, true);
+        return false;
+    }
+    const quint8 prevStates = quint8(states);
+    const quint8 expectStates = (prevStates & ~mask) | (values & mask);
+
+    return writeGroup(prevStates, expectStates, tag);
+}
+
+Relay::CasResult Relay::compareAndSet(quint8 expectedStates, quint8 newStates,
+                                     quint8* actualStates, int tag)
+{
+    const quint64 start = trace::now();
+    CommandScope commandScope {this}; (void) commandScope;
+    trace::Span lockSpan {"lock", trace::Category::Lock, this};
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    lockSpan.finish();
+
+    CasResult result = CasResult::Failed;
+    retryCommand(locker, start, [&]() {
+        result = compareAndSetInternal(expectedStates, newStates, actualStates, tag);
+        return (result != CasResult::Failed);
+    });
+    return result;
+}
+
+Relay::CasResult Relay::compareAndSetInternal(quint8 expectedStates, quint8 newStates,
+                                              quint8* actualStates, int tag)
+{
+    if (!_deviceInitialized)
+    {
+        alog::Line logLine =
+            log_error_m << "Failed compare-and-set relays. Device not initialized";
+        failChangeInternal(0, logLine.impl->buff.c_str(), tag, false);
+        return CasResult::Failed;
+    }
+
+    const quint8 allMask = _board->allMask;
+    if ((expectedStates | newStates) & ~allMask)
+    {
+        alog::Line logLine = log_error_m << log_format(
+            "Failed compare-and-set relays. States %?/%? out of range"
+            " of relay count %?", int(expectedStates), int(newStates), int(_count));
+        failChangeInternal(0, logLine.impl->buff.c_str(), tag, false);
+        return CasResult::Failed;
+    }
+
+    char buff[8] = {0};
+    int states = readStates(buff, sizeof(buff));
+    if (states < 0)
+    {
+        alog::Line logLine = log_error_m << "Failed get relays current state";
+        failChangeInternal(0, logLine.impl->buff.c_str(), tag, true);
+        return CasResult::Failed;
+    }
+    const quint8 prevStates = quint8(states) & allMask;
+
+    if (prevStates != expectedStates)
+    {
+        // Состояния, измененные извне, сразу переносятся в кэш и сообщаются
+        // сигналом changed(), как при опросе платы
+        if (quint8(states) != _states)
+            externalChange(quint8(states));
+
+        if (actualStates)
+            *actualStates = prevStates;
+
+        log_debug_m << log_format(
+            "Compare-and-set conflict. Expected: %?. Actual: %?",
+            int(expectedStates), int(prevStates));
+        return CasResult::Conflict;
+    }
+
+    const quint8 expectStates = newStates | (quint8(states) & ~allMask);
+    if (!writeGroup(quint8(states), expectStates, tag))
+        return CasResult::Failed;
+
+    if (actualStates)
+        *actualStates = _states & allMask;
+    return CasResult::Success;
+}
+
+bool Relay::Transaction::set(int relayNumber, bool value)
+{
+    if (relayNumber < 1 || relayNumber > 8)
+    {
+        _invalid = true;
+        return false;
+    }
+    const quint8 bit = quint8(1U << (relayNumber - 1));
+    _mask |= bit;
+    _values = value ? (_values | bit) : (_values & ~bit);
+    return true;
+}
+
+Relay::Transaction Relay::begin(int tag) const
+{
+    Transaction transaction;
+    transaction._relay = this;
+    transaction._tag = tag;
+    return transaction;
+}
+
+bool Relay::commit(const Transaction& transaction)
+{
+    const quint64 start = trace::now();
+    CommandScope commandScope {this}; (void) commandScope;
+    trace::Span lockSpan {"lock", trace::Category::Lock, this};
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    lockSpan.finish();
+    bool success = retryCommand(locker, start, [&]() {
+        return commitInternal(transaction);
+    });
+
+    trace::Span span {"committed", trace::Category::Signal, this};
+    emit committed(transaction._tag, success);
+    return success;
+}
+
+bool Relay::commitInternal(const Transaction& transaction)
+{
+    const int tag = transaction._tag;
+    if (transaction._relay != this)
+    {
+        alog::Line logLine = log_error_m
+            << "Failed commit transaction. Transaction was started by another relay";
+        failChangeInternal(0, logLine.impl->buff.c_str(), tag, false);
+        return false;
+    }
+
+    if (!_deviceInitialized)
+    {
+        alog::Line logLine =
+            log_error_m << "Failed commit transaction. Device not initialized";
+        failChangeInternal(0, logLine.impl->buff.c_str(), tag, false);
+        return false;
+    }
+
+    const quint8 mask = transaction._mask;
+    if (transaction._invalid || (mask & ~_board->allMask))
+    {
+        alog::Line logLine = log_error_m << log_format(
+            "Failed commit transaction. Mask %? out of range of relay count %?",
+            int(mask), int(_count));
+        failChangeInternal(0, logLine.impl->buff.c_str(), tag, false);
+        return false;
+    }
+
+    char buff[8] = {0};
+    int states = readStates(buff, sizeof(buff));
+    if (states < 0)
+    {
+        alog::Line logLine = log_error_m << "Failed get relays current state";
+        failChangeInternal(0, logLine.impl->buff.c_str(), tag, true);
+        return false;
+    }
+    const quint8 prevStates = quint8(states);
+    const quint8 expectStates = (prevStates & ~mask) | (transaction._values & mask);
+
+    // Состояния, измененные извне до начала транзакции, сообщаются отдельно,
+    // как при опросе платы
+    if (prevStates != _states)
+        externalChange(prevStates);
+
+    // Промежуточные состояния (после части команд прямого переключения и
+    // отката) в кэш и историю не заносятся: кэш обновляется однократно, когда
+    // исход транзакции окончательно известен
+    const char* error = nullptr;
+    if (applyGroup(prevStates, expectStates, states, error))
+    {
+        updateStates(quint8(states), tag);
+
+        if (!_realtimeActive)
+            log_verbose_m << log_format(
+                "USB relay transaction committed. Old value: %?. New value: %?",
+                int(prevStates), int(expectStates));
+
+        resetPollInterval();
+
+        _usbContinuousErrors = 0;
+        _usbLastErrorCode = 0;
+        return true;
+    }
+
+    // Откат: реле возвращаются в состояния, предшествовавшие транзакции.
+    // Текущие состояния перечитываются, так как обмен мог быть прерван
+    // на любой из команд
+    bool rolledBack = false;
+    states = readStates(buff, sizeof(buff));
+    if (states >= 0 && quint8(states) == prevStates)
+    {
+        rolledBack = true;
+    }
+    else if (states >= 0)
+    {
+        const char* rollbackError = nullptr;
+        rolledBack = applyGroup(quint8(states), prevStates, states, rollbackError);
+        if (states < 0)
+            states = readStates(buff, sizeof(buff));
+    }
+
+    // Если откат не удался, в кэш заносятся фактические состояния платы, об
+    // изменившихся реле сообщается сигналом changed()
+    if (states >= 0 && quint8(states) != _states)
+    {
+        const quint8 cachedStates = _states;
+        updateStates(quint8(states), tag);
+
+        trace::Span span {"changed", trace::Category::Signal, this};
+        for (int i = 0; i < _count; ++i)
+            if ((cachedStates ^ _states) & (1U << i))
+                emit changed(i + 1, tag);
+    }
+
+    alog::Line logLine = log_error_m << log_format(
+        "Failed commit transaction (%? -> %?): %?. %?",
+        int(prevStates), int(expectStates), error,
+        (rolledBack) ? "Relay states rolled back"
+                     : "Failed roll back relay states");
+    failChangeInternal(0, logLine.impl->buff.c_str(), tag, true);
+    return false;
+}
+
+bool Relay::writeGroup(quint8 prevStates, quint8 expectStates, int tag)
+{
+    int states = -1;
+    const char* error = nullptr;
+    bool success = applyGroup(prevStates, expectStates, states, error);
+    if (states >= 0)
+        updateStates(quint8(states), tag);
+
+    if (!success)
+    {
+        alog::Line logLine = log_error_m << error;
+        failChangeInternal(0, logLine.impl->buff.c_str(), tag, true);
+        return false;
+    }
+
+    if (!_realtimeActive)
+        log_verbose_m << log_format(
+            "USB relay group changed. Old value: %?. New value: %?",
+            int(prevStates), int(expectStates));
+
+    { //Block for trace::Span
+        trace::Span span {"changed", trace::Category::Signal, this};
+        for (int i = 0; i < _count; ++i)
+            if ((prevStates ^ expectStates) & (1U << i))
+                emit changed(i + 1, tag);
+    }
+    resetPollInterval();
+
+    _usbContinuousErrors = 0;
+    _usbLastErrorCode = 0;
+    return true;
+}
+
+bool Relay::applyGroup(quint8 prevStates, quint8 expectStates, int& states,
+                       const char*& error)
+{
+    char buff[8] = {0};
+    quint8 commands[8][2];
+    int commandsCount = _board->planCommands(prevStates, expectStates, commands);
+
+    states = -1;
+    for (int i = 0; i < commandsCount; ++i)
+        if (!writeCommand(commands[i][0], commands[i][1]))
+        {
+            error = "Failed toggle relay group";
+            return false;
+        }
+
+    states = readStates(buff, sizeof(buff));
+    if (states < 0)
+    {
+        error = "Failed get relays current state";
+        return false;
+    }
+    if (quint8(states) != expectStates)
+    {
+        error = "Failed set relays to new state";
+        return false;
+    }
+    return true;
+}
+
+static void traceTransfer(const char* name, const Relay* relay,
+                          const Transport::AsyncTransfer& transfer, int arg)
+{
+    if (!trace::enabled())
+        return;
+
+    using namespace std::chrono;
+    trace::record(name, trace::Category::Transfer, relay,
+        quint64(duration_cast<nanoseconds>(transfer.submitTime.time_since_epoch()).count()),
+        quint64(duration_cast<nanoseconds>(transfer.completeTime.time_since_epoch()).count()),
+        arg);
+}
+
+bool Relay::syncPrepare(SyncGroup& group)
+{
+    _commandStart = trace::now();
+    if (!_deviceInitialized)
+    {
+        alog::Line logLine =
+            log_error_m << "Failed toggle relay group. Device not initialized";
+        failChangeInternal(0, logLine.impl->buff.c_str(), group.tag, false);
+        return false;
+    }
+
+    if (group.mask & ~_board->allMask)
+    {
+        alog::Line logLine = log_error_m << log_format(
+            "Failed toggle relay group. Mask %? out of range of relay count %?",
+            int(group.mask), int(_count));
+        failChangeInternal(0, logLine.impl->buff.c_str(), group.tag, false);
+        return false;
+    }
+
+    char buff[8] = {0};
+    int states = readStates(buff, sizeof(buff));
+    if (states < 0)
+    {
+        alog::Line logLine = log_error_m << "Failed get relays current state";
+        failChangeInternal(0, logLine.impl->buff.c_str(), group.tag, false);
+        return false;
+    }
+    group.prevStates = quint8(states);
+    group.expectStates = (group.prevStates & ~group.mask) | (group.values & group.mask);
+
+    quint8 commands[8][2];
+    group.transferCount =
+        _board->planCommands(group.prevStates, group.expectStates, commands);
+
+    // Команды только готовятся: отправка любой из них до syncSubmit() пере-
+    // ключила бы часть реле платы раньше остальных плат
+    for (int i = 0; i < group.transferCount; ++i)
+    {
+        Transport::AsyncTransfer& transfer = group.transfers[i];
+        transfer.requestType = LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_ENDPOINT_OUT;
+        transfer.request = USBRQ_HID_SET_REPORT;
+        transfer.length = sizeof(transfer.data);
+        memset(transfer.data, 0, sizeof(transfer.data));
+        transfer.data[0] = commands[i][0];
+        transfer.data[1] = commands[i][1];
+    }
+    return true;
+}
+
+void Relay::syncSubmit(SyncGroup& group)
+{
+    for (int i = 0; i < group.transferCount; ++i)
+    {
+        int res = _transport->submit(group.transfers[i], REPORT_REQUEST_TIMEOUT);
+        if (res != LIBUSB_SUCCESS)
+        {
+            log_error_m << "Failed submit message to USB interface"
+                        << ". Error code: " << res
+                        << ". Detail: " << libusb_error_name(res);
+
+            // Последующие команды плана не отправляются, результат проверяет-
+            // ся в syncFinish()
+            group.transferCount = i + 1;
+            break;
+        }
+    }
+}
+
+void Relay::syncHandleEvents(SyncGroup& group, int timeout)
+{
+    for (int i = 0; i < group.transferCount; ++i)
+        if (!group.transfers[i].completed)
+        {
+            _transport->handleEvents(group.transfers[i], timeout);
+            break;
+        }
+}
+
+bool Relay::syncFinish(SyncGroup& group)
+{
+    int failedResult = 0;
+    for (int i = 0; i < group.transferCount; ++i)
+    {
+        Transport::AsyncTransfer& transfer = group.transfers[i];
+        traceTransfer("SET_REPORT async", this, transfer, transfer.data[0]);
+        accountTransfer(transfer);
+        _transport->release(transfer);
+
+        if (transfer.result != transfer.length && failedResult == 0)
+            failedResult = (transfer.result < 0) ? transfer.result : LIBUSB_ERROR_IO;
+    }
+
+    // Часть команд плана могла быть исполнена, поэтому состояния перечиты-
+    // ваются и при ошибке отправки
+    char buff[8] = {0};
+    int states = readStates(buff, sizeof(buff));
+    if (states >= 0)
+        updateStates(quint8(states), group.tag);
+
+    if (failedResult != 0)
+    {
+        alog::Line logLine =
+            log_error_m << "Failed send message to USB interface"
+                        << ". Error code: " << failedResult
+                        << ". Detail: " << libusb_error_name(failedResult);
+        _usbLastErrorCode = failedResult;
+        ++_usbContinuousErrors;
+        failChangeInternal(0, logLine.impl->buff.c_str(), group.tag, false);
+        return false;
+    }
+
+    if (states < 0)
+    {
+        alog::Line logLine = log_error_m << "Failed get relays current state";
+        failChangeInternal(0, logLine.impl->buff.c_str(), group.tag, false);
+        return false;
+    }
+
+    if (_states != group.expectStates)
+    {
+        alog::Line logLine = log_error_m << "Failed set relays to new state";
+        failChangeInternal(0, logLine.impl->buff.c_str(), group.tag, false);
+        return false;
+    }
+
+    { //Block for trace::Span
+        trace::Span span {"changed", trace::Category::Signal, this};
+        for (int i = 0; i < _count; ++i)
+            if ((group.prevStates ^ group.expectStates) & (1U << i))
+                emit changed(i + 1, group.tag);
+    }
+    resetPollInterval();
+
+    _usbContinuousErrors = 0;
+    _usbLastErrorCode = 0;
+    return true;
+}
+
+bool Relay::asyncStart(bool pollDue)
+{
+    AsyncOp& op = _asyncOp;
+    if (op.transferCount > 0)
+        return false;
+
+    trace::Span lockSpan {"lock", trace::Category::Lock, this};
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    lockSpan.finish();
+
+    if (op.kind == AsyncOp::Kind::Command)
+    {
+        // Ожидается повтор команды после неудачной попытки
+        if (trace::now() < op.retryTime)
+            return false;
+
+        return asyncSubmit();
+    }
+
+    while (_backlog > 0)
+    {
+        Command cmd;
+        if (!popCommand(cmd))
+        {
+            // Производитель зарезервировал место в очереди, но еще не опубли-
+            // ковал команду. Реактор вернется к плате на следующей итерации
+            break;
+        }
+
+        _commandStart = cmd.postTime;
+        if (!_deviceInitialized)
+        {
+            alog::Line logLine =
+                log_error_m << "Failed toggle relay. Device not initialized";
+            failChangeInternal(cmd.relayNumber, logLine.impl->buff.c_str(), cmd.tag, false);
+            continue;
+        }
+
+        const ActiveBoardOps* board = _board;
+        if (cmd.relayNumber > board->count)
+        {
+            alog::Line logLine = log_error_m << log_format(
+                "Failed toggle relay number %?. Number out of range [1..%?]",
+                cmd.relayNumber, count());
+            failChangeInternal(cmd.relayNumber, logLine.impl->buff.c_str(), cmd.tag, false);
+            continue;
+        }
+
+        const int relayNumber = qMax(cmd.relayNumber, 0);
+        const quint8 mask = board->mask(relayNumber);
+        if (idempotentHit(mask, cmd.value ? mask : 0))
+        {
+            ++_commandsSkipped;
+            if (_idempotentEmitChanged)
+                emit changed(relayNumber, cmd.tag);
+            continue;
+        }
+
+        // Команда отправляется без предварительного чтения состояний, резуль-
+        // тат проверяется только для переключаемых реле
+        if (relayNumber == 0)
+        {
+            op.cmd1 = (cmd.value) ? 0xFE : 0xFC; // Включить/выключить все реле
+            op.cmd2 = 0;
+        }
+        else
+        {
+            op.cmd1 = (cmd.value) ? 0xFF : 0xFD; // Включить/выключить реле по номеру
+            op.cmd2 = quint8(relayNumber);
+        }
+        op.checkMask = mask;
+        op.expectStates = (cmd.value) ? mask : 0;
+
+        op.kind = AsyncOp::Kind::Command;
+        op.command = cmd;
+        op.attempt = 0;
+        op.retryTime = 0;
+        op.deadline = trace::now() + quint64(_retryPolicy.deadline) * 1000000;
+        return asyncSubmit();
+    }
+
+    // Опрос уступает приоритет командам
+    if (!pollDue || _commandsActive > 0 || _backlog > 0)
+        return false;
+
+    op.kind = AsyncOp::Kind::Poll;
+    op.version = _stateVersion;
+    return asyncSubmit();
+}
+
+bool Relay::asyncSubmit()
+{
+    AsyncOp& op = _asyncOp;
+
+    auto prepare = [](Transport::AsyncTransfer& transfer, bool out)
+    {
+        transfer = Transport::AsyncTransfer();
+        transfer.requestType = LIBUSB_REQUEST_TYPE_CLASS
+                               | ((out) ? LIBUSB_ENDPOINT_OUT : LIBUSB_ENDPOINT_IN);
+        transfer.request = (out) ? USBRQ_HID_SET_REPORT : USBRQ_HID_GET_REPORT;
+        transfer.length = sizeof(transfer.data);
+    };
+
+    // Для команды чтение состояний отправляется вместе с командой: запросы
+    // к плате исполняются последовательно в порядке отправки
+    if (op.kind == AsyncOp::Kind::Command)
+    {
+        prepare(op.transfers[0], true);
+        op.transfers[0].data[0] = op.cmd1;
+        op.transfers[0].data[1] = op.cmd2;
+        prepare(op.transfers[1], false);
+        op.transferCount = 2;
+    }
+    else
+    {
+        prepare(op.transfers[0], false);
+        op.transferCount = 1;
+    }
+    op.cancelled = false;
+
+    for (int i = 0; i < op.transferCount; ++i)
+    {
+        int res = _transport->submit(op.transfers[i], REPORT_REQUEST_TIMEOUT);
+        if (res != LIBUSB_SUCCESS)
+        {
+            // Запрос завершен с ошибкой при отправке, результат обрабатывает-
+            // ся в asyncFinish()
+            op.transferCount = i + 1;
+            break;
+        }
+    }
+    return true;
+}
+
+void Relay::asyncEvents()
+{
+    AsyncOp& op = _asyncOp;
+    if (op.transferCount == 0)
+        return;
+
+    trace::Span lockSpan {"lock", trace::Category::Lock, this};
+    QMutexLocker locker {&_threadLock}; (void) locker;
+    lockSpan.finish();
+
+    // Опрос отменяется, чтобы поступившая команда не ожидала его завершения
+    if (op.kind == AsyncOp::Kind::Poll && !op.cancelled
+        && (_commandsActive > 0 || _backlog > 0 || _deviceLeft))
+    {
+        _transport->cancel(op.transfers[0]);
+        op.cancelled = true;
+    }
+
+    _transport->processEvents();
+    for (int i = 0; i < op.transferCount; ++i)
+        if (!op.transfers[i].completed)
+            return;
+
+    asyncFinish(true);
+}
+
+void Relay::asyncAbort()
+{
+    AsyncOp& op = _asyncOp;
+    if (op.kind == AsyncOp::Kind::None)
+        return;
+
+    QMutexLocker locker {&_threadLock}; (void) locker;
+
+    for (int i = 0; i < op.transferCount; ++i)
+        _transport->cancel(op.transfers[i]);
+
+    for (int i = 0; i < op.transferCount; ++i)
+        while (!op.transfers[i].completed)
+            _transport->handleEvents(op.transfers[i], 100);
+
+    asyncFinish(false);
+}
+
+int Relay::asyncRetryDelay() const
+{
+    const AsyncOp& op = _asyncOp;
+    if (op.kind != AsyncOp::Kind::Command || op.transferCount > 0)
+        return -1;
+
+    const quint64 now = trace::now();
+    return (op.retryTime > now) ? int((op.retryTime - now + 999999) / 1000000) : 0;
+}
+
+void Relay::asyncFinish(bool retryAllowed)
+{
+    AsyncOp& op = _asyncOp;
+
+    const int transferCount = op.transferCount;
+    for (int i = 0; i < transferCount; ++i)
+    {
+        Transport::AsyncTransfer& transfer = op.transfers[i];
+        if (transfer.requestType & LIBUSB_ENDPOINT_IN)
+            traceTransfer("GET_REPORT async", this, transfer, 0);
+        else
+            traceTransfer("SET_REPORT async", this, transfer, transfer.data[0]);
+        accountTransfer(transfer);
+        _transport->release(transfer);
+    }
+    op.transferCount = 0;
+
+    if (op.kind == AsyncOp::Kind::Poll)
+    {
+        op.kind = AsyncOp::Kind::None;
+        const Transport::AsyncTransfer& transfer = op.transfers[0];
+
+        // Результат LIBUSB_ERROR_INTERRUPTED означает отмену запроса, а не сбой
+        // обмена (см. readStatesPreemptible())
+        if (transfer.result == LIBUSB_ERROR_INTERRUPTED)
+        {
+            log_debug2_m << "USB relay poll preempted by command";
+            return;
+        }
+
+        const int res = transfer.result;
+        if (res != transfer.length)
+        {
+            alog::Line logLine =
+                log_error_m << "Failed send message to USB interface";
+            if (res < 0)
+            {
+                _usbLastErrorCode = res;
+                logLine << ". Error code: " << res
+                        << ". Detail: " << libusb_error_name(res);
+            }
+            ++_usbContinuousErrors;
+            return;
+        }
+        _usbContinuousErrors = 0;
+        _usbLastErrorCode = 0;
+
+        // Если во время опроса состояния были изменены командой, результат
+        // опроса мог устареть
+        if (_stateVersion != op.version || _commandsActive > 0)
+            return;
+
+        pollCompleted(quint8(transfer.data[7])); // Байт 7 содержит битовые флаги состояний реле
+        return;
+    }
+
+    if (op.kind != AsyncOp::Kind::Command)
+        return;
+
+    const Command& cmd = op.command;
+    const int relayNumber = qMax(cmd.relayNumber, 0);
+    _commandStart = cmd.postTime;
+
+    const char* error = nullptr;
+    int res = 0;
+    if (transferCount == 0)
+    {
+        // Ожидавшийся повтор команды прерван отключением платы
+        error = "Failed toggle relay. Device not initialized";
+    }
+    else if (op.transfers[0].result != op.transfers[0].length)
+    {
+        error = "Failed send message to USB interface";
+        res = (op.transfers[0].result < 0) ? op.transfers[0].result : LIBUSB_ERROR_IO;
+    }
+    else if (transferCount < 2 || op.transfers[1].result != op.transfers[1].length)
+    {
+        error = "Failed get relays current state";
+        res = (transferCount == 2 && op.transfers[1].result < 0)
+              ? op.transfers[1].result : LIBUSB_ERROR_IO;
+    }
+    else
+    {
+        updateStates(quint8(op.transfers[1].data[7]), cmd.tag);
+        if ((_states ^ op.expectStates) & op.checkMask)
+            error = "Failed set relays to new state";
+    }
+
+    if (error == nullptr)
+    {
+        op.kind = AsyncOp::Kind::None;
+        if (op.attempt > 0)
+            ++_retriesRecovered;
+
+        if (relayNumber == 0)
+            log_verbose_m << log_format(
+                "USB all relay turn %?", (cmd.value) ? "ON" : "OFF");
+        else
+            log_verbose_m << log_format(
+                "USB relay %? turn %?", relayNumber, (cmd.value) ? "ON" : "OFF");
+
+        { //Block for trace::Span
+            trace::Span span {"changed", trace::Category::Signal, this, relayNumber};
+            emit changed(relayNumber, cmd.tag);
+        }
+        resetPollInterval();
+
+        _usbContinuousErrors = 0;
+        _usbLastErrorCode = 0;
+        return;
+    }
+
+    // Повтор выполняется после паузы без ожидания в цикле событий реактора
+    // (см. asyncRetryDelay()). Счетчик ошибок обмена учитывает только оконча-
+    // тельный результат команды
+    const RetryPolicy policy = _retryPolicy;
+    if (retryAllowed && transferCount != 0 && !_deviceLeft
+        && op.attempt + 1 < policy.maxAttempts)
+    {
+        const int delay = retryDelay(policy, op.attempt);
+        const quint64 retryTime = trace::now() + quint64(delay) * 1000000;
+        if (policy.deadline <= 0 || retryTime < op.deadline)
+        {
+            ++_retries;
+            log_debug_m << log_format(
+                "%?. Command failed (attempt %? of %?). Retry after %? ms",
+                error, op.attempt + 1, policy.maxAttempts, delay);
+            ++op.attempt;
+            op.retryTime = retryTime;
+            return;
+        }
+        log_error_m << log_format(
+            "Command retry deadline (%? ms) expired after %? attempt(s)",
+            policy.deadline, op.attempt + 1);
+    }
+
+    op.kind = AsyncOp::Kind::None;
+    if (op.attempt > 0)
+        ++_retriesExhausted;
+
+    alog::Line logLine = log_error_m << error;
+    if (res < 0)
+    {
+        ++_usbContinuousErrors;
+        _usbLastErrorCode = res;
+        logLine << ". Error code: " << res
+                << ". Detail: " << libusb_error_name(res);
+    }
+    failChangeInternal(relayNumber, logLine.impl->buff.c_str(), cmd.tag, false);
+}
+
 Relay& relay()
 {
     return safe::singleton<Relay>();
@@ -28,19 +28,47 @@
 #include "shared/defmac.h"
 #include "shared/safe_singleton.h"
 #include "shared/qt/qthreadex.h"
+#include "usb_relay_board.h"
+#include "usb_relay_history.h"
+#include "usb_transport.h"
 
 #include <QtCore>
 #include <atomic>
-#include <libusb-1.0/libusb.h>
+#include <chrono>
+#include <functional>
+#include <memory>
 
 namespace usb {
 
+class RelayReactor;
+class ChannelMap;
+class HotplugMonitor;
+
 class Relay : public QThreadEx
 {
 public:
+    // Для обслуживания нескольких плат создается по одному экземпляру Relay
+    // на каждую плату. Для привязки экземпляра к конкретной плате используется
+    // функция setAttachSerial()
+    Relay();
+    ~Relay();
+
+    // Значение tag для изменений состояния, выполненных извне
+    static const int ExternalTag = -1;
+
+    // Значение tag для изменений, выполненных механизмом приведения платы
+    // к требуемому состоянию (см. setDesired())
+    static const int ReconcileTag = -2;
+
     bool init(const QVector<int>& states = {});
     void deinit();
 
+    // Устанавливает транспорт обмена с устройством (по умолчанию используется
+    // LibusbTransport). Транспорт переходит во владение Relay. Функция должна
+    // вызываться до init()
+    void setTransport(Transport*);
+    Transport* transport() const {return _transport.get();}
+
     // Наименование продукта
     QString product() const;
 
@@ -58,8 +86,25 @@ public:
     QString attachSerial() const;
     void setAttachSerial(const QString&);
 
-    // Вектор текущих состояний реле
-    QVector<int> states() const;
+    // Вектор текущих состояний реле. Если параметр version задан, в него
+    // записывается версия, соответствующая возвращенным состояниям
+    QVector<int> states(quint64* version = nullptr) const;
+
+    // Версия состояний реле. Увеличивается при каждом изменении состояний,
+    // как выполненном командой, так и обнаруженном при опросе
+    quint64 stateVersion() const {return _stateVersion;}
+
+    // Ожидает, пока версия состояний станет больше sinceVersion, но не дольше
+    // timeout миллисекунд (при timeout < 0 ожидание не ограничено). Возвра-
+    // щает текущую версию; если она равна sinceVersion, то  изменений  за
+    // время ожидания не было. Ожидание завершается досрочно, если плата  не
+    // подключена, отключается или рабочий поток останавливается
+    quint64 waitForChange(quint64 sinceVersion, int timeout);
+
+    // История изменений состояний реле. Версия записи совпадает с версией
+    // состояний (см. stateVersion())
+    StateHistory& history() {return _history;}
+    const StateHistory& history() const {return _history;}
 
     // Возвращает количество реле в подключенном устройстве
     int count() const;
@@ -67,6 +112,242 @@ public:
     // Возвращает TRUE если устройство подключено
     bool isAttached() const {return _deviceInitialized;}
 
+    // Текущий интервал опроса состояний реле (в миллисекундах).  Интервал
+    // адаптивный: после команд переключения и после обнаружения изменений
+    // извне опрос выполняется с минимальным интервалом, при неизменном состо-
+    // янии интервал удваивается вплоть до максимального.  Если к  сигналам
+    // changed(), attached() и detached() никто не подключен и нет  реле  в
+    // режиме Policy::Enforce, опрос приостанавливается и функция возвращает 0.
+    // В этом случае отключение платы без поддержки hotplug обнаруживается
+    // при очередной команде переключения
+    int pollInterval() const;
+    void setPollInterval(int minMsec, int maxMsec);
+
+    // Максимальное количество команд в очереди post(), не более CommandRingSize
+    static const int CommandRingSize = 256;
+    int queueCapacity() const {return _queueCapacity;}
+    void setQueueCapacity(int value);
+
+    // Количество команд в очереди, ожидающих исполнения
+    int backlog() const {return _backlog;}
+
+    // Режим пропуска команд, не изменяющих состояние реле. Если maxAge > 0,
+    // то команда toggle()/toggleGroup()/post(),  требуемое  состояние  которой
+    // совпадает с кэшированным, завершается без обращения к плате. Условие -
+    // кэшированное состояние подтверждено чтением с платы не более maxAge мс
+    // назад. Параметр emitChanged определяет, эмитируется ли для таких команд
+    // сигнал changed() (для команды группы - по сигналу на каждое реле маски).
+    // При maxAge = 0 (по умолчанию) режим выключен
+    void setIdempotentMode(int maxAge, bool emitChanged = false);
+
+    // Режим управления реле.  Observe - реле управляется только командами
+    // toggle()/post(), изменения извне лишь фиксируются. Enforce -  рабочий
+    // поток непрерывно приводит реле к требуемому состоянию: после подключе-
+    // ния платы, после изменений извне, обнаруженных при опросе, а также после
+    // команд toggle()/post(), противоречащих требуемому состоянию.  Измене-
+    // ния, выполненные при этом, сообщаются сигналом changed() с tag равным
+    // ReconcileTag. Для реле в режиме Enforce опрос не приостанавливается
+    enum class Policy {Observe, Enforce};
+
+    // Задает требуемое состояние для реле из маски mask (бит 0 соответствует
+    // реле 1) и переводит их в режим Enforce
+    void setDesired(quint8 mask, quint8 values);
+
+    // Устанавливает режим для реле relayNumber (relayNumber <= 0 - для  всех
+    // реле). При переводе в режим Enforce требуемым считается последнее за-
+    // данное через setDesired() состояние. Возвращает FALSE если номер реле
+    // вне допустимого диапазона
+    bool setPolicy(int relayNumber, Policy);
+
+    // Требуемые состояния и маска реле в режиме Enforce
+    quint8 desiredStates() const {return quint8(_desired);}
+    quint8 enforceMask() const {return quint8(_desired >> 8);}
+
+    // Политика повтора команд переключения при сбоях обмена с платой. Повтор
+    // выполняется только для ошибок USB-обмена и ошибок проверки результата;
+    // логические ошибки (устройство не подключено, номер реле вне диапазона)
+    // не повторяются. Пауза между попытками выбирается случайно в интервале
+    // [0, min(backoffMax, backoffBase * 2^attempt)], чтобы  несколько  плат
+    // и приложений не обращались к шине синхронно. На время паузы блокировка
+    // платы освобождается. Сигнал failChange() эмитируется однократно, после
+    // исчерпания попыток или по истечении deadline. Синхронные команды (toggle(),
+    // toggleGroup() и т.п.) повторяются в вызывающем потоке, команды из очереди
+    // post() - в рабочем потоке
+    struct RetryPolicy
+    {
+        int maxAttempts = {1};   // Общее количество попыток (1 - без повторов)
+        int deadline    = {0};   // Предельное время исполнения команды, мс
+                                 // (0 - без ограничения)
+        int backoffBase = {20};  // Базовая пауза, мс
+        int backoffMax  = {500}; // Максимальная пауза, мс
+    };
+    RetryPolicy retryPolicy() const;
+    void setRetryPolicy(const RetryPolicy&);
+
+    // Режим реального времени для рабочего потока. Параметры применяются при
+    // старте потока (функция run()), поэтому должны задаваться до  вызова
+    // start(). В режиме реактора (см. RelayReactor) не используются.
+    // В режиме реального времени команды из очереди post() исполняются без
+    // записи в лог (в том числе ошибок и повторов) и без выделения памяти
+    // драйвером: запрос к плате выделяется транспортом однократно и исполь-
+    // зуется повторно. Сигналы changed()/failChange() для таких команд по
+    // умолчанию не эмитируются (получатели с отложенным вызовом требуют
+    // выделения памяти), результат доступен через history(), waitForChange()
+    // и stats(). Выделения памяти внутри libusb (например, при передаче за-
+    // проса ядру) этим не исключаются.  Блокировка  платы  (QMutex)  не под-
+    // держивает наследование приоритета, поэтому для команд из потоков с бо-
+    // лее низким приоритетом следует использовать post(): постановка команды
+    // в очередь выполняется без блокировок
+    struct RealtimeConfig
+    {
+        bool enabled       = {false};
+        int  priority      = {50};   // Приоритет SCHED_FIFO [1..99]
+        int  cpu           = {-1};   // Процессор для привязки потока
+                                     // (-1 - без привязки)
+        bool lockMemory    = {true}; // Блокировка памяти процесса (mlockall)
+        int  stackPrefault = {256 * 1024}; // Объем стека, выделяемый
+                                           // заранее, байт
+        bool emitSignals   = {false}; // Эмиссия changed()/failChange() для
+                                      // команд потока (failChange() - без
+                                      // текста ошибки)
+    };
+    RealtimeConfig realtime() const;
+    void setRealtime(const RealtimeConfig&);
+
+    // Результат переключения реле в заданный момент времени (см. toggleAt()).
+    // Все значения времени заданы по монотонным часам в наносекундах (см.
+    // trace::now())
+    struct TimedResult
+    {
+        bool    success      = {false};
+        quint64 deadline     = {0}; // Заданный момент переключения
+        quint64 issueTime    = {0}; // Фактическое начало USB-транзакции
+        quint64 completeTime = {0}; // Завершение USB-транзакции
+
+        // Отклонение начала транзакции от заданного момента, нс
+        qint64 issueError() const {return qint64(issueTime - deadline);}
+    };
+
+    // Переключает реле relayNumber (см. toggle()) в момент deadline. Ожида-
+    // ние выполняется функцией clock_nanosleep() с последующим активным ожи-
+    // данием в течение короткого интервала, блокировка платы на это время не
+    // захватывается, фоновый опрос приостанавливается. Команда отправляется
+    // без предварительного чтения состояний, после переключения проверяется
+    // только состояние реле relayNumber. Если момент deadline уже прошел,
+    // команда отправляется сразу. Повтор при сбоях не выполняется, режим
+    // setIdempotentMode() не применяется
+    TimedResult toggleAt(int relayNumber, bool value, quint64 deadline, int tag = 0);
+
+    // Результат операции compareAndSet()
+    enum class CasResult
+    {
+        Success,  // Состояния реле изменены
+        Conflict, // Текущие состояния не совпали с ожидаемыми, изменения
+                  // не выполнялись
+        Failed    // Ошибка исполнения, эмитирован сигнал failChange()
+    };
+
+    // Переводит реле в состояния newStates, если текущие  состояния  платы
+    // равны expectedStates (бит 0 соответствует реле 1, учитываются только
+    // реле платы). Сравнение и переключение выполняются под блокировкой платы
+    // по состоянию, прочитанному с платы, поэтому между ними не может  быть
+    // исполнена другая команда. Обращений к плате не больше, чем у toggleGroup().
+    // В параметр actualStates записываются состояния после операции: при кон-
+    // фликте - текущие состояния платы, что позволяет повторить операцию без
+    // дополнительного чтения. При Success сигнал changed() эмитируется  для
+    // операции; при Conflict, если состояния были изменены извне, они сразу
+    // заносятся в кэш и сообщаются сигналом changed() с тегом ExternalTag.
+    // Операция исполняется в вызывающем потоке, как и toggleGroup()
+    CasResult compareAndSet(quint8 expectedStates, quint8 newStates,
+                            quint8* actualStates = nullptr, int tag = 0);
+
+    // Транзакция: набор изменений состояний реле, применяемых  по  принципу
+    // "все или ничего". Формируется функциями begin()/set(), применяется
+    // функцией commit()
+    class Transaction
+    {
+    public:
+        // Задает новое состояние для реле relayNumber (нумерация с единицы).
+        // Повторный вызов для того же реле заменяет предыдущее значение.
+        // Возвращает FALSE если номер реле вне диапазона [1..8]
+        bool set(int relayNumber, bool value);
+
+        quint8 mask() const {return _mask;}
+        quint8 values() const {return _values;}
+        int tag() const {return _tag;}
+
+    private:
+        friend class Relay;
+        const Relay* _relay = {nullptr}; // Экземпляр, создавший транзакцию
+        quint8 _mask = {0};
+        quint8 _values = {0};
+        int    _tag = {0};
+        bool   _invalid = {false};
+    };
+
+    // Начинает транзакцию. Параметр tag см. в описании toggle(). Транзакция
+    // может быть применена только экземпляром Relay, создавшим ее
+    Transaction begin(int tag = 0) const;
+
+    // Применяет транзакцию. Минимальный набор команд формируется однократно
+    // для всех реле транзакции (см. RelayBoard::planCommands()), результат
+    // проверяется однократно после отправки всех команд.  Если  проверка
+    // не прошла или обмен был прерван, реле возвращаются в состояния, пред-
+    // шествовавшие транзакции. Кэш состояний и история изменений обновляют-
+    // ся однократно, когда исход транзакции известен: промежуточные состоя-
+    // ния в них не попадают. Результат сообщается сигналом committed() (новые
+    // состояния доступны через states()), при ошибке дополнительно эмитиру-
+    // ется failChange() с relayNumber = 0. Если откат не удался, для реле,
+    // оставшихся в измененном состоянии, эмитируется changed()
+    bool commit(const Transaction&);
+
+    // Границы интервалов гистограммы длительности USB-транзакций (в микро-
+    // секундах). Последний интервал гистограммы не ограничен сверху
+    static const int LatencyBuckets = 10;
+    static constexpr quint32 LatencyBounds[LatencyBuckets - 1] =
+        {250, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000};
+
+    // Статистика работы с платой. Все поля читаются атомарно, без захвата
+    // блокировки платы, поэтому функция stats() может вызываться с  любой
+    // частотой (например, при сборе метрик)
+    struct Stats
+    {
+        QString serial;             // Серийный номер подключенной платы
+        bool    attached = {false};
+        int     count = {0};        // Количество реле
+        quint8  states = {0};       // Битовая маска состояний реле
+        quint64 stateVersion = {0};
+        int     backlog = {0};
+        int     pollInterval = {0}; // Текущий интервал опроса, мс
+
+        quint64 attaches = {0};         // Подключений платы
+        quint64 detaches = {0};         // Отключений платы
+        quint64 transfers = {0};        // USB-транзакций
+        quint64 transferErrors = {0};   // USB-транзакций, завершенных ошибкой
+        quint64 commandFailures = {0};  // Эмиссий сигнала failChange()
+
+        // Гистограмма длительности успешных USB-транзакций (не накопительная),
+        // сумма длительностей в микросекундах
+        quint64 transferLatency[LatencyBuckets] = {0};
+        quint64 transferLatencySum = {0};
+
+        quint64 retries = {0};          // Выполнено повторных попыток
+        quint64 retriesRecovered = {0}; // Команд, успешных после повтора
+        quint64 retriesExhausted = {0}; // Команд, неуспешных после повторов
+        quint64 commandsRejected = {0}; // Команд post(), отклоненных из-за
+                                        // переполнения очереди
+
+        quint64 commandsSkipped = {0};  // Команд, завершенных без обращения
+                                        // к плате (см. setIdempotentMode())
+
+        bool    converged = {true};          // Состояние соответствует требуемому
+        quint64 reconcileCorrections = {0};  // Корректирующих переключений
+        quint64 reconcileFailures = {0};     // Неудачных корректировок
+        quint64 convergenceTime = {0};       // Время последнего приведения
+                                             // к требуемому состоянию, мкс
+    };
+    Stats stats() const;
+
 signals:
     // Эмитируется при подключении реле к USB-порту
     void attached();
@@ -75,12 +356,17 @@ signals:
     void detached();
 
     // Эмитируется при изменении состояния реле. Описание поля tag смотри
-    // в методе toggle()
+    // в методе toggle(). Для изменений, выполненных извне и обнаруженных при
+    // опросе, tag равен ExternalTag
     void changed(int relayNumber, int tag);
 
     // Эмитируется если не удалось изменить состояние реле
     void failChange(int relayNumber, const QString& errorMessage, int tag);
 
+    // Эмитируется по завершении commit(): success = TRUE если транзакция
+    // применена, FALSE - если она отклонена или отменена откатом
+    void committed(int tag, bool success);
+
 public slots:
     //bool toggle(const QVector<int> states);
 
@@ -92,21 +378,236 @@ public slots:
     // именно приложение выполнило переключение
     bool toggle(int relayNumber, bool value, int tag = 0);
 
+    // Переключает группу реле за одно обращение к плате. Параметр mask задает
+    // битовую маску переключаемых реле (бит 0 соответствует реле 1), параметр
+    // values - новые состояния для этих реле. Проверка результата выполняется
+    // однократно после отправки всех команд. Сигнал changed() эмитируется для
+    // каждого реле, изменившего состояние; при ошибке  эмитируется  failChange()
+    // с relayNumber = 0
+    bool toggleGroup(quint8 mask, quint8 values, int tag = 0);
+
+    // Асинхронный вариант функции toggle().  Команда помещается в очередь
+    // и исполняется рабочим потоком (собственным  или  потоком RelayReactor).
+    // Результат переключения сообщается сигналами changed()/failChange().
+    // Очередь не использует блокировок, поэтому время вызова не зависит от
+    // выполняемого в этот момент обмена с платой. Возвращает FALSE если оче-
+    // редь команд заполнена
+    bool post(int relayNumber, bool value, int tag = 0);
+
 private:
     Q_OBJECT
-    Relay() = default;
     DISABLE_DEFAULT_COPY(Relay)
 
+public:
+    // Результат опроса платы при перечислении устройств
+    struct ProbeResult
+    {
+        bool    valid = {false}; // FALSE - устройство не является платой реле
+                                 // или не ответило на запросы
+        QString product;
+        QString serial;
+        int     relayCount = {0};
+        quint8  states = {0};   // Состояния реле на момент опроса
+        quint64 time = {0};     // Время опроса, нс (см. trace::now())
+    };
+
+private:
+    // Применяет параметры режима реального времени к текущему потоку
+    void applyRealtime();
+
+    // Поиск и захват платы. Платы-кандидаты, отсутствующие в кэше опроса,
+    // опрашиваются параллельно (см. Transport::createProbe()),  после  чего
+    // открывается только плата с подходящим серийным номером. Кэшируются как
+    // успешные, так и неудачные результаты опроса
     bool claimDevice();
     void releaseDevice(bool deviceDetached);
 
+    // Опрашивает устройство. Если keepOpen() для результата опроса возвращает
+    // TRUE, устройство остается открытым в transport
+    bool probeDevice(Transport*, const DeviceInfo&, ProbeResult&,
+                     const std::function<bool (const ProbeResult&)>& keepOpen);
+
+    // Опрашивает устройства и помещает результаты в кэш. Первая плата с  се-
+    // рийным номером attachSerial (любая плата, если он пуст) остается откры-
+    // той в _transport, возвращается ее индекс в devices или -1
+    int  probeDevices(const QVector<DeviceInfo>&, const QString& attachSerial);
+
+    // Параметр opened: устройство уже открыто в _transport функцией probeDevices()
+    // и состояния реле взяты из результата опроса
+    bool openDevice(const DeviceInfo&, const ProbeResult&, bool opened);
+
+    // Шаги рабочего цикла. Используются как в run(), так и в RelayReactor
+    bool attachDevice();
+    void detachDevice(bool deviceDetached);
+    bool detachRequired() const;
+
+    // Вызывается HotplugMonitor при отключении устройства от USB-порта
+    void deviceLeft();
+    void pollStates();
+    bool pollSuspended() const
+        {return (_pollSubscribers == 0) && (enforceMask() == 0);}
+    void resetPollInterval();
+    void processCommands();
+
+    // Приводит реле в режиме Enforce к требуемому состоянию
+    void reconcile();
+
+    // Пробуждает рабочий поток (собственный или поток реактора)
+    void wakeWorker();
+
+    // Ожидает пробуждения рабочего потока, но не дольше timeout миллисекунд
+    // (при timeout < 0 ожидание не ограничено)
+    void waitWorker(int timeout);
+    static int claimRetryTimeout(quint32 claimAttempts);
+
     void run() override;
     void threadStopEstablished() override;
 
+    void connectNotify(const QMetaMethod&) override;
+    void disconnectNotify(const QMetaMethod&) override;
+
+    // Синхронный control transfer с учетом в статистике
+    int controlTransfer(quint8 requestType, quint8 request,
+                        quint16 value, quint16 index,
+                        uchar* data, quint16 length, uint timeout);
+
+    // Учитывает в статистике завершенную USB-транзакцию
+    void accountTransfer(qint64 latencyUsec, int result);
+    void accountTransfer(const Transport::AsyncTransfer&);
+
+    // Сохраняет серийный номер для чтения без блокировки (см. stats())
+    void setSerialInternal(const QString&);
+
     int readStates(char* buff, int buffSize);
 
+    // Чтение состояний для фонового опроса.  Запрос выполняется асинхронно
+    // и отменяется, если в процессе чтения поступила команда переключения.
+    // Возвращает -2 если чтение было прервано командой
+    int readStatesPreemptible(char* buff, int buffSize);
+    bool writeCommand(quint8 cmd1, quint8 cmd2);
+
     QVector<int> statesInternal() const;
-    bool toggleInternal(int relayNumber, bool value, int tag);
+
+    // Обновляет _states значением, прочитанным с платы, и фиксирует время
+    // подтверждения кэша. При изменении состояний увеличивает версию, добав-
+    // ляет запись в историю и будит потоки, ожидающие в waitForChange().
+    // Вызывается под блокировкой _threadLock
+    void updateStates(quint8 states, int tag);
+
+    // Обрабатывает изменение состояний реле извне, обнаруженное при чтении
+    // состояний с платы: обновляет кэш (см. updateStates()) и эмитирует
+    // changed() с тегом ExternalTag для каждого измененного реле. Вызывается
+    // под блокировкой _threadLock
+    void externalChange(quint8 states);
+
+    // Проверка для режима setIdempotentMode(). Возвращает TRUE если кэширо-
+    // ванные состояния реле из маски mask совпадают с values и кэш достаточно
+    // свежий. Вызывается под блокировкой _threadLock
+    bool idempotentHit(quint8 mask, quint8 values) const;
+
+    // Исполняет команду command() с учетом политики повтора. Вызывается под
+    // блокировкой locker, на время паузы между попытками блокировка освобожда-
+    // ется. Параметр start - время вызова команды (см. trace::now())
+    bool retryCommand(QMutexLocker& locker, quint64 start,
+                      const std::function<bool()>& command);
+
+    // Сообщает об ошибке переключения. Если ошибка  transient  и  у  команды
+    // остались попытки, сигнал failChange() откладывается до решения о повторе
+    void failChangeInternal(int relayNumber, const QString& errorMessage, int tag,
+                            bool transient);
+
+    // Вариант failChangeInternal() для потока реального времени: ошибка учи-
+    // тывается в статистике без записи в лог и без формирования сообщения.
+    // Всегда возвращает FALSE
+    bool failRealtime(int relayNumber, int tag, bool transient);
+
+    bool toggleInternal(int relayNumber, bool value, int tag,
+                        TimedResult* timed = nullptr);
+    bool toggleGroupInternal(quint8 mask, quint8 values, int tag);
+    CasResult compareAndSetInternal(quint8 expectedStates, quint8 newStates,
+                                    quint8* actualStates, int tag);
+
+    bool commitInternal(const Transaction&);
+
+    // Переводит реле из состояния prevStates (прочитано с платы)  в  состоя-
+    // ние expectStates минимальным набором команд с однократной проверкой
+    // результата. Используется командами групповых изменений
+    bool writeGroup(quint8 prevStates, quint8 expectStates, int tag);
+
+    // Общая часть writeGroup() и commitInternal(): отправка команд и проверка
+    // результата. Прочитанные после отправки состояния записываются в states
+    // (-1 если прочитать не удалось), кэш состояний не обновляется. Сигналы
+    // не эмитирует, при ошибке в error записывается ее описание
+    bool applyGroup(quint8 prevStates, quint8 expectStates, int& states,
+                    const char*& error);
+
+    // Синхронизированное переключение групп реле на нескольких платах (см.
+    // ChannelMap::applySync()). Вызывающая сторона захватывает _threadLock
+    // всех плат до вызова syncPrepare() и освобождает после syncFinish()
+    struct SyncGroup
+    {
+        quint8 mask = {0};
+        quint8 values = {0};
+        int    tag = {0};
+
+        quint8 prevStates = {0};
+        quint8 expectStates = {0};
+
+        // План команд группы. syncPrepare() только формирует запросы, на
+        // плату ничего не отправляется; весь план отправляется асинхронно
+        // в syncSubmit() одновременно для всех плат. Запросы к одной плате
+        // исполняются последовательно в порядке отправки
+        Transport::AsyncTransfer transfers[8];
+        int transferCount = {0};
+
+        bool completed() const
+        {
+            for (int i = 0; i < transferCount; ++i)
+                if (!transfers[i].completed)
+                    return false;
+            return true;
+        }
+    };
+    bool syncPrepare(SyncGroup&);
+    void syncSubmit(SyncGroup&);
+    void syncHandleEvents(SyncGroup&, int timeout);
+    bool syncFinish(SyncGroup&);
+
+    // Асинхронное обслуживание платы реактором (см. RelayReactor). Команда
+    // из очереди post() или фоновый опрос отправляются на плату без ожидания
+    // ответа, события всех плат реактора обрабатываются в общем цикле. Для
+    // платы одновременно выполняется не более одной операции (см. AsyncOp)
+
+    // Начинает исполнение повтора команды, следующей команды из очереди или,
+    // если pollDue, опрос состояний. Возвращает TRUE если запросы отправлены
+    bool asyncStart(bool pollDue);
+
+    // Обрабатывает без ожидания события транспорта и завершает операцию, если
+    // ее запросы выполнены.  Выполняющийся опрос отменяется при поступлении
+    // команды
+    void asyncEvents();
+
+    // Отменяет операцию и дожидается завершения ее запросов. Команда завер-
+    // шается с ошибкой без повтора. Вызывается перед отключением платы
+    void asyncAbort();
+
+    // Возвращает TRUE если запросы операции отправлены и не обработаны
+    bool asyncBusy() const {return (_asyncOp.transferCount > 0);}
+
+    // Пауза до повтора команды в миллисекундах, -1 если повтор не ожидается
+    int asyncRetryDelay() const;
+
+    // Дескрипторы для ожидания событий транспорта (см. Transport::pollFds())
+    bool asyncPollFds(QVector<pollfd>& fds) {return _transport->pollFds(fds);}
+
+    bool asyncSubmit();
+    void asyncFinish(bool retryAllowed);
+
+    // Пауза перед повтором команды после неудачной попытки attempt, мс
+    static int retryDelay(const RetryPolicy&, int attempt);
+
+    // Обрабатывает состояния, прочитанные с платы фоновым опросом
+    void pollCompleted(quint8 states);
 
 private:
     int _usbBusNumber = {0};
@@ -115,20 +616,156 @@ private:
     QVector<int> _initStates;
     QString _attachSerial;
 
-    libusb_context*       _context = {nullptr};
-    libusb_device_handle* _deviceHandle = {nullptr};
+    std::unique_ptr<Transport> _transport {new LibusbTransport};
     std::atomic_bool      _deviceInitialized = {false};
+    std::atomic_bool      _deviceLeft = {false};
     std::atomic_int       _usbContinuousErrors = {0};
     std::atomic_int       _usbLastErrorCode = {0};
 
     QString _product;
     QString _serial;
-    quint8  _states = {0};
-    qint32  _count = {0};
+    std::atomic<quint64> _serialPacked = {0};
+
+    std::atomic<quint8> _states = {0};
+    std::atomic<quint64> _stateVersion = {0};
+    StateHistory _history;
+
+    // Время вызова исполняемой команды и время последнего успешного опроса,
+    // используются для расчета задержки в истории изменений
+    quint64 _commandStart = {0};
+    quint64 _lastPollTime = {0};
+
+    // Время последнего подтверждения _states чтением с платы, нс
+    quint64 _statesVerifiedAt = {0};
+
+    std::atomic_int  _idempotentMaxAge = {0};
+    std::atomic_bool _idempotentEmitChanged = {false};
+    std::atomic<quint64> _commandsSkipped = {0};
+    std::atomic_int _count = {0};
+
+    // Функции платы, соответствующие количеству реле (см. RelayBoard<N>).
+    // Устанавливается при захвате платы
+    const ActiveBoardOps* _board = {nullptr};
+
+    struct Command
+    {
+        qint32  relayNumber;
+        qint32  tag;
+        bool    value;
+        quint64 postTime;
+    };
+
+    // Очередь команд post(): ограниченное кольцо  с  несколькими  производи-
+    // телями и одним потребителем. Поле seq ячейки равно позиции записи, если
+    // ячейка свободна, и позиции записи + 1, если команда опубликована
+    struct CommandSlot
+    {
+        std::atomic<quint64> seq;
+        Command command;
+    };
+    CommandSlot _commandRing[CommandRingSize];
+    std::atomic<quint64> _enqueuePos = {0};
+    quint64 _dequeuePos = {0};
+
+    // Извлечение команды из очереди post(). Вызывается под блокировкой
+    // _threadLock, что гарантирует единственного потребителя
+    bool popCommand(Command&);
+
+    // Количество команд в очереди, включая резервируемые производителями
+    std::atomic_int  _backlog = {0};
+
+    // Операция, выполняемая реактором асинхронно (см. asyncStart()).  Хранит-
+    // ся в Relay, а не в реакторе: адреса запросов не должны меняться до их
+    // завершения. Используется потоком реактора под блокировкой его списка
+    // плат. Команда, ожидающая повтора, из очереди post() уже извлечена
+    struct AsyncOp
+    {
+        enum class Kind {None, Poll, Command};
+
+        Kind    kind = {Kind::None};
+        Command command = {};
+        quint8  cmd1 = {0};
+        quint8  cmd2 = {0};
+        quint8  expectStates = {0};
+        quint8  checkMask = {0};
+        int     attempt = {0};
+        quint64 retryTime = {0};  // Время повтора команды, нс
+        quint64 deadline = {0};   // Крайний срок повторов команды, нс
+        quint64 version = {0};    // Версия состояний при отправке опроса
+        bool    cancelled = {false};
+
+        Transport::AsyncTransfer transfers[2];
+        int transferCount = {0};
+    };
+    AsyncOp _asyncOp;
+    std::atomic<quint64> _commandsRejected = {0};
+    std::atomic_int  _queueCapacity = {16};
+    std::atomic_int  _pollInterval = {100};
+    std::atomic_int  _pollIntervalMin = {100};
+    std::atomic_int  _pollIntervalMax = {2000};
+    // Количество подключений к сигналам changed(), attached() и detached().
+    // Опрос нужен и подписчикам attached()/detached(): без hotplug отключение
+    // платы определяется по ошибкам обмена при опросе
+    std::atomic_int  _pollSubscribers = {0};
+
+    std::atomic<quint64> _attaches = {0};
+    std::atomic<quint64> _detaches = {0};
+    std::atomic<quint64> _transfers = {0};
+    std::atomic<quint64> _transferErrors = {0};
+    std::atomic<quint64> _commandFailures = {0};
+    std::atomic<quint64> _transferLatency[LatencyBuckets];
+    std::atomic<quint64> _transferLatencySum = {0};
+
+    // Требуемое состояние: младший байт - состояния, старший - маска реле
+    // в режиме Enforce. Хранятся в одном атомарном значении, чтобы рабочий
+    // поток всегда видел согласованную пару
+    std::atomic<quint16> _desired = {0};
+
+    quint64 _divergedSince = {0};   // Время обнаружения расхождения, нс
+    quint64 _reconcileAfter = {0};  // Время следующей попытки после ошибки, нс
+    std::atomic_bool     _converged = {true};
+    std::atomic<quint64> _reconcileCorrections = {0};
+    std::atomic<quint64> _reconcileFailures = {0};
+    std::atomic<quint64> _convergenceTime = {0};
+
+    RetryPolicy _retryPolicy;
+
+    RealtimeConfig _realtime;
+    std::atomic_bool _realtimeActive = {false};
+    std::atomic<quint64> _retries = {0};
+    std::atomic<quint64> _retriesRecovered = {0};
+    std::atomic<quint64> _retriesExhausted = {0};
+
+    // Отложенная ошибка текущей попытки (см. failChangeInternal())
+    bool    _failDeferrable = {false};
+    bool    _failDeferred = {false};
+    int     _failRelayNumber = {0};
+    int     _failTag = {0};
+    QString _failMessage;
+
+    // Количество команд, ожидающих захвата _threadLock или исполняемых в дан-
+    // ный момент. Фоновый опрос уступает приоритет командам
+    std::atomic_int  _commandsActive = {0};
+
+    struct CommandScope
+    {
+        explicit CommandScope(Relay* r) : relay(r) {++relay->_commandsActive;}
+        ~CommandScope() {--relay->_commandsActive;}
+        Relay* relay;
+    };
+
+    // Реактор, обслуживающий плату (nullptr для режима собственного потока)
+    std::atomic<RelayReactor*> _reactor = {nullptr};
+
+    // Используется для пробуждения собственного рабочего потока
+    int _eventFd = {-1};
 
     mutable QMutex _threadLock;
-    mutable QWaitCondition _threadCond;
+    mutable QWaitCondition _stateCond;
 
+    friend class RelayReactor;
+    friend class ChannelMap;
+    friend class HotplugMonitor;
     template<typename T, int> friend T& safe::singleton();
 };
 
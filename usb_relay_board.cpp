@@ -0,0 +1,55 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#include "usb_relay_board.h"
+
+namespace usb {
+
+// Реле с номером 1 соответствует младший бит маски состояний
+static_assert(RelayBoard<1>::mask<1>() == 0x01, "Invalid relay mask");
+static_assert(RelayBoard<8>::mask<8>() == 0x80, "Invalid relay mask");
+static_assert(RelayBoard<8>::mask<0>() == RelayBoard<8>::AllMask, "Invalid relay mask");
+
+const ActiveBoardOps* boardOps(int count)
+{
+#ifdef USB_RELAY_BOARD_COUNT
+    static constexpr ActiveBoardOps ops {};
+    return (count == USB_RELAY_BOARD_COUNT) ? &ops : nullptr;
+#else
+    static constexpr BoardOps ops[] = {
+        boardOps<1>(), boardOps<2>(), boardOps<4>(), boardOps<8>()
+    };
+    switch (count)
+    {
+        case 1: return &ops[0];
+        case 2: return &ops[1];
+        case 4: return &ops[2];
+        case 8: return &ops[3];
+    }
+    return nullptr;
+#endif
+}
+
+} // namespace usb
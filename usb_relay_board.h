@@ -0,0 +1,225 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#pragma once
+
+#include <QtCore>
+#include <utility>
+
+namespace usb {
+
+/**
+  Параметры платы с количеством реле N, известным на этапе компиляции. Маски
+  вычисляются как constexpr, циклы по реле разворачиваются, номера реле, пере-
+  даваемые как параметры шаблона, проверяются статически.
+  Класс Relay использует экземпляры RelayBoard<1/2/4/8> через таблицу BoardOps,
+  выбираемую по количеству реле платы при ее захвате (см. ActiveBoardOps)
+*/
+template<int N>
+struct RelayBoard
+{
+    static_assert(N == 1 || N == 2 || N == 4 || N == 8,
+                  "The number of relays must be one of values [1, 2, 4, 8]");
+
+    static constexpr int    Count = N;
+    static constexpr quint8 AllMask = quint8((1U << N) - 1);
+
+    // Маска реле с номером R. Номер 0 соответствует всем реле платы
+    template<int R>
+    static constexpr quint8 mask()
+    {
+        static_assert(R >= 0 && R <= N, "Relay number out of range");
+        return (R == 0) ? AllMask : quint8(1U << (R - 1));
+    }
+
+    // Маска реле с номером relayNumber, для номеров вне диапазона [0..N]
+    // возвращает 0
+    static constexpr quint8 mask(int relayNumber)
+    {
+        return (relayNumber == 0) ? AllMask
+               : (relayNumber > 0 && relayNumber <= N) ? quint8(1U << (relayNumber - 1))
+               : quint8(0);
+    }
+
+    // Вызывает func(relayNumber) для каждого реле, бит которого установлен
+    // в mask. Номера реле передаются по возрастанию
+    template<typename Func>
+    static void forEach(quint8 mask, Func&& func)
+    {
+        forEach(mask, func, std::make_integer_sequence<int, N>());
+    }
+
+    // Формирует минимальный по количеству USB-транзакций список команд для пере-
+    // вода реле из состояния prevStates в состояние expectStates. Прошивка платы
+    // поддерживает только переключение отдельного реле (0xFF/0xFD) и всех реле
+    // сразу (0xFE/0xFC). Групповая команда  перекрывает  результат  предыдущих,
+    // поэтому имеет смысл только первой. Таким образом возможны три варианта:
+    //   - только команды для отдельных реле: popcount(prev ^ expect);
+    //   - "включить все" и выключение отдельных реле: 1 + количество нулей
+    //     в expect;
+    //   - "выключить все" и включение отдельных реле: 1 + количество единиц
+    //     в expect.
+    // Реле, состояние которых не меняется, не должны  даже  кратковременно
+    // переключаться. Поэтому "включить все" допускается только если среди них
+    // нет выключенных, а "выключить все" - только если нет включенных. Из до-
+    // пустимых выбирается вариант с наименьшим количеством команд, при равенст-
+    // ве предпочтение отдается первому. Из-за этого ограничения переход из
+    // состояния "все выключены" в состояние "все, кроме одного, включены"  вы-
+    // полняется 7 командами для отдельных реле, а не 2 командами ("включить
+    // все" и выключение одного реле): выключенное реле кратковременно включи-
+    // лось бы. Вариант из 2 команд применяется, только если это реле уже вклю-
+    // чено и переключается. Возвращает количество команд (не более 8)
+    static int planCommands(quint8 prevStates, quint8 expectStates,
+                            quint8 commands[8][2])
+    {
+        prevStates &= AllMask;
+        expectStates &= AllMask;
+
+        if (expectStates == prevStates)
+            return 0;
+
+        const int onCount = qPopulationCount(expectStates);
+        const int singleCost = qPopulationCount(quint8(prevStates ^ expectStates));
+        const int allOnCost  = 1 + (N - onCount);
+        const int allOffCost = 1 + onCount;
+
+        // Групповая команда не должна затрагивать неизменяемые реле
+        const bool allOnValid  = (quint8(~(prevStates | expectStates)) & AllMask) == 0;
+        const bool allOffValid = (prevStates & expectStates) == 0;
+
+        int count = 0;
+        if (allOnValid && allOnCost < singleCost
+            && (!allOffValid || allOnCost <= allOffCost))
+        {
+            commands[count][0] = 0xFE; // Включить все реле
+            commands[count][1] = 0;
+            ++count;
+            prevStates = AllMask;
+        }
+        else if (allOffValid && allOffCost < singleCost)
+        {
+            commands[count][0] = 0xFC; // Выключить все реле
+            commands[count][1] = 0;
+            ++count;
+            prevStates = 0;
+        }
+
+        forEach(prevStates ^ expectStates, [&](int relayNumber)
+        {
+            // Включить/выключить реле по номеру
+            quint8 bit = quint8(1U << (relayNumber - 1));
+            commands[count][0] = (expectStates & bit) ? 0xFF : 0xFD;
+            commands[count][1] = quint8(relayNumber);
+            ++count;
+        });
+        return count;
+    }
+
+    // Преобразует битовую маску состояний в вектор состояний реле
+    static void unpack(quint8 states, QVector<int>& result)
+    {
+        result.resize(N);
+        unpack(states, result.data(), std::make_integer_sequence<int, N>());
+    }
+
+private:
+    template<typename Func, int... I>
+    static void forEach(quint8 mask, Func& func, std::integer_sequence<int, I...>)
+    {
+        ((mask & RelayBoard::mask<I + 1>() ? func(I + 1) : void()), ...);
+    }
+
+    template<int... I>
+    static void unpack(quint8 states, int* result, std::integer_sequence<int, I...>)
+    {
+        ((result[I] = bool(states & RelayBoard::mask<I + 1>())), ...);
+    }
+};
+
+/**
+  Таблица функций платы для диспетчеризации во время выполнения
+*/
+struct BoardOps
+{
+    int    count;
+    quint8 allMask;
+    quint8 (*mask)(int relayNumber);
+    int    (*planCommands)(quint8 prevStates, quint8 expectStates,
+                           quint8 commands[8][2]);
+    void   (*unpack)(quint8 states, QVector<int>& result);
+};
+
+template<int N>
+constexpr BoardOps boardOps()
+{
+    return {N, RelayBoard<N>::AllMask,
+            &RelayBoard<N>::mask,
+            &RelayBoard<N>::planCommands,
+            &RelayBoard<N>::unpack};
+}
+
+/**
+  Функции платы с количеством реле N в виде статических членов. Имена совпа-
+  дают с полями BoardOps, поэтому вызов через указатель (board->mask(...))
+  записывается одинаково, но исполняется без косвенного перехода и может быть
+  встроен компилятором
+*/
+template<int N>
+struct StaticBoardOps
+{
+    static constexpr int    count = N;
+    static constexpr quint8 allMask = RelayBoard<N>::AllMask;
+
+    static quint8 mask(int relayNumber)
+    {
+        return RelayBoard<N>::mask(relayNumber);
+    }
+    static int planCommands(quint8 prevStates, quint8 expectStates,
+                            quint8 commands[8][2])
+    {
+        return RelayBoard<N>::planCommands(prevStates, expectStates, commands);
+    }
+    static void unpack(quint8 states, QVector<int>& result)
+    {
+        RelayBoard<N>::unpack(states, result);
+    }
+};
+
+// Функции платы, используемые классом Relay. Для встраиваемых сборок с зара-
+// нее известной моделью платы можно определить макрос USB_RELAY_BOARD_COUNT,
+// в этом случае функции RelayBoard<USB_RELAY_BOARD_COUNT> вызываются напря-
+// мую, а не через таблицу BoardOps
+#ifdef USB_RELAY_BOARD_COUNT
+typedef StaticBoardOps<USB_RELAY_BOARD_COUNT> ActiveBoardOps;
+#else
+typedef BoardOps ActiveBoardOps;
+#endif
+
+// Возвращает функции для платы с количеством реле count, или nullptr если
+// такая плата не поддерживается. При определенном USB_RELAY_BOARD_COUNT под-
+// держивается только плата с указанным количеством реле
+const ActiveBoardOps* boardOps(int count);
+
+} // namespace usb
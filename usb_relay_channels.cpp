@@ -0,0 +1,356 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#include "usb_relay_channels.h"
+
+#include "shared/logger/logger.h"
+#include "shared/logger/format.h"
+#include "shared/qt/logger_operators.h"
+
+#include <algorithm>
+#include <future>
+
+#define log_error_m   alog::logger().error   (alog_line_location, "UsbRelayChannels")
+#define log_warn_m    alog::logger().warn    (alog_line_location, "UsbRelayChannels")
+#define log_info_m    alog::logger().info    (alog_line_location, "UsbRelayChannels")
+#define log_verbose_m alog::logger().verbose (alog_line_location, "UsbRelayChannels")
+#define log_debug_m   alog::logger().debug   (alog_line_location, "UsbRelayChannels")
+#define log_debug2_m  alog::logger().debug2  (alog_line_location, "UsbRelayChannels")
+
+namespace usb {
+
+bool ChannelMap::addBoard(const QString& serial, Relay* relay)
+{
+    if (serial.isEmpty() || relay == nullptr)
+    {
+        log_error_m << "Failed add board. Serial or relay is empty";
+        return false;
+    }
+    if (_boardIndexes.contains(serial))
+    {
+        log_error_m << "Failed add board. Board already registered: " << serial;
+        return false;
+    }
+
+    Board board;
+    board.serial = serial;
+    board.relay = relay;
+    _boards.append(board);
+    _boardIndexes.insert(serial, _boards.count() - 1);
+    return true;
+}
+
+int ChannelMap::addChannel(const QString& name, const QString& serial, int relayNumber)
+{
+    if (_channelIndexes.contains(name))
+    {
+        log_error_m << "Failed add channel. Channel already exists: " << name;
+        return -1;
+    }
+
+    int boardIndex = _boardIndexes.value(serial, -1);
+    if (boardIndex < 0)
+    {
+        log_error_m << log_format(
+            "Failed add channel %?. Board %? not registered", name, serial);
+        return -1;
+    }
+
+    // Максимальное количество реле на плате - 8
+    if (relayNumber < 1 || relayNumber > 8)
+    {
+        log_error_m << log_format(
+            "Failed add channel %?. Relay number %? out of range [1..8]",
+            name, relayNumber);
+        return -1;
+    }
+
+    Channel channel;
+    channel.name = name;
+    channel.boardIndex = boardIndex;
+    channel.relayNumber = relayNumber;
+    _channels.append(channel);
+    _channelIndexes.insert(name, _channels.count() - 1);
+    return _channels.count() - 1;
+}
+
+int ChannelMap::channelId(const QString& name) const
+{
+    return _channelIndexes.value(name, -1);
+}
+
+QVector<ChannelMap::BoardChange>
+ChannelMap::splitChanges(const QVector<Change>& changes, Result& result) const
+{
+    QVector<BoardChange> boardChanges;
+    boardChanges.resize(_boards.count());
+
+    for (const Change& change : changes)
+    {
+        if (change.channelId < 0 || change.channelId >= _channels.count())
+        {
+            log_error_m << "Failed apply channels. Bad channel id: " << change.channelId;
+            result.failedChannels.append(change.channelId);
+            continue;
+        }
+        const Channel& channel = _channels[change.channelId];
+        BoardChange& bc = boardChanges[channel.boardIndex];
+
+        quint8 bit = quint8(1U << (channel.relayNumber - 1));
+        bc.mask |= bit;
+        if (change.value)
+            bc.values |= bit;
+        else
+            bc.values &= ~bit;
+    }
+    return boardChanges;
+}
+
+void ChannelMap::failedChannels(const QVector<Change>& changes, int boardIndex,
+                                Result& result) const
+{
+    ++result.failedBoards;
+    for (const Change& change : changes)
+        if (change.channelId >= 0 && change.channelId < _channels.count()
+            && _channels[change.channelId].boardIndex == boardIndex)
+            result.failedChannels.append(change.channelId);
+}
+
+ChannelMap::Result ChannelMap::apply(const QVector<Change>& changes, int tag) const
+{
+    Result result;
+    QVector<BoardChange> boardChanges = splitChanges(changes, result);
+
+    // Переключение на платах выполняется параллельно. Последняя из плат
+    // обслуживается в вызывающем потоке
+    QVector<int> indexes;
+    for (int i = 0; i < boardChanges.count(); ++i)
+        if (boardChanges[i].mask)
+            indexes.append(i);
+
+    std::vector<std::future<bool>> futures;
+    futures.reserve(indexes.count());
+    for (int i = 0; i < indexes.count() - 1; ++i)
+    {
+        Relay* relay = _boards[indexes[i]].relay;
+        BoardChange bc = boardChanges[indexes[i]];
+        futures.push_back(std::async(std::launch::async, [relay, bc, tag]()
+        {
+            return relay->toggleGroup(bc.mask, bc.values, tag);
+        }));
+    }
+
+    QVector<bool> boardResults;
+    boardResults.resize(indexes.count());
+    if (!indexes.isEmpty())
+    {
+        Relay* relay = _boards[indexes.last()].relay;
+        const BoardChange& bc = boardChanges[indexes.last()];
+        boardResults[indexes.count() - 1] = relay->toggleGroup(bc.mask, bc.values, tag);
+    }
+    for (size_t i = 0; i < futures.size(); ++i)
+        boardResults[int(i)] = futures[i].get();
+
+    result.boards = indexes.count();
+    for (int i = 0; i < indexes.count(); ++i)
+        if (!boardResults[i])
+            failedChannels(changes, indexes[i], result);
+
+    result.success = result.failedChannels.isEmpty();
+
+    if (!result.success)
+        log_error_m << log_format(
+            "Failed apply channels. Failed boards: %? of %?. Failed channels: %?",
+            result.failedBoards, result.boards, result.failedChannels.count());
+    return result;
+}
+
+ChannelMap::SyncResult ChannelMap::applySync(const QVector<Change>& changes, int tag) const
+{
+    using namespace std::chrono;
+
+    SyncResult result;
+    QVector<BoardChange> boardChanges = splitChanges(changes, result);
+
+    QVector<int> indexes;
+    for (int i = 0; i < boardChanges.count(); ++i)
+        if (boardChanges[i].mask)
+            indexes.append(i);
+
+    // Блокировки плат захватываются в порядке возрастания адресов объектов,
+    // это исключает взаимную блокировку при параллельных вызовах applySync()
+    std::sort(indexes.begin(), indexes.end(), [this](int i1, int i2)
+    {
+        return _boards[i1].relay < _boards[i2].relay;
+    });
+
+    const int count = indexes.count();
+    std::vector<Relay::SyncGroup> groups(count);
+    for (int i = 0; i < count; ++i)
+    {
+        groups[i].mask = boardChanges[indexes[i]].mask;
+        groups[i].values = boardChanges[indexes[i]].values;
+        groups[i].tag = tag;
+        ++_boards[indexes[i]].relay->_commandsActive;
+        _boards[indexes[i]].relay->_threadLock.lock();
+    }
+
+    // Подготовка команд выполняется параллельно
+    QVector<bool> prepared;
+    prepared.resize(count);
+    {
+        std::vector<std::future<bool>> futures;
+        futures.reserve(count);
+        for (int i = 0; i < count; ++i)
+        {
+            Relay* relay = _boards[indexes[i]].relay;
+            Relay::SyncGroup* group = &groups[i];
+            futures.push_back(std::async(std::launch::async, [relay, group]()
+            {
+                return relay->syncPrepare(*group);
+            }));
+        }
+        for (int i = 0; i < count; ++i)
+            prepared[i] = futures[i].get();
+    }
+
+    // Одновременная отправка планов команд всех плат
+    for (int i = 0; i < count; ++i)
+        if (prepared[i])
+            _boards[indexes[i]].relay->syncSubmit(groups[i]);
+
+    // Ожидание завершения отправки. События каждой платы обрабатываются в
+    // отдельном потоке с блокирующим ожиданием, поэтому время  завершения
+    // команды фиксируется без задержек и без активного ожидания
+    {
+        std::vector<std::future<void>> futures;
+        futures.reserve(count);
+        for (int i = 0; i < count; ++i)
+        {
+            if (!prepared[i])
+                continue;
+
+            Relay* relay = _boards[indexes[i]].relay;
+            Relay::SyncGroup* group = &groups[i];
+            futures.push_back(std::async(std::launch::async, [relay, group]()
+            {
+                while (!group->completed())
+                    relay->syncHandleEvents(*group, 100);
+            }));
+        }
+        for (std::future<void>& future : futures)
+            future.wait();
+    }
+
+    QVector<bool> finished;
+    finished.resize(count);
+    {
+        std::vector<std::future<bool>> futures;
+        futures.reserve(count);
+        for (int i = 0; i < count; ++i)
+        {
+            if (!prepared[i])
+            {
+                futures.push_back({});
+                continue;
+            }
+            Relay* relay = _boards[indexes[i]].relay;
+            Relay::SyncGroup* group = &groups[i];
+            futures.push_back(std::async(std::launch::async, [relay, group]()
+            {
+                return relay->syncFinish(*group);
+            }));
+        }
+        for (int i = 0; i < count; ++i)
+            finished[i] = prepared[i] && futures[i].get();
+    }
+
+    for (int i = count - 1; i >= 0; --i)
+    {
+        _boards[indexes[i]].relay->_threadLock.unlock();
+        --_boards[indexes[i]].relay->_commandsActive;
+    }
+
+    // Вычисление разброса времени переключения. Учитывается первая команда
+    // плана каждой платы: по ее завершении на плате изменяется первое реле
+    Transport::AsyncTransfer::TimePoint submitMin, submitMax, completeMin, completeMax;
+    bool first = true;
+    for (int i = 0; i < count; ++i)
+    {
+        if (!finished[i] || groups[i].transferCount == 0)
+            continue;
+
+        const Transport::AsyncTransfer& transfer = groups[i].transfers[0];
+        if (first)
+        {
+            submitMin = submitMax = transfer.submitTime;
+            completeMin = completeMax = transfer.completeTime;
+            first = false;
+            continue;
+        }
+        submitMin = std::min(submitMin, transfer.submitTime);
+        submitMax = std::max(submitMax, transfer.submitTime);
+        completeMin = std::min(completeMin, transfer.completeTime);
+        completeMax = std::max(completeMax, transfer.completeTime);
+    }
+    result.submitSpread = duration_cast<microseconds>(submitMax - submitMin).count();
+    result.skew = duration_cast<microseconds>(completeMax - completeMin).count();
+
+    result.boards = count;
+    for (int i = 0; i < count; ++i)
+        if (!finished[i])
+            failedChannels(changes, indexes[i], result);
+
+    result.success = result.failedChannels.isEmpty();
+
+    if (!result.success)
+        log_error_m << log_format(
+            "Failed apply channels. Failed boards: %? of %?. Failed channels: %?",
+            result.failedBoards, result.boards, result.failedChannels.count());
+
+    log_debug_m << log_format(
+        "Synchronized apply on %? boards. Submit spread: %? us; skew: %? us",
+        result.boards, result.submitSpread, result.skew);
+    return result;
+}
+
+ChannelMap::Result ChannelMap::apply(const QVector<QPair<QString, bool>>& changes,
+                                     int tag) const
+{
+    QVector<Change> ch;
+    ch.reserve(changes.count());
+    for (const QPair<QString, bool>& change : changes)
+    {
+        Change c;
+        c.channelId = channelId(change.first);
+        c.value = change.second;
+        if (c.channelId < 0)
+            log_error_m << "Channel not found: " << change.first;
+        ch.append(c);
+    }
+    return apply(ch, tag);
+}
+
+} // namespace usb
@@ -0,0 +1,133 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#pragma once
+
+#include "usb_relay.h"
+
+#include <QtCore>
+
+namespace usb {
+
+/**
+  Логическая карта каналов. Связывает именованные нагрузки с парами  (серийный
+  номер платы, номер реле) и позволяет переключать группы каналов, располо-
+  женных на разных платах. Изменение группы разбивается на  битовые  маски  по
+  платам, маски отправляются на платы параллельно, результат возвращается  од-
+  ной структурой. Конфигурирование карты (addBoard()/addChannel()) выполняется
+  до начала использования, функция apply() может вызываться из разных потоков
+*/
+class ChannelMap
+{
+public:
+    ChannelMap() = default;
+
+    // Регистрирует плату с серийным номером serial
+    bool addBoard(const QString& serial, Relay*);
+
+    // Добавляет канал. Плата с серийным номером serial должна быть предвари-
+    // тельно зарегистрирована. Нумерация реле начинается с единицы. Возвращает
+    // идентификатор канала или -1 при ошибке
+    int addChannel(const QString& name, const QString& serial, int relayNumber);
+
+    // Возвращает идентификатор канала по имени или -1 если канал не найден
+    int channelId(const QString& name) const;
+
+    // Количество каналов
+    int count() const {return _channels.count();}
+
+    struct Channel
+    {
+        QString name;
+        int boardIndex = {-1};
+        int relayNumber = {0};
+    };
+    const Channel& channel(int id) const {return _channels[id];}
+
+    struct Change
+    {
+        int  channelId = {-1};
+        bool value = {false};
+    };
+
+    struct Result
+    {
+        bool success = {false};
+        int  boards = {0};       // Количество плат, участвовавших в переключении
+        int  failedBoards = {0}; // Количество плат, завершивших переключение с ошибкой
+        QVector<int> failedChannels;
+    };
+
+    // Переключает группу каналов. Для каждой платы выполняется одно обращение
+    // Relay::toggleGroup(), обращения к разным платам выполняются параллельно
+    Result apply(const QVector<Change>& changes, int tag = 0) const;
+
+    // Вариант функции apply() с адресацией каналов по имени
+    Result apply(const QVector<QPair<QString, bool>>& changes, int tag = 0) const;
+
+    struct SyncResult : Result
+    {
+        qint64 submitSpread = {0}; // Разброс времени отправки первых команд
+                                   // плат (в мкс)
+        qint64 skew = {0};         // Разброс времени первого изменения реле
+                                   // на платах (в мкс)
+    };
+
+    // Синхронизированное переключение группы каналов. Планы команд для всех
+    // плат подготавливаются заранее без обращения к платам и отправляются
+    // одновременно асинхронными USB-запросами. В результате возвращается раз-
+    // брос времени переключения между платами, измеренный по завершению пер-
+    // вой команды плана каждой платы
+    SyncResult applySync(const QVector<Change>& changes, int tag = 0) const;
+
+private:
+    DISABLE_DEFAULT_COPY(ChannelMap)
+
+    struct Board
+    {
+        QString serial;
+        Relay*  relay = {nullptr};
+    };
+
+    struct BoardChange
+    {
+        quint8 mask = {0};
+        quint8 values = {0};
+    };
+
+    // Разбивает изменение группы каналов на битовые маски по платам
+    QVector<BoardChange> splitChanges(const QVector<Change>&, Result&) const;
+
+    // Заполняет список каналов, не переключенных из-за ошибки на плате
+    void failedChannels(const QVector<Change>&, int boardIndex, Result&) const;
+
+    QVector<Board> _boards;
+    QHash<QString, int> _boardIndexes;
+
+    QVector<Channel> _channels;
+    QHash<QString, int> _channelIndexes;
+};
+
+} // namespace usb
@@ -0,0 +1,133 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#include "usb_relay_history.h"
+
+namespace usb {
+
+void StateHistory::record(const StateChange& change)
+{
+    Slot& slot = _ring[change.version & (Capacity - 1)];
+
+    slot.seq.store(change.version * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.timestamp.store(change.timestamp, std::memory_order_relaxed);
+    slot.latency.store(change.latency, std::memory_order_relaxed);
+    slot.tag.store(change.tag, std::memory_order_relaxed);
+    slot.oldStates.store(change.oldStates, std::memory_order_relaxed);
+    slot.newStates.store(change.newStates, std::memory_order_relaxed);
+
+    slot.seq.store(change.version * 2 + 2, std::memory_order_release);
+    _lastVersion.store(change.version, std::memory_order_release);
+}
+
+bool StateHistory::read(quint64 version, StateChange& change) const
+{
+    const Slot& slot = _ring[version & (Capacity - 1)];
+
+    quint64 seq = slot.seq.load(std::memory_order_acquire);
+    if (seq != version * 2 + 2)
+        return false;
+
+    change.version   = version;
+    change.timestamp = slot.timestamp.load(std::memory_order_relaxed);
+    change.latency   = slot.latency.load(std::memory_order_relaxed);
+    change.tag       = slot.tag.load(std::memory_order_relaxed);
+    change.oldStates = slot.oldStates.load(std::memory_order_relaxed);
+    change.newStates = slot.newStates.load(std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return (slot.seq.load(std::memory_order_relaxed) == seq);
+}
+
+QVector<StateChange> StateHistory::since(quint64 sinceVersion) const
+{
+    return range(sinceVersion, _lastVersion.load(std::memory_order_acquire));
+}
+
+QVector<StateChange> StateHistory::range(quint64 sinceVersion,
+                                         quint64 lastVersion) const
+{
+    QVector<StateChange> changes;
+    if (lastVersion <= sinceVersion)
+        return changes;
+
+    quint64 first = sinceVersion + 1;
+    if (lastVersion - sinceVersion > quint64(Capacity))
+        first = lastVersion - Capacity + 1;
+
+    changes.reserve(int(lastVersion - first + 1));
+    for (quint64 version = first; version <= lastVersion; ++version)
+    {
+        StateChange change;
+        if (read(version, change))
+            changes.append(change);
+    }
+    return changes;
+}
+
+QVector<StateChange> StateHistory::last(int count) const
+{
+    count = qBound(0, count, int(Capacity));
+
+    // Версия считывается однократно: при повторном чтении в since() писатель
+    // мог бы успеть добавить записи, и результат превысил бы count
+    const quint64 lastVersion = _lastVersion.load(std::memory_order_acquire);
+    QVector<StateChange> changes =
+        range((lastVersion > quint64(count)) ? lastVersion - count : 0, lastVersion);
+
+    if (changes.count() > count)
+        changes.remove(0, changes.count() - count);
+    return changes;
+}
+
+QVector<StateChange> StateHistory::drain(quint64* lost)
+{
+    quint64 drainVersion = _drainVersion.load(std::memory_order_acquire);
+    while (true)
+    {
+        const quint64 lastVersion = _lastVersion.load(std::memory_order_acquire);
+        if (lastVersion <= drainVersion)
+        {
+            if (lost)
+                *lost = 0;
+            return {};
+        }
+
+        // Несколько потоков могут вычитывать историю одновременно, каждая
+        // запись выдается только одному из них
+        if (!_drainVersion.compare_exchange_weak(drainVersion, lastVersion,
+                                                 std::memory_order_acq_rel))
+            continue;
+
+        QVector<StateChange> changes = range(drainVersion, lastVersion);
+        if (lost)
+            *lost = (lastVersion - drainVersion) - quint64(changes.count());
+        return changes;
+    }
+}
+
+} // namespace usb
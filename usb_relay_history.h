@@ -0,0 +1,102 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#pragma once
+
+#include <QtCore>
+#include <atomic>
+
+namespace usb {
+
+/**
+  Запись истории изменений состояний реле
+*/
+struct StateChange
+{
+    quint64 version   = {0}; // Версия состояний после изменения
+    quint64 timestamp = {0}; // Время изменения по монотонным часам (нс),
+                             // см. trace::now()
+    quint32 latency   = {0}; // Задержка (мкс): для команд - от вызова команды
+                             // до подтверждения нового состояния, для внешних
+                             // изменений - от предыдущего опроса до обнаружения
+                             // изменения. Значение 0 - задержка не измерялась
+    qint32  tag       = {0}; // Поле tag команды или Relay::ExternalTag
+    quint8  oldStates = {0};
+    quint8  newStates = {0};
+};
+
+/**
+  История изменений состояний реле одной платы.  Записи хранятся в кольцевом
+  буфере фиксированного размера, при переполнении старые записи перезаписы-
+  ваются. Запись выполняется одним писателем (под блокировкой платы), чтение
+  выполняется без блокировок из любого потока
+*/
+class StateHistory
+{
+public:
+    // Размер кольцевого буфера, должен быть степенью двойки
+    static const int Capacity = 256;
+
+    // Добавляет запись. Поле version должно увеличиваться на единицу
+    // с каждой записью
+    void record(const StateChange&);
+
+    // Записи с версией больше sinceVersion, упорядоченные по возрастанию
+    // версии. Перезаписанные записи пропускаются
+    QVector<StateChange> since(quint64 sinceVersion) const;
+
+    // Последние count записей
+    QVector<StateChange> last(int count = Capacity) const;
+
+    // Возвращает записи, поступившие после предыдущего вызова drain(). Если
+    // параметр lost задан, в него записывается количество записей, которые
+    // были перезаписаны до вычитки
+    QVector<StateChange> drain(quint64* lost = nullptr);
+
+    // Версия последней записи
+    quint64 lastVersion() const {return _lastVersion.load(std::memory_order_acquire);}
+
+private:
+    bool read(quint64 version, StateChange&) const;
+    QVector<StateChange> range(quint64 sinceVersion, quint64 lastVersion) const;
+
+    // Поле seq используется как seqlock: нечетное значение - запись в процес-
+    // се, четное - запись завершена
+    struct Slot
+    {
+        std::atomic<quint64> seq = {0};
+        std::atomic<quint64> timestamp = {0};
+        std::atomic<quint32> latency = {0};
+        std::atomic<qint32>  tag = {0};
+        std::atomic<quint8>  oldStates = {0};
+        std::atomic<quint8>  newStates = {0};
+    };
+    Slot _ring[Capacity];
+
+    std::atomic<quint64> _lastVersion = {0};
+    std::atomic<quint64> _drainVersion = {0};
+};
+
+} // namespace usb
@@ -0,0 +1,540 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#include "usb_relay_metrics.h"
+
+#include "shared/logger/logger.h"
+#include "shared/logger/format.h"
+#include "shared/qt/logger_operators.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define log_error_m   alog::logger().error   (alog_line_location, "UsbRelayMetrics")
+#define log_warn_m    alog::logger().warn    (alog_line_location, "UsbRelayMetrics")
+#define log_info_m    alog::logger().info    (alog_line_location, "UsbRelayMetrics")
+#define log_verbose_m alog::logger().verbose (alog_line_location, "UsbRelayMetrics")
+#define log_debug_m   alog::logger().debug   (alog_line_location, "UsbRelayMetrics")
+#define log_debug2_m  alog::logger().debug2  (alog_line_location, "UsbRelayMetrics")
+
+#define CLIENT_TIMEOUT  1000 // Предельное время обслуживания клиента, мс
+#define CLIENT_MAX      16   // Количество одновременно обслуживаемых клиентов
+
+namespace usb {
+
+namespace {
+
+QByteArray escapeLabel(const QString& value)
+{
+    QByteArray result;
+    for (char ch : value.toUtf8())
+    {
+        if (ch == '\\' || ch == '"')
+            result.append('\\');
+        if (ch == '\n')
+        {
+            result.append("\\n");
+            continue;
+        }
+        result.append(ch);
+    }
+    return result;
+}
+
+void family(QByteArray& out, const char* name, const char* type, const char* help)
+{
+    out.append("# HELP ").append(name).append(' ').append(help).append('\n');
+    out.append("# TYPE ").append(name).append(' ').append(type).append('\n');
+}
+
+void sample(QByteArray& out, const char* name, const QByteArray& labels,
+            const QByteArray& value)
+{
+    out.append(name).append('{').append(labels).append("} ").append(value).append('\n');
+}
+
+} // namespace
+
+MetricsExporter::MetricsExporter()
+{
+    _eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_eventFd < 0)
+        log_error_m << "Failed create eventfd. Error: " << strerror(errno);
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    closeListen();
+    if (_eventFd >= 0)
+        close(_eventFd);
+}
+
+void MetricsExporter::addBoard(Relay* relay, const QString& name)
+{
+    if (relay == nullptr)
+        return;
+
+    QMutexLocker locker {&_boardsLock}; (void) locker;
+    for (Board& board : _boards)
+        if (board.relay == relay)
+        {
+            board.name = name;
+            return;
+        }
+
+    Board board;
+    board.relay = relay;
+    board.name = name;
+    _boards.append(board);
+}
+
+void MetricsExporter::removeBoard(Relay* relay)
+{
+    QMutexLocker locker {&_boardsLock}; (void) locker;
+    for (int i = 0; i < _boards.count(); ++i)
+        if (_boards[i].relay == relay)
+        {
+            _boards.remove(i);
+            break;
+        }
+}
+
+bool MetricsExporter::listen(const QString& address, bool allowRemote)
+{
+    closeListen();
+
+    QString unixPath;
+    if (address.startsWith("unix:"))
+        unixPath = address.mid(5);
+    else if (address.startsWith("/"))
+        unixPath = address;
+
+    if (!unixPath.isEmpty())
+    {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+
+        QByteArray path = unixPath.toUtf8();
+        if (path.length() >= int(sizeof(addr.sun_path)))
+        {
+            log_error_m << "Unix socket path too long: " << unixPath;
+            return false;
+        }
+        memcpy(addr.sun_path, path.constData(), path.length());
+
+        _listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (_listenFd < 0)
+        {
+            log_error_m << "Failed create socket. Error: " << strerror(errno);
+            return false;
+        }
+        unlink(addr.sun_path);
+        if (bind(_listenFd, (sockaddr*)&addr, sizeof(addr)) < 0)
+        {
+            log_error_m << "Failed bind socket " << unixPath
+                        << ". Error: " << strerror(errno);
+            closeListen();
+            return false;
+        }
+        _unixPath = unixPath;
+    }
+    else
+    {
+        QString host = "127.0.0.1";
+        QString port = address;
+        if (address.contains(":"))
+        {
+            host = address.section(':', 0, 0);
+            port = address.section(':', 1);
+        }
+
+        bool ok;
+        int portNumber = port.toInt(&ok);
+        if (!ok || portNumber <= 0 || portNumber > 65535)
+        {
+            log_error_m << "Invalid metrics address: " << address;
+            return false;
+        }
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(quint16(portNumber));
+        if (inet_pton(AF_INET, host.toLatin1().constData(), &addr.sin_addr) != 1)
+        {
+            log_error_m << "Invalid metrics address: " << address;
+            return false;
+        }
+
+        // Метрики отдаются без аутентификации, поэтому по умолчанию допуска-
+        // ются только адреса loopback-интерфейса (127.0.0.0/8)
+        if ((ntohl(addr.sin_addr.s_addr) >> 24) != IN_LOOPBACKNET)
+        {
+            if (!allowRemote)
+            {
+                log_error_m << "Failed listen metrics address " << address
+                            << ". Address is not loopback, remote access not allowed";
+                return false;
+            }
+            log_warn_m << "Metrics address " << address << " is not loopback"
+                       << ". Metrics will be available without authentication"
+                       << " to remote hosts";
+        }
+
+        _listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (_listenFd < 0)
+        {
+            log_error_m << "Failed create socket. Error: " << strerror(errno);
+            return false;
+        }
+        int reuse = 1;
+        setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        if (bind(_listenFd, (sockaddr*)&addr, sizeof(addr)) < 0)
+        {
+            log_error_m << "Failed bind socket " << address
+                        << ". Error: " << strerror(errno);
+            closeListen();
+            return false;
+        }
+    }
+
+    if (::listen(_listenFd, 8) < 0)
+    {
+        log_error_m << "Failed listen socket " << address
+                    << ". Error: " << strerror(errno);
+        closeListen();
+        return false;
+    }
+    log_info_m << "Metrics available at " << address;
+    return true;
+}
+
+void MetricsExporter::closeListen()
+{
+    if (_listenFd >= 0)
+    {
+        close(_listenFd);
+        _listenFd = -1;
+    }
+    if (!_unixPath.isEmpty())
+    {
+        unlink(_unixPath.toUtf8().constData());
+        _unixPath.clear();
+    }
+}
+
+QByteArray MetricsExporter::render() const
+{
+    struct Item
+    {
+        QByteArray labels;
+        Relay::Stats stats;
+    };
+    QVector<Item> items;
+
+    { //Block for QMutexLocker
+        QMutexLocker locker {&_boardsLock}; (void) locker;
+        items.reserve(_boards.count());
+        for (int i = 0; i < _boards.count(); ++i)
+        {
+            Item item;
+            item.stats = _boards[i].relay->stats();
+
+            QString name = _boards[i].name;
+            if (name.isEmpty())
+                name = item.stats.serial;
+            if (name.isEmpty())
+                name = QString("board%1").arg(i);
+
+            item.labels = "board=\"" + escapeLabel(name) + "\"";
+            items.append(item);
+        }
+    }
+
+    QByteArray out;
+    out.reserve(4096 + items.count() * 4096);
+
+    auto counter = [&](const char* name, const char* type, const char* help,
+                       quint64 Relay::Stats::* field)
+    {
+        family(out, name, type, help);
+        for (const Item& item : items)
+            sample(out, name, item.labels, QByteArray::number(item.stats.*field));
+    };
+
+    family(out, "usbrelay_attached", "gauge",
+           "Board is attached (1) or not (0)");
+    for (const Item& item : items)
+        sample(out, "usbrelay_attached", item.labels,
+               item.stats.attached ? "1" : "0");
+
+    family(out, "usbrelay_relay_state", "gauge",
+           "Relay state: on (1) or off (0)");
+    for (const Item& item : items)
+        for (int i = 0; i < item.stats.count; ++i)
+            sample(out, "usbrelay_relay_state",
+                   item.labels + ",relay=\"" + QByteArray::number(i + 1) + "\"",
+                   (item.stats.states & (1U << i)) ? "1" : "0");
+
+    counter("usbrelay_state_changes_total", "counter",
+            "Relay state changes (state version)", &Relay::Stats::stateVersion);
+
+    family(out, "usbrelay_queue_backlog", "gauge",
+           "Commands waiting in the post() queue");
+    for (const Item& item : items)
+        sample(out, "usbrelay_queue_backlog", item.labels,
+               QByteArray::number(item.stats.backlog));
+
+    family(out, "usbrelay_poll_interval_seconds", "gauge",
+           "Current state poll interval, 0 if polling is suspended");
+    for (const Item& item : items)
+        sample(out, "usbrelay_poll_interval_seconds", item.labels,
+               QByteArray::number(item.stats.pollInterval / 1000.0, 'g', 6));
+
+    counter("usbrelay_attaches_total", "counter",
+            "Board attaches", &Relay::Stats::attaches);
+    counter("usbrelay_detaches_total", "counter",
+            "Board detaches", &Relay::Stats::detaches);
+    counter("usbrelay_transfers_total", "counter",
+            "USB transfers issued", &Relay::Stats::transfers);
+    counter("usbrelay_transfer_errors_total", "counter",
+            "USB transfers failed", &Relay::Stats::transferErrors);
+    counter("usbrelay_command_failures_total", "counter",
+            "Failed relay commands (failChange signals)", &Relay::Stats::commandFailures);
+    counter("usbrelay_retries_total", "counter",
+            "Command retry attempts", &Relay::Stats::retries);
+    counter("usbrelay_retries_recovered_total", "counter",
+            "Commands succeeded after retry", &Relay::Stats::retriesRecovered);
+    counter("usbrelay_retries_exhausted_total", "counter",
+            "Commands failed after retry", &Relay::Stats::retriesExhausted);
+    counter("usbrelay_commands_rejected_total", "counter",
+            "Commands rejected because the post() queue was full",
+            &Relay::Stats::commandsRejected);
+    counter("usbrelay_commands_skipped_total", "counter",
+            "Commands completed from the verified state cache without USB traffic",
+            &Relay::Stats::commandsSkipped);
+
+    family(out, "usbrelay_converged", "gauge",
+           "Enforced relays match the desired state (1) or not (0)");
+    for (const Item& item : items)
+        sample(out, "usbrelay_converged", item.labels,
+               item.stats.converged ? "1" : "0");
+
+    counter("usbrelay_reconcile_corrections_total", "counter",
+            "Corrections made to reach the desired state",
+            &Relay::Stats::reconcileCorrections);
+    counter("usbrelay_reconcile_failures_total", "counter",
+            "Failed corrections", &Relay::Stats::reconcileFailures);
+
+    family(out, "usbrelay_convergence_seconds", "gauge",
+           "Duration of the last convergence to the desired state");
+    for (const Item& item : items)
+        sample(out, "usbrelay_convergence_seconds", item.labels,
+               QByteArray::number(item.stats.convergenceTime / 1000000.0, 'f', 6));
+
+    const char* latency = "usbrelay_transfer_latency_seconds";
+    family(out, latency, "histogram", "Successful USB transfer duration");
+    for (const Item& item : items)
+    {
+        quint64 cumulative = 0;
+        for (int i = 0; i < Relay::LatencyBuckets; ++i)
+        {
+            cumulative += item.stats.transferLatency[i];
+            QByteArray le = (i < Relay::LatencyBuckets - 1)
+                            ? QByteArray::number(Relay::LatencyBounds[i] / 1000000.0, 'g', 6)
+                            : QByteArray("+Inf");
+            sample(out, "usbrelay_transfer_latency_seconds_bucket",
+                   item.labels + ",le=\"" + le + "\"",
+                   QByteArray::number(cumulative));
+        }
+        sample(out, "usbrelay_transfer_latency_seconds_sum", item.labels,
+               QByteArray::number(item.stats.transferLatencySum / 1000000.0, 'f', 6));
+        sample(out, "usbrelay_transfer_latency_seconds_count", item.labels,
+               QByteArray::number(cumulative));
+    }
+    return out;
+}
+
+bool MetricsExporter::serveClient(Client& client)
+{
+    if (client.response.isEmpty())
+    {
+        char buff[1024];
+        ssize_t res = read(client.fd, buff, sizeof(buff));
+        if (res < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        if (res == 0)
+            return false;
+        client.request.append(buff, int(res));
+
+        // Достаточно получить строку запроса, заголовки не анализируются
+        if (!client.request.contains("\r\n\r\n") && !client.request.contains("\n\n")
+            && client.request.length() < 8192)
+            return true;
+
+        if (client.request.startsWith("GET "))
+        {
+            QByteArray body = render();
+            client.response =
+                "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                "Content-Length: " + QByteArray::number(body.length()) + "\r\n"
+                "Connection: close\r\n\r\n" + body;
+        }
+        else
+        {
+            client.response = "HTTP/1.0 405 Method Not Allowed\r\n"
+                              "Content-Length: 0\r\n"
+                              "Connection: close\r\n\r\n";
+        }
+    }
+
+    // MSG_NOSIGNAL: закрытое клиентом соединение не должно приводить к SIGPIPE
+    while (client.written < client.response.length())
+    {
+        ssize_t res = send(client.fd, client.response.constData() + client.written,
+                           size_t(client.response.length() - client.written),
+                           MSG_NOSIGNAL);
+        if (res < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        client.written += int(res);
+    }
+    return false;
+}
+
+void MetricsExporter::run()
+{
+    using namespace std::chrono;
+
+    log_info_m << "Started";
+
+    if (_listenFd < 0)
+        log_warn_m << "Listen address not set, metrics available only via render()";
+
+    QVector<Client> clients;
+    QVector<pollfd> pfds;
+
+    while (true)
+    {
+        CHECK_QTHREADEX_STOP
+
+        // Индексы: 0 - eventfd, 1 - слушающий сокет (-1 если новые соедине-
+        // ния не принимаются), далее клиенты в порядке clients
+        pfds.resize(0);
+        pfds.append({_eventFd, POLLIN, 0});
+        pfds.append({(clients.count() < CLIENT_MAX) ? _listenFd : -1, POLLIN, 0});
+
+        int timeout = -1;
+        steady_clock::time_point now = steady_clock::now();
+        for (const Client& client : clients)
+        {
+            pfds.append({client.fd, short(client.response.isEmpty() ? POLLIN : POLLOUT), 0});
+            int remain = int(qMax<qint64>(
+                duration_cast<milliseconds>(client.deadline - now).count() + 1, 0));
+            timeout = (timeout < 0) ? remain : qMin(timeout, remain);
+        }
+
+        int res = ::poll(pfds.data(), nfds_t(pfds.count()), timeout);
+        if (res < 0)
+        {
+            if (errno != EINTR)
+            {
+                log_error_m << "Failed wait metrics requests. Error: " << strerror(errno);
+                msleep(100);
+            }
+            continue;
+        }
+        if (pfds[0].revents)
+        {
+            quint64 val;
+            while (read(_eventFd, &val, sizeof(val)) > 0) {}
+            continue;
+        }
+
+        now = steady_clock::now();
+        for (int i = clients.count() - 1; i >= 0; --i)
+        {
+            Client& client = clients[i];
+            bool active = true;
+            if (pfds[2 + i].revents)
+                active = serveClient(client);
+
+            if (active && now >= client.deadline)
+            {
+                log_debug_m << "Metrics client timed out";
+                active = false;
+            }
+            if (!active)
+            {
+                close(client.fd);
+                clients.remove(i);
+            }
+        }
+
+        if (pfds[1].revents & POLLIN)
+        {
+            while (clients.count() < CLIENT_MAX)
+            {
+                int fd = accept4(_listenFd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                if (fd < 0)
+                {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                        log_error_m << "Failed accept connection. Error: " << strerror(errno);
+                    break;
+                }
+                Client client;
+                client.fd = fd;
+                client.deadline = now + milliseconds(CLIENT_TIMEOUT);
+                clients.append(client);
+            }
+        }
+    }
+
+    for (const Client& client : clients)
+        close(client.fd);
+
+    log_info_m << "Stopped";
+}
+
+void MetricsExporter::threadStopEstablished()
+{
+    if (_eventFd < 0)
+        return;
+
+    quint64 val = 1;
+    if (write(_eventFd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+        log_error_m << "Failed write to eventfd. Error: " << strerror(errno);
+}
+
+} // namespace usb
@@ -0,0 +1,98 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#pragma once
+
+#include "usb_relay.h"
+
+#include <QtCore>
+#include <chrono>
+
+namespace usb {
+
+/**
+  Экспорт метрик плат реле в текстовом формате Prometheus (text exposition
+  format 0.0.4). Метрики отдаются по HTTP через Unix-сокет или TCP-порт на
+  loopback-интерфейсе. Значения формируются из Relay::stats(), поэтому сбор
+  метрик не захватывает блокировки плат и не влияет на исполнение команд
+*/
+class MetricsExporter : public QThreadEx
+{
+public:
+    MetricsExporter();
+    ~MetricsExporter();
+
+    // Добавляет/удаляет плату. Параметр name используется как значение метки
+    // board, если он пуст - используется серийный номер платы
+    void addBoard(Relay*, const QString& name = QString());
+    void removeBoard(Relay*);
+
+    // Задает точку подключения. Адрес в формате "unix:/path/to/socket" (или
+    // абсолютный путь) - Unix-сокет, "port" или "127.0.0.1:port" - TCP-порт
+    // на loopback-интерфейсе. Адрес вне loopback-интерфейса  отклоняется,
+    // если не задан параметр allowRemote. Вызывается до start()
+    bool listen(const QString& address, bool allowRemote = false);
+
+    // Текущие значения метрик
+    QByteArray render() const;
+
+private:
+    Q_OBJECT
+    DISABLE_DEFAULT_COPY(MetricsExporter)
+
+    void run() override;
+    void threadStopEstablished() override;
+
+    // Клиенты обслуживаются в неблокирующем режиме, время обслуживания одно-
+    // го клиента ограничено, поэтому медленный клиент не задерживает остальных
+    struct Client
+    {
+        typedef std::chrono::steady_clock::time_point TimePoint;
+
+        int        fd = {-1};
+        QByteArray request;
+        QByteArray response;
+        int        written = {0};
+        TimePoint  deadline;
+    };
+
+    // Возвращает FALSE, если обслуживание клиента завершено
+    bool serveClient(Client&);
+    void closeListen();
+
+    struct Board
+    {
+        Relay*  relay = {nullptr};
+        QString name;
+    };
+    mutable QMutex _boardsLock;
+    QVector<Board> _boards;
+
+    int _listenFd = {-1};
+    int _eventFd = {-1};
+    QString _unixPath;
+};
+
+} // namespace usb
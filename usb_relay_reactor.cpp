@@ -0,0 +1,352 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#include "usb_relay_reactor.h"
+
+#include "shared/logger/logger.h"
+#include "shared/logger/format.h"
+#include "shared/qt/logger_operators.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define log_error_m   alog::logger().error   (alog_line_location, "UsbRelayReactor")
+#define log_warn_m    alog::logger().warn    (alog_line_location, "UsbRelayReactor")
+#define log_info_m    alog::logger().info    (alog_line_location, "UsbRelayReactor")
+#define log_verbose_m alog::logger().verbose (alog_line_location, "UsbRelayReactor")
+#define log_debug_m   alog::logger().debug   (alog_line_location, "UsbRelayReactor")
+#define log_debug2_m  alog::logger().debug2  (alog_line_location, "UsbRelayReactor")
+
+namespace usb {
+
+using namespace std::chrono;
+
+RelayReactor::RelayReactor()
+{
+    _eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_eventFd < 0)
+        log_error_m << "Failed create eventfd. Error: " << strerror(errno);
+}
+
+RelayReactor::~RelayReactor()
+{
+    if (_eventFd >= 0)
+        close(_eventFd);
+}
+
+bool RelayReactor::addBoard(Relay* relay)
+{
+    if (relay == nullptr)
+        return false;
+
+    if (relay->isRunning())
+    {
+        log_error_m << "Failed add board. Relay thread already started";
+        return false;
+    }
+
+    QMutexLocker locker {&_boardsLock}; (void) locker;
+    for (const Board& board : _boards)
+        if (board.relay == relay)
+            return true;
+
+    { //Block for QMutexLocker
+        QMutexLocker locker {&relay->_threadLock}; (void) locker;
+        relay->_reactor = this;
+    }
+
+    Board board;
+    board.relay = relay;
+    board.nextClaim = steady_clock::now();
+    _boards.append(board);
+
+    wake();
+    return true;
+}
+
+void RelayReactor::removeBoard(Relay* relay)
+{
+    QMutexLocker locker {&_boardsLock}; (void) locker;
+    for (int i = 0; i < _boards.count(); ++i)
+    {
+        if (_boards[i].relay != relay)
+            continue;
+
+        waitAttach(_boards[i]);
+        if (_boards[i].attached)
+        {
+            relay->asyncAbort();
+            relay->detachDevice(false);
+        }
+
+        { //Block for QMutexLocker
+            QMutexLocker locker {&relay->_threadLock}; (void) locker;
+            relay->_reactor = nullptr;
+        }
+        _boards.remove(i);
+        break;
+    }
+}
+
+QVector<RelayReactor::BoardStat> RelayReactor::stats() const
+{
+    QVector<QPair<Relay*, bool>> boards;
+    { //Block for QMutexLocker
+        QMutexLocker locker {&_boardsLock}; (void) locker;
+        boards.reserve(_boards.count());
+        for (const Board& board : _boards)
+            boards.append({board.relay, board.attached});
+    }
+
+    // Значения берутся из снимка Relay::stats(), не захватывающего блокировку
+    // платы: реактор удерживает _boardsLock при обслуживании платы под ее
+    // блокировкой, поэтому обратный порядок захвата приводил бы к взаимной
+    // блокировке
+    QVector<BoardStat> stats;
+    stats.reserve(boards.count());
+    for (const QPair<Relay*, bool>& board : boards)
+    {
+        const Relay::Stats relayStats = board.first->stats();
+
+        BoardStat stat;
+        stat.serial = relayStats.serial;
+        stat.attached = board.second;
+        stat.pollInterval = relayStats.pollInterval;
+        stat.backlog = relayStats.backlog;
+        stats.append(stat);
+    }
+    return stats;
+}
+
+void RelayReactor::wake()
+{
+    if (_eventFd < 0)
+        return;
+
+    quint64 val = 1;
+    if (write(_eventFd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+        log_error_m << "Failed write to eventfd. Error: " << strerror(errno);
+}
+
+void RelayReactor::waitAttach(Board& board)
+{
+    if (!board.attach.valid())
+        return;
+
+    board.attached = board.attach.get();
+    board.attach = std::shared_future<bool>();
+}
+
+RelayReactor::Board::TimePoint RelayReactor::serviceBoard(Board& board)
+{
+    Relay* relay = board.relay;
+
+    if (board.attach.valid())
+    {
+        if (board.attach.wait_for(seconds(0)) != std::future_status::ready)
+            return steady_clock::time_point::max();
+
+        waitAttach(board);
+        if (!board.attached)
+        {
+            int timeout = Relay::claimRetryTimeout(board.claimAttempts++);
+            board.nextClaim = steady_clock::now() + seconds(timeout);
+        }
+        else
+        {
+            board.claimAttempts = 0;
+            board.lastPoll = steady_clock::now();
+        }
+    }
+
+    if (!board.attached)
+    {
+        // Команды, поставленные в очередь до подключения платы, завершаются
+        // с ошибкой (см. Relay::toggleInternal())
+        relay->processCommands();
+
+        if (steady_clock::now() < board.nextClaim)
+            return board.nextClaim;
+
+        // Захват выполняется во вспомогательном потоке, по его  завершении
+        // реактор пробуждается
+        board.attach = std::async(std::launch::async, [this, relay]()
+        {
+            bool attached = relay->attachDevice();
+            wake();
+            return attached;
+        }).share();
+        return steady_clock::time_point::max();
+    }
+
+    if (relay->detachRequired())
+    {
+        // Выполняющаяся операция отменяется до закрытия устройства
+        relay->asyncAbort();
+        relay->detachDevice(true);
+        board.attached = false;
+        board.nextClaim = steady_clock::now();
+        return board.nextClaim;
+    }
+
+    // Завершение отправленных запросов обрабатывается в цикле событий
+    if (relay->asyncBusy())
+        return steady_clock::time_point::max();
+
+    // Если опрос приостановлен, то реактор будет разбужен при подключении
+    // к сигналу changed(), при поступлении команды или при изменении требуе-
+    // мого состояния
+    const steady_clock::time_point now = steady_clock::now();
+    int interval = relay->pollInterval();
+    bool pollDue = (interval != 0) && (now >= board.lastPoll + milliseconds(interval));
+    if (pollDue)
+        board.lastPoll = now;
+
+    if (relay->asyncStart(pollDue))
+        return steady_clock::time_point::max();
+
+    // Команда зарезервирована в очереди, но еще не опубликована
+    if (relay->backlog() > 0)
+        return now;
+
+    int retryDelay = relay->asyncRetryDelay();
+    if (retryDelay >= 0)
+        return now + milliseconds(retryDelay);
+
+    relay->reconcile();
+
+    interval = relay->pollInterval();
+    if (interval == 0)
+        return steady_clock::time_point::max();
+
+    return board.lastPoll + milliseconds(interval);
+}
+
+void RelayReactor::run()
+{
+    log_info_m << "Started";
+
+    QVector<pollfd> fds;
+    while (true)
+    {
+        CHECK_QTHREADEX_STOP
+
+        steady_clock::time_point wakeTime = steady_clock::now() + seconds(1);
+
+        fds.resize(1);
+        fds[0] = {_eventFd, POLLIN, 0};
+        bool busy = false;
+        bool pollable = true;
+
+        // Блокировка захватывается на время обслуживания одной платы,  чтобы
+        // вызовы addBoard()/removeBoard()/stats() не ожидали обхода всех плат.
+        // Длительный захват платы выполняется вне блокировки (см. Board::attach),
+        // обмен с платами выполняется асинхронно
+        for (int i = 0;; ++i)
+        {
+            QMutexLocker locker {&_boardsLock}; (void) locker;
+            if (i >= _boards.count() || threadStop())
+                break;
+
+            Board& board = _boards[i];
+            steady_clock::time_point time = serviceBoard(board);
+            if (time < wakeTime)
+                wakeTime = time;
+
+            if (board.attached && board.relay->asyncBusy())
+            {
+                busy = true;
+                if (!board.relay->asyncPollFds(fds))
+                    pollable = false;
+            }
+        }
+        if (threadStop())
+            continue;
+
+        // Ожидание событий всех плат выполняется одним вызовом poll(). Если
+        // транспорт платы не предоставляет дескрипторы, то ожидание не выпол-
+        // няется. Время ожидания при отправленных запросах ограничено, чтобы
+        // своевременно обрабатывать таймауты запросов
+        qint64 timeout =
+            duration_cast<milliseconds>(wakeTime - steady_clock::now()).count();
+        if (busy)
+            timeout = (pollable) ? qMin(timeout, qint64(100)) : 0;
+
+        if (timeout > 0)
+        {
+            int res = ::poll(fds.data(), nfds_t(fds.count()), int(timeout));
+            if (res < 0 && errno != EINTR)
+            {
+                log_error_m << "Failed wait reactor events. Error: " << strerror(errno);
+                msleep(timeout);
+                continue;
+            }
+            if (res > 0 && (fds[0].revents & POLLIN))
+            {
+                quint64 val;
+                while (read(_eventFd, &val, sizeof(val)) > 0) {}
+            }
+        }
+        if (!busy)
+            continue;
+
+        for (int i = 0;; ++i)
+        {
+            QMutexLocker locker {&_boardsLock}; (void) locker;
+            if (i >= _boards.count())
+                break;
+
+            Board& board = _boards[i];
+            if (board.attached && board.relay->asyncBusy())
+                board.relay->asyncEvents();
+        }
+    }
+
+    { //Block for QMutexLocker
+        QMutexLocker locker {&_boardsLock}; (void) locker;
+        for (Board& board : _boards)
+        {
+            waitAttach(board);
+            if (board.attached)
+            {
+                board.relay->asyncAbort();
+                board.relay->detachDevice(false);
+                board.attached = false;
+            }
+        }
+    }
+
+    log_info_m << "Stopped";
+}
+
+void RelayReactor::threadStopEstablished()
+{
+    wake();
+}
+
+} // namespace usb
@@ -0,0 +1,106 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#pragma once
+
+#include "usb_relay.h"
+
+#include <QtCore>
+#include <chrono>
+#include <future>
+
+namespace usb {
+
+/**
+  Механизм обслуживания нескольких плат реле в одном потоке. Опрос состояний
+  и исполнение команд из очередей post() выполняются асинхронными запросами:
+  запросы отправляются на все подключенные платы без ожидания ответа, а их
+  завершение и пробуждение через eventfd ожидаются в общем цикле событий.
+  Поэтому медленная плата не задерживает обслуживание остальных. Платы, до-
+  бавленные в реактор, не должны запускаться как отдельные потоки.
+  Поиск и захват платы (Relay::attachDevice()) может длиться несколько секунд,
+  поэтому выполняется во вспомогательном потоке и не задерживает обслуживание
+  остальных плат. Сигнал attached() эмитируется из вспомогательного потока
+*/
+class RelayReactor : public QThreadEx
+{
+public:
+    RelayReactor();
+    ~RelayReactor();
+
+    // Добавляет/удаляет плату из обслуживания
+    bool addBoard(Relay*);
+    void removeBoard(Relay*);
+
+    struct BoardStat
+    {
+        QString serial;
+        bool attached = {false};
+        int  pollInterval = {0}; // Интервал опроса (в миллисекундах), 0 - опрос
+                                 // приостановлен
+        int  backlog = {0};      // Количество команд в очереди
+    };
+    QVector<BoardStat> stats() const;
+
+    // Пробуждает поток реактора
+    void wake();
+
+private:
+    Q_OBJECT
+    DISABLE_DEFAULT_COPY(RelayReactor)
+
+    void run() override;
+    void threadStopEstablished() override;
+
+    struct Board
+    {
+        typedef std::chrono::steady_clock::time_point TimePoint;
+
+        Relay*    relay = {nullptr};
+        bool      attached = {false};
+
+        // Результат захвата платы, выполняемого во вспомогательном потоке.
+        // Пока захват не завершен, плата не обслуживается
+        std::shared_future<bool> attach;
+
+        quint32   claimAttempts = {0};
+        TimePoint nextClaim;
+        TimePoint lastPoll;
+    };
+
+    // Выполняет обслуживание платы, возвращает время следующего обслуживания
+    Board::TimePoint serviceBoard(Board&);
+
+    // Ожидает завершения захвата платы, если он выполняется
+    static void waitAttach(Board&);
+
+private:
+    QVector<Board> _boards;
+    mutable QMutex _boardsLock;
+
+    int _eventFd = {-1};
+};
+
+} // namespace usb
@@ -0,0 +1,216 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#include "usb_relay_trace.h"
+
+#include "shared/logger/logger.h"
+#include "shared/logger/format.h"
+#include "shared/qt/logger_operators.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define log_error_m   alog::logger().error   (alog_line_location, "UsbRelayTrace")
+#define log_warn_m    alog::logger().warn    (alog_line_location, "UsbRelayTrace")
+#define log_info_m    alog::logger().info    (alog_line_location, "UsbRelayTrace")
+#define log_verbose_m alog::logger().verbose (alog_line_location, "UsbRelayTrace")
+#define log_debug_m   alog::logger().debug   (alog_line_location, "UsbRelayTrace")
+#define log_debug2_m  alog::logger().debug2  (alog_line_location, "UsbRelayTrace")
+
+namespace usb {
+namespace trace {
+
+std::atomic_bool traceEnabled = {false};
+
+namespace {
+
+// Размер кольцевого буфера, должен быть степенью двойки
+const quint64 RING_SIZE = 32768;
+
+// Ячейка кольцевого буфера. Поле seq используется как  seqlock:  нечетное
+// значение - запись в процессе, четное - запись завершена. Поля события
+// атомарные, что исключает гонки данных при одновременном чтении и записи
+struct Slot
+{
+    std::atomic<quint64>     seq = {0};
+    std::atomic<const char*> name = {nullptr};
+    std::atomic<const void*> owner = {nullptr};
+    std::atomic<quint64>     start = {0};
+    std::atomic<quint64>     finish = {0};
+    std::atomic<qint32>      arg = {0};
+    std::atomic<qint32>      tid = {0};
+    std::atomic<quint8>      category = {0};
+};
+
+Slot ring[RING_SIZE];
+std::atomic<quint64> writeIndex = {0};
+
+struct Event
+{
+    const char* name;
+    const void* owner;
+    quint64 start;
+    quint64 finish;
+    qint32  arg;
+    qint32  tid;
+    quint8  category;
+};
+
+const char* categoryName(quint8 category)
+{
+    switch (Category(category))
+    {
+        case Category::Lock:     return "lock";
+        case Category::Transfer: return "transfer";
+        case Category::Poll:     return "poll";
+        case Category::Signal:   return "signal";
+        case Category::Command:  return "command";
+    }
+    return "unknown";
+}
+
+qint32 threadId()
+{
+    thread_local qint32 tid = qint32(syscall(SYS_gettid));
+    return tid;
+}
+
+} // namespace
+
+void setEnabled(bool val)
+{
+    traceEnabled = val;
+}
+
+quint64 now()
+{
+    using namespace std::chrono;
+    return quint64(duration_cast<nanoseconds>(
+                       steady_clock::now().time_since_epoch()).count());
+}
+
+void record(const char* name, Category category, const void* owner,
+            quint64 start, quint64 finish, int arg)
+{
+    quint64 index = writeIndex.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = ring[index & (RING_SIZE - 1)];
+
+    slot.seq.store(index * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.owner.store(owner, std::memory_order_relaxed);
+    slot.start.store(start, std::memory_order_relaxed);
+    slot.finish.store(finish, std::memory_order_relaxed);
+    slot.arg.store(arg, std::memory_order_relaxed);
+    slot.tid.store(threadId(), std::memory_order_relaxed);
+    slot.category.store(quint8(category), std::memory_order_relaxed);
+
+    slot.seq.store(index * 2 + 2, std::memory_order_release);
+}
+
+void clear()
+{
+    for (Slot& slot : ring)
+        slot.seq.store(0, std::memory_order_relaxed);
+}
+
+QByteArray exportChromeJson()
+{
+    QVector<Event> events;
+    events.reserve(int(RING_SIZE));
+
+    for (Slot& slot : ring)
+    {
+        quint64 seq1 = slot.seq.load(std::memory_order_acquire);
+        if (seq1 == 0 || (seq1 & 1))
+            continue;
+
+        Event event;
+        event.name     = slot.name.load(std::memory_order_relaxed);
+        event.owner    = slot.owner.load(std::memory_order_relaxed);
+        event.start    = slot.start.load(std::memory_order_relaxed);
+        event.finish   = slot.finish.load(std::memory_order_relaxed);
+        event.arg      = slot.arg.load(std::memory_order_relaxed);
+        event.tid      = slot.tid.load(std::memory_order_relaxed);
+        event.category = slot.category.load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq1)
+            continue;
+
+        events.append(event);
+    }
+
+    std::sort(events.begin(), events.end(), [](const Event& e1, const Event& e2)
+    {
+        return e1.start < e2.start;
+    });
+
+    QByteArray json;
+    json.reserve(events.count() * 160 + 64);
+    json.append("{\"traceEvents\":[");
+
+    const qint32 pid = qint32(getpid());
+    char buff[256];
+    for (int i = 0; i < events.count(); ++i)
+    {
+        const Event& e = events[i];
+        int len = snprintf(buff, sizeof(buff),
+            "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f"
+            ",\"pid\":%d,\"tid\":%d,\"args\":{\"board\":\"%p\",\"arg\":%d}}",
+            (i == 0) ? "" : ",\n", e.name, categoryName(e.category),
+            double(e.start) / 1000, double(e.finish - e.start) / 1000,
+            pid, e.tid, e.owner, e.arg);
+        json.append(buff, qMin(len, int(sizeof(buff)) - 1));
+    }
+    json.append("],\"displayTimeUnit\":\"ns\"}\n");
+    return json;
+}
+
+bool exportChromeJson(const QString& fileName)
+{
+    QFile file {fileName};
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        log_error_m << "Failed open file " << fileName
+                    << ". Detail: " << file.errorString();
+        return false;
+    }
+    QByteArray json = exportChromeJson();
+    if (file.write(json) != json.length())
+    {
+        log_error_m << "Failed write file " << fileName
+                    << ". Detail: " << file.errorString();
+        return false;
+    }
+    return true;
+}
+
+} // namespace trace
+} // namespace usb
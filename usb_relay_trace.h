@@ -0,0 +1,111 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#pragma once
+
+#include <QtCore>
+#include <atomic>
+
+/**
+  Трассировка временных интервалов работы драйвера USB-реле.  События  записы-
+  ваются в кольцевой буфер фиксированного размера без использования блокировок.
+  При переполнении буфера старые события перезаписываются. Накопленные события
+  можно экспортировать в формате Chrome trace JSON для просмотра в Perfetto
+  (https://ui.perfetto.dev) или chrome://tracing. По умолчанию трассировка
+  выключена, в этом случае стоимость точки трассировки - одно атомарное чтение
+*/
+namespace usb {
+namespace trace {
+
+enum class Category : quint8
+{
+    Lock     = 0, // Ожидание захвата _threadLock
+    Transfer = 1, // USB control transfer
+    Poll     = 2, // Цикл опроса состояний реле
+    Signal   = 3, // Эмиссия сигнала
+    Command  = 4  // Исполнение команды переключения
+};
+
+extern std::atomic_bool traceEnabled;
+
+// Включает/выключает трассировку
+void setEnabled(bool);
+inline bool enabled() {return traceEnabled.load(std::memory_order_relaxed);}
+
+// Текущее время монотонных часов (в наносекундах)
+quint64 now();
+
+// Записывает событие в кольцевой буфер. Параметр name должен указывать
+// на строку со статическим временем жизни. Параметр owner идентифицирует
+// плату (объект Relay), arg - дополнительный числовой параметр события
+void record(const char* name, Category, const void* owner,
+            quint64 start, quint64 finish, int arg = 0);
+
+// Очищает кольцевой буфер
+void clear();
+
+// Экспорт накопленных событий в формате Chrome trace JSON
+QByteArray exportChromeJson();
+bool exportChromeJson(const QString& fileName);
+
+/**
+  Временной интервал. Событие записывается при вызове finish() или в деструк-
+  торе, если трассировка была включена на момент создания объекта
+*/
+class Span
+{
+public:
+    Span(const char* name, Category category, const void* owner, int arg = 0)
+        : _name(name), _owner(owner), _arg(arg), _category(category)
+    {
+        if (enabled())
+            _start = now();
+    }
+    ~Span() {finish();}
+
+    void setArg(int arg) {_arg = arg;}
+
+    void finish()
+    {
+        if (_start)
+        {
+            record(_name, _category, _owner, _start, now(), _arg);
+            _start = 0;
+        }
+    }
+
+private:
+    Span(const Span&) = delete;
+    Span& operator= (const Span&) = delete;
+
+    const char* _name;
+    const void* _owner;
+    quint64 _start = {0};
+    int _arg;
+    Category _category;
+};
+
+} // namespace trace
+} // namespace usb
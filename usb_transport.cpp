@@ -0,0 +1,465 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#include "usb_transport.h"
+
+#include "shared/logger/logger.h"
+#include "shared/logger/format.h"
+#include "shared/qt/logger_operators.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define log_error_m   alog::logger().error   (alog_line_location, "UsbTransport")
+#define log_warn_m    alog::logger().warn    (alog_line_location, "UsbTransport")
+#define log_info_m    alog::logger().info    (alog_line_location, "UsbTransport")
+#define log_verbose_m alog::logger().verbose (alog_line_location, "UsbTransport")
+#define log_debug_m   alog::logger().debug   (alog_line_location, "UsbTransport")
+#define log_debug2_m  alog::logger().debug2  (alog_line_location, "UsbTransport")
+
+#define TRANSFER_DATA_SIZE  64 // Размер данных заранее выделенного запроса
+
+namespace usb {
+
+LibusbTransport::~LibusbTransport()
+{
+    // Запрос освобождается до libusb_exit(), пока контекст еще действителен
+    freeTransfer();
+    deinit();
+}
+
+int LibusbTransport::init()
+{
+    if (_context)
+        return LIBUSB_SUCCESS;
+
+    int res = libusb_init(&_context);
+    if (res != LIBUSB_SUCCESS)
+        _context = nullptr;
+    return res;
+}
+
+void LibusbTransport::deinit()
+{
+    close();
+    freeDeviceList();
+    if (_shared)
+    {
+        _context = nullptr;
+        return;
+    }
+    if (_context)
+    {
+        libusb_exit(_context);
+        _context = nullptr;
+    }
+}
+
+bool LibusbTransport::hotplugCapable() const
+{
+    return libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+}
+
+int LibusbTransport::deviceList(QVector<DeviceInfo>& devices)
+{
+    freeDeviceList();
+    devices.clear();
+
+    ssize_t devCount = libusb_get_device_list(_context, &_devList);
+    if (devCount < 0)
+    {
+        _devList = nullptr;
+        return int(devCount);
+    }
+
+    devices.reserve(int(devCount));
+    for (ssize_t i = 0; i < devCount; ++i)
+    {
+        libusb_device* device = _devList[i];
+        libusb_device_descriptor descript;
+        int res = libusb_get_device_descriptor(device, &descript);
+        if (res != LIBUSB_SUCCESS)
+        {
+            log_error_m << "Failed get device descriptor"
+                        << ". Error code: " << res
+                        << ". Detail: " << libusb_error_name(res);
+            continue;
+        }
+
+        DeviceInfo info;
+        info.index = int(i);
+        info.busNumber = libusb_get_bus_number(device);
+        info.deviceNumber = libusb_get_device_address(device);
+        info.vendorId = descript.idVendor;
+        info.productId = descript.idProduct;
+        info.iManufacturer = descript.iManufacturer;
+        info.iProduct = descript.iProduct;
+        devices.append(info);
+    }
+    return int(devCount);
+}
+
+void LibusbTransport::freeDeviceList()
+{
+    if (_shared)
+    {
+        _devList = nullptr;
+        return;
+    }
+    if (_devList)
+    {
+        // Открытое устройство удерживает собственную ссылку
+        libusb_free_device_list(_devList, 1);
+        _devList = nullptr;
+    }
+}
+
+Transport* LibusbTransport::createProbe()
+{
+    if (_context == nullptr || _devList == nullptr)
+        return nullptr;
+
+    LibusbTransport* probe = new LibusbTransport;
+    probe->_context = _context;
+    probe->_devList = _devList;
+    probe->_shared = true;
+    return probe;
+}
+
+bool LibusbTransport::takeDevice(Transport* transport)
+{
+    LibusbTransport* probe = dynamic_cast<LibusbTransport*>(transport);
+    if (probe == nullptr || probe->_context != _context)
+        return false;
+
+    close();
+    _interrupted = false;
+    _deviceHandle = probe->_deviceHandle;
+    probe->_deviceHandle = nullptr;
+    return true;
+}
+
+int LibusbTransport::open(const DeviceInfo& info)
+{
+    if (_devList == nullptr || info.index < 0)
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    _interrupted = false;
+    int res = libusb_open(_devList[info.index], &_deviceHandle);
+    if (res != LIBUSB_SUCCESS)
+        _deviceHandle = nullptr;
+    return res;
+}
+
+void LibusbTransport::close()
+{
+    if (_deviceHandle)
+    {
+        libusb_close(_deviceHandle);
+        _deviceHandle = nullptr;
+    }
+}
+
+int LibusbTransport::stringDescriptor(quint8 index, char* buff, int buffSize)
+{
+    return libusb_get_string_descriptor_ascii(_deviceHandle, index,
+                                              (uchar*)buff, buffSize);
+}
+
+int LibusbTransport::checkActiveConfig()
+{
+    libusb_config_descriptor* config;
+    int res = libusb_get_active_config_descriptor(libusb_get_device(_deviceHandle), &config);
+    if (res == LIBUSB_SUCCESS)
+        libusb_free_config_descriptor(config);
+    return res;
+}
+
+int LibusbTransport::setAutoDetachKernelDriver(bool val)
+{
+    return libusb_set_auto_detach_kernel_driver(_deviceHandle, int(val));
+}
+
+int LibusbTransport::claimInterface(int number)
+{
+    return libusb_claim_interface(_deviceHandle, number);
+}
+
+int LibusbTransport::releaseInterface(int number)
+{
+    return libusb_release_interface(_deviceHandle, number);
+}
+
+int LibusbTransport::controlTransfer(quint8 requestType, quint8 request,
+                                     quint16 value, quint16 index,
+                                     uchar* data, quint16 length, uint timeout)
+{
+    // Запрос выполняется в асинхронном режиме, чтобы его можно было прервать
+    // через interrupt() при отключении устройства
+    if (_interrupted)
+        return LIBUSB_ERROR_INTERRUPTED;
+
+    libusb_transfer* t = acquireTransfer(length);
+    if (t == nullptr)
+        return LIBUSB_ERROR_NO_MEM;
+
+    uchar* buff = t->buffer;
+    libusb_fill_control_setup(buff, requestType, request, value, index, length);
+    if ((requestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
+        memcpy(buff + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+
+    AsyncTransfer transfer;
+    libusb_fill_control_transfer(t, _deviceHandle, buff,
+                                 syncTransferCallback, &transfer, timeout);
+
+    int res = libusb_submit_transfer(t);
+    if (res != LIBUSB_SUCCESS)
+    {
+        releaseTransfer(t);
+        return res;
+    }
+
+    bool cancelled = false;
+    while (!transfer.completed)
+    {
+        if (!cancelled && _interrupted)
+        {
+            libusb_cancel_transfer(t);
+            cancelled = true;
+        }
+        timeval tv = {0, 100 * 1000};
+        res = libusb_handle_events_timeout_completed(_context, &tv, &transfer.completed);
+        if (res != LIBUSB_SUCCESS && res != LIBUSB_ERROR_INTERRUPTED)
+        {
+            log_error_m << "Failed handle USB events"
+                        << ". Error code: " << res
+                        << ". Detail: " << libusb_error_name(res);
+            if (!cancelled)
+            {
+                libusb_cancel_transfer(t);
+                cancelled = true;
+            }
+        }
+    }
+
+    res = transfer.result;
+    if (res > 0 && (requestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+        memcpy(data, libusb_control_transfer_get_data(t), res);
+
+    releaseTransfer(t);
+    return res;
+}
+
+int LibusbTransport::submit(AsyncTransfer& transfer, uint timeout)
+{
+    libusb_transfer* t = acquireTransfer(sizeof(transfer.data));
+    if (t == nullptr)
+    {
+        transfer.impl = nullptr;
+        transfer.result = LIBUSB_ERROR_NO_MEM;
+        transfer.submitTime = std::chrono::steady_clock::now();
+        transfer.completeTime = transfer.submitTime;
+        transfer.completed = 1;
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    uchar* buff = t->buffer;
+    libusb_fill_control_setup(buff, transfer.requestType, transfer.request,
+                              0, // value
+                              0, // index
+                              transfer.length);
+    memcpy(buff + LIBUSB_CONTROL_SETUP_SIZE, transfer.data, transfer.length);
+
+    libusb_fill_control_transfer(t, _deviceHandle, buff,
+                                 transferCallback, &transfer, timeout);
+
+    transfer.impl = t;
+    transfer.completed = 0;
+    transfer.submitTime = std::chrono::steady_clock::now();
+
+    int res = libusb_submit_transfer(t);
+    if (res != LIBUSB_SUCCESS)
+    {
+        transfer.result = res;
+        transfer.completeTime = transfer.submitTime;
+        transfer.completed = 1;
+    }
+    return res;
+}
+
+static int transferResult(libusb_transfer* t)
+{
+    switch (t->status)
+    {
+        case LIBUSB_TRANSFER_COMPLETED:
+            return t->actual_length;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return LIBUSB_ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_CANCELLED:
+            return LIBUSB_ERROR_INTERRUPTED;
+        case LIBUSB_TRANSFER_STALL:
+            return LIBUSB_ERROR_PIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return LIBUSB_ERROR_NO_DEVICE;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            return LIBUSB_ERROR_OVERFLOW;
+        default:
+            return LIBUSB_ERROR_IO;
+    }
+}
+
+void LIBUSB_CALL LibusbTransport::transferCallback(libusb_transfer* t)
+{
+    AsyncTransfer* transfer = static_cast<AsyncTransfer*>(t->user_data);
+    transfer->completeTime = std::chrono::steady_clock::now();
+    transfer->result = transferResult(t);
+    if (t->status == LIBUSB_TRANSFER_COMPLETED)
+        memcpy(transfer->data, libusb_control_transfer_get_data(t),
+               qMin(t->actual_length, int(sizeof(transfer->data))));
+    transfer->completed = 1;
+}
+
+void LIBUSB_CALL LibusbTransport::syncTransferCallback(libusb_transfer* t)
+{
+    // Данные копируются в буфер вызывающей стороны в controlTransfer()
+    AsyncTransfer* transfer = static_cast<AsyncTransfer*>(t->user_data);
+    transfer->result = transferResult(t);
+    transfer->completed = 1;
+}
+
+void LibusbTransport::handleEvents(AsyncTransfer& transfer, int timeout)
+{
+    timeval tv = {timeout / 1000, (timeout % 1000) * 1000};
+    int res = libusb_handle_events_timeout_completed(_context, &tv, &transfer.completed);
+    if (res != LIBUSB_SUCCESS && res != LIBUSB_ERROR_INTERRUPTED)
+        log_error_m << "Failed handle USB events"
+                    << ". Error code: " << res
+                    << ". Detail: " << libusb_error_name(res);
+}
+
+void LibusbTransport::processEvents()
+{
+    timeval tv = {0, 0};
+    int res = libusb_handle_events_timeout_completed(_context, &tv, nullptr);
+    if (res != LIBUSB_SUCCESS && res != LIBUSB_ERROR_INTERRUPTED)
+        log_error_m << "Failed handle USB events"
+                    << ". Error code: " << res
+                    << ". Detail: " << libusb_error_name(res);
+}
+
+bool LibusbTransport::pollFds(QVector<pollfd>& fds)
+{
+    if (_context == nullptr)
+        return false;
+
+    const libusb_pollfd** list = libusb_get_pollfds(_context);
+    if (list == nullptr)
+        return false;
+
+    for (int i = 0; list[i]; ++i)
+        fds.append({list[i]->fd, list[i]->events, 0});
+
+    libusb_free_pollfds(list);
+    return true;
+}
+
+void LibusbTransport::cancel(AsyncTransfer& transfer)
+{
+    if (transfer.impl && !transfer.completed)
+        libusb_cancel_transfer(static_cast<libusb_transfer*>(transfer.impl));
+}
+
+void LibusbTransport::interrupt()
+{
+    _interrupted = true;
+    if (_context)
+        libusb_interrupt_event_handler(_context);
+}
+
+void LibusbTransport::release(AsyncTransfer& transfer)
+{
+    if (transfer.impl)
+    {
+        releaseTransfer(static_cast<libusb_transfer*>(transfer.impl));
+        transfer.impl = nullptr;
+    }
+}
+
+libusb_transfer* LibusbTransport::acquireTransfer(int length)
+{
+    if (length <= TRANSFER_DATA_SIZE && !_transferBusy.exchange(true))
+    {
+        if (_transfer == nullptr)
+        {
+            _transferBuff = (uchar*)malloc(LIBUSB_CONTROL_SETUP_SIZE + TRANSFER_DATA_SIZE);
+            _transfer = (_transferBuff) ? libusb_alloc_transfer(0) : nullptr;
+            if (_transfer == nullptr)
+            {
+                free(_transferBuff);
+                _transferBuff = nullptr;
+            }
+        }
+        if (_transfer)
+        {
+            _transfer->flags = 0;
+            _transfer->buffer = _transferBuff;
+            return _transfer;
+        }
+        _transferBusy = false;
+    }
+
+    uchar* buff = (uchar*)malloc(LIBUSB_CONTROL_SETUP_SIZE + length);
+    libusb_transfer* t = (buff) ? libusb_alloc_transfer(0) : nullptr;
+    if (t == nullptr)
+    {
+        free(buff);
+        return nullptr;
+    }
+    t->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    t->buffer = buff;
+    return t;
+}
+
+void LibusbTransport::releaseTransfer(libusb_transfer* t)
+{
+    if (t == _transfer)
+        _transferBusy = false;
+    else
+        libusb_free_transfer(t);
+}
+
+void LibusbTransport::freeTransfer()
+{
+    if (_transfer)
+    {
+        libusb_free_transfer(_transfer);
+        _transfer = nullptr;
+    }
+    free(_transferBuff);
+    _transferBuff = nullptr;
+    _transferBusy = false;
+}
+
+} // namespace usb
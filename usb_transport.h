@@ -0,0 +1,219 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#pragma once
+
+#include "shared/defmac.h"
+
+#include <QtCore>
+#include <atomic>
+#include <chrono>
+#include <libusb-1.0/libusb.h>
+#include <poll.h>
+
+namespace usb {
+
+// Описание USB-устройства, полученное при перечислении устройств
+struct DeviceInfo
+{
+    int     index = {-1};       // Индекс устройства в списке перечисления
+    int     busNumber = {0};
+    int     deviceNumber = {0};
+    quint16 vendorId = {0};
+    quint16 productId = {0};
+    quint8  iManufacturer = {0};
+    quint8  iProduct = {0};
+};
+
+/**
+  Транспортный уровень обмена с USB-устройством. Все обращения  Relay  к  USB
+  выполняются через этот интерфейс, что позволяет записывать  обмен  и  воспро-
+  изводить его без физического устройства. Экземпляр транспорта обслуживает не
+  более одного открытого устройства. Функции возвращают коды ошибок libusb
+*/
+class Transport
+{
+public:
+    virtual ~Transport() = default;
+
+    virtual int  init() = 0;
+    virtual void deinit() = 0;
+
+    // Возвращает TRUE если отключение устройства может отслеживаться
+    // через HotplugMonitor
+    virtual bool hotplugCapable() const {return false;}
+
+    // Перечисление устройств. Список остается действительным до вызова
+    // freeDeviceList() или следующего вызова deviceList()
+    virtual int  deviceList(QVector<DeviceInfo>&) = 0;
+    virtual void freeDeviceList() = 0;
+
+    // Создает вспомогательный транспорт для параллельного опроса устройств из
+    // текущего списка перечисления.  Вспомогательный транспорт использует
+    // контекст и список устройств исходного и действителен до вызова  free-
+    // DeviceList() исходного транспорта. Возвращает nullptr если параллель-
+    // ный опрос не поддерживается
+    virtual Transport* createProbe() {return nullptr;}
+
+    // Принимает устройство, открытое вспомогательным транспортом probe (см.
+    // createProbe()), без повторного открытия. После вызова probe не  имеет
+    // открытого устройства. Возвращает FALSE если передача не поддерживается
+    virtual bool takeDevice(Transport* /*probe*/) {return false;}
+
+    virtual int  open(const DeviceInfo&) = 0;
+    virtual void close() = 0;
+    virtual bool isOpen() const = 0;
+
+    // Возвращает длину строки или код ошибки. Строка в buff завершается нулем
+    virtual int stringDescriptor(quint8 index, char* buff, int buffSize) = 0;
+
+    virtual int checkActiveConfig() = 0;
+    virtual int setAutoDetachKernelDriver(bool) = 0;
+    virtual int claimInterface(int number) = 0;
+    virtual int releaseInterface(int number) = 0;
+
+    // Возвращает количество переданных байт или код ошибки
+    virtual int controlTransfer(quint8 requestType, quint8 request,
+                                quint16 value, quint16 index,
+                                uchar* data, quint16 length, uint timeout) = 0;
+
+    // Асинхронный control transfer. Размер данных не превышает 8 байт
+    struct AsyncTransfer
+    {
+        typedef std::chrono::steady_clock::time_point TimePoint;
+
+        quint8 requestType = {0};
+        quint8 request = {0};
+        quint8 length = {0};
+        uchar  data[8] = {0};
+
+        int result = {0};    // Количество переданных байт или код ошибки
+        int completed = {0};
+
+        TimePoint submitTime;
+        TimePoint completeTime;
+
+        void* impl = {nullptr};
+    };
+
+    // Отправляет запрос, результат фиксируется в полях result/completed
+    // в процессе обработки событий handleEvents()
+    virtual int  submit(AsyncTransfer&, uint timeout) = 0;
+    virtual void handleEvents(AsyncTransfer&, int timeout) = 0;
+    virtual void cancel(AsyncTransfer&) = 0;
+    virtual void release(AsyncTransfer&) = 0;
+
+    // Обрабатывает без ожидания события всех отправленных запросов. Исполь-
+    // зуется общим циклом событий нескольких транспортов (см. RelayReactor),
+    // ожидание событий выполняется по дескрипторам из pollFds()
+    virtual void processEvents() {}
+
+    // Добавляет в fds дескрипторы, по готовности которых следует вызывать
+    // processEvents(). Возвращает FALSE если транспорт не использует дескрип-
+    // торы: его запросы завершаются при вызове processEvents() без ожидания
+    virtual bool pollFds(QVector<pollfd>& /*fds*/) {return false;}
+
+    // Прерывает выполняющийся и последующие обмены с устройством, они завер-
+    // шаются с кодом LIBUSB_ERROR_INTERRUPTED. Действует до следующего вызова
+    // open(). Может вызываться из любого потока
+    virtual void interrupt() {}
+};
+
+/**
+  Транспорт на основе libusb
+*/
+class LibusbTransport : public Transport
+{
+public:
+    LibusbTransport() = default;
+    ~LibusbTransport();
+
+    int  init() override;
+    void deinit() override;
+    bool hotplugCapable() const override;
+
+    int  deviceList(QVector<DeviceInfo>&) override;
+    void freeDeviceList() override;
+    Transport* createProbe() override;
+    bool takeDevice(Transport*) override;
+
+    int  open(const DeviceInfo&) override;
+    void close() override;
+    bool isOpen() const override {return (_deviceHandle != nullptr);}
+
+    int stringDescriptor(quint8 index, char* buff, int buffSize) override;
+
+    int checkActiveConfig() override;
+    int setAutoDetachKernelDriver(bool) override;
+    int claimInterface(int number) override;
+    int releaseInterface(int number) override;
+
+    int controlTransfer(quint8 requestType, quint8 request,
+                        quint16 value, quint16 index,
+                        uchar* data, quint16 length, uint timeout) override;
+
+    int  submit(AsyncTransfer&, uint timeout) override;
+    void handleEvents(AsyncTransfer&, int timeout) override;
+    void cancel(AsyncTransfer&) override;
+    void release(AsyncTransfer&) override;
+    void processEvents() override;
+    bool pollFds(QVector<pollfd>&) override;
+    void interrupt() override;
+
+    libusb_context* context() const {return _context;}
+
+private:
+    DISABLE_DEFAULT_COPY(LibusbTransport)
+    static void LIBUSB_CALL transferCallback(libusb_transfer*);
+    static void LIBUSB_CALL syncTransferCallback(libusb_transfer*);
+
+    // Возвращает запрос с буфером для length байт данных. Используется заранее
+    // выделенный запрос транспорта, если он свободен; иначе запрос выделяется
+    // и освобождается в releaseTransfer()
+    libusb_transfer* acquireTransfer(int length);
+    void releaseTransfer(libusb_transfer*);
+    void freeTransfer();
+
+private:
+    libusb_context*       _context = {nullptr};
+    libusb_device_handle* _deviceHandle = {nullptr};
+    libusb_device**       _devList = {nullptr};
+
+    // Для транспорта, созданного через createProbe(): контекст и список
+    // устройств принадлежат исходному транспорту
+    bool _shared = {false};
+
+    std::atomic_bool _interrupted = {false};
+
+    // Запрос, выделяемый однократно при первом обращении к устройству и ис-
+    // пользуемый повторно, чтобы обмен с платой не требовал выделения памяти.
+    // Признак занятости атомарный: запрос захватывается через exchange(), что
+    // исключает его повторную выдачу при обращении из разных потоков
+    libusb_transfer* _transfer = {nullptr};
+    uchar*           _transferBuff = {nullptr};
+    std::atomic_bool _transferBusy = {false};
+};
+
+} // namespace usb
@@ -0,0 +1,497 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#include "usb_transport_replay.h"
+
+#include "shared/logger/logger.h"
+#include "shared/logger/format.h"
+#include "shared/qt/logger_operators.h"
+
+#include <string.h>
+#include <thread>
+
+#define log_error_m   alog::logger().error   (alog_line_location, "UsbReplay")
+#define log_warn_m    alog::logger().warn    (alog_line_location, "UsbReplay")
+#define log_info_m    alog::logger().info    (alog_line_location, "UsbReplay")
+#define log_verbose_m alog::logger().verbose (alog_line_location, "UsbReplay")
+#define log_debug_m   alog::logger().debug   (alog_line_location, "UsbReplay")
+#define log_debug2_m  alog::logger().debug2  (alog_line_location, "UsbReplay")
+
+namespace usb {
+
+using namespace std::chrono;
+using replay::Op;
+using replay::RecordHeader;
+using replay::DeviceRecord;
+
+static const char fileSignature[] = "URLYREC1";
+static const int  fileSignatureLen = 8;
+
+static quint64 elapsed(steady_clock::time_point start)
+{
+    return quint64(duration_cast<microseconds>(steady_clock::now() - start).count());
+}
+
+//------------------------------- RecordTransport ----------------------------
+
+RecordTransport::RecordTransport(Transport* transport, const QString& fileName)
+    : _transport(transport), _file(fileName)
+{
+    if (!_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        log_error_m << "Failed open file " << fileName
+                    << ". Detail: " << _file.errorString();
+        return;
+    }
+    _file.write(fileSignature, fileSignatureLen);
+    _recording = true;
+}
+
+RecordTransport::~RecordTransport()
+{
+    if (_recording)
+        _file.close();
+}
+
+void RecordTransport::write(Op op, quint8 requestType, quint8 request, quint8 arg,
+                            int result, quint64 duration,
+                            const void* payload, int payloadSize)
+{
+    if (!_recording)
+        return;
+
+    RecordHeader header;
+    header.op = quint8(op);
+    header.requestType = requestType;
+    header.request = request;
+    header.arg = arg;
+    header.result = result;
+    header.duration = quint32(qMin(duration, quint64(UINT32_MAX)));
+    header.payloadSize = quint16(qMax(payloadSize, 0));
+
+    QMutexLocker locker {&_fileLock}; (void) locker;
+    _file.write((const char*)&header, sizeof(header));
+    if (header.payloadSize)
+        _file.write((const char*)payload, header.payloadSize);
+}
+
+int RecordTransport::init()
+{
+    steady_clock::time_point start = steady_clock::now();
+    int res = _transport->init();
+    write(Op::Init, 0, 0, 0, res, elapsed(start), nullptr, 0);
+    return res;
+}
+
+void RecordTransport::deinit()
+{
+    _transport->deinit();
+    QMutexLocker locker {&_fileLock}; (void) locker;
+    _file.flush();
+}
+
+int RecordTransport::deviceList(QVector<DeviceInfo>& devices)
+{
+    steady_clock::time_point start = steady_clock::now();
+    int res = _transport->deviceList(devices);
+    quint64 duration = elapsed(start);
+
+    QVector<DeviceRecord> records;
+    records.reserve(devices.count());
+    for (const DeviceInfo& info : devices)
+    {
+        DeviceRecord rec;
+        rec.index = qint16(info.index);
+        rec.busNumber = quint8(info.busNumber);
+        rec.deviceNumber = quint8(info.deviceNumber);
+        rec.vendorId = info.vendorId;
+        rec.productId = info.productId;
+        rec.iManufacturer = info.iManufacturer;
+        rec.iProduct = info.iProduct;
+        records.append(rec);
+    }
+    write(Op::DeviceList, 0, 0, 0, res, duration,
+          records.constData(), records.count() * int(sizeof(DeviceRecord)));
+    return res;
+}
+
+void RecordTransport::freeDeviceList()
+{
+    _transport->freeDeviceList();
+}
+
+int RecordTransport::open(const DeviceInfo& info)
+{
+    steady_clock::time_point start = steady_clock::now();
+    int res = _transport->open(info);
+    write(Op::Open, 0, 0, quint8(info.index), res, elapsed(start), nullptr, 0);
+    return res;
+}
+
+void RecordTransport::close()
+{
+    _transport->close();
+}
+
+bool RecordTransport::isOpen() const
+{
+    return _transport->isOpen();
+}
+
+int RecordTransport::stringDescriptor(quint8 index, char* buff, int buffSize)
+{
+    steady_clock::time_point start = steady_clock::now();
+    int res = _transport->stringDescriptor(index, buff, buffSize);
+    write(Op::StringDescriptor, 0, 0, index, res, elapsed(start),
+          buff, (res > 0) ? qMin(res + 1, buffSize) : 0);
+    return res;
+}
+
+int RecordTransport::checkActiveConfig()
+{
+    steady_clock::time_point start = steady_clock::now();
+    int res = _transport->checkActiveConfig();
+    write(Op::CheckActiveConfig, 0, 0, 0, res, elapsed(start), nullptr, 0);
+    return res;
+}
+
+int RecordTransport::setAutoDetachKernelDriver(bool val)
+{
+    steady_clock::time_point start = steady_clock::now();
+    int res = _transport->setAutoDetachKernelDriver(val);
+    write(Op::SetAutoDetach, 0, 0, quint8(val), res, elapsed(start), nullptr, 0);
+    return res;
+}
+
+int RecordTransport::claimInterface(int number)
+{
+    steady_clock::time_point start = steady_clock::now();
+    int res = _transport->claimInterface(number);
+    write(Op::ClaimInterface, 0, 0, quint8(number), res, elapsed(start), nullptr, 0);
+    return res;
+}
+
+int RecordTransport::releaseInterface(int number)
+{
+    steady_clock::time_point start = steady_clock::now();
+    int res = _transport->releaseInterface(number);
+    write(Op::ReleaseInterface, 0, 0, quint8(number), res, elapsed(start), nullptr, 0);
+    return res;
+}
+
+int RecordTransport::controlTransfer(quint8 requestType, quint8 request,
+                                     quint16 value, quint16 index,
+                                     uchar* data, quint16 length, uint timeout)
+{
+    steady_clock::time_point start = steady_clock::now();
+    int res = _transport->controlTransfer(requestType, request, value, index,
+                                          data, length, timeout);
+    quint64 duration = elapsed(start);
+
+    // Для запросов IN записываются полученные данные, для запросов OUT -
+    // отправленные
+    int payloadSize = length;
+    if (requestType & LIBUSB_ENDPOINT_IN)
+        payloadSize = qMax(res, 0);
+
+    write(Op::ControlTransfer, requestType, request, 0, res, duration, data, payloadSize);
+    return res;
+}
+
+int RecordTransport::submit(AsyncTransfer& transfer, uint timeout)
+{
+    return _transport->submit(transfer, timeout);
+}
+
+void RecordTransport::handleEvents(AsyncTransfer& transfer, int timeout)
+{
+    _transport->handleEvents(transfer, timeout);
+}
+
+void RecordTransport::cancel(AsyncTransfer& transfer)
+{
+    _transport->cancel(transfer);
+}
+
+void RecordTransport::release(AsyncTransfer& transfer)
+{
+    // Асинхронный запрос записывается при освобождении, когда известны
+    // результат и время завершения
+    quint64 duration = quint64(duration_cast<microseconds>(
+                           transfer.completeTime - transfer.submitTime).count());
+    write(Op::AsyncTransfer, transfer.requestType, transfer.request, 0,
+          transfer.result, duration, transfer.data, transfer.length);
+
+    _transport->release(transfer);
+}
+
+//------------------------------- ReplayTransport ----------------------------
+
+ReplayTransport::ReplayTransport(const QString& fileName, double speed)
+    : _speed(speed)
+{
+    QFile file {fileName};
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        log_error_m << "Failed open file " << fileName
+                    << ". Detail: " << file.errorString();
+        return;
+    }
+    _data = file.readAll();
+
+    if (_data.length() < fileSignatureLen
+        || memcmp(_data.constData(), fileSignature, fileSignatureLen) != 0)
+    {
+        log_error_m << "Bad file signature: " << fileName;
+        return;
+    }
+
+    int offset = fileSignatureLen;
+    while (offset + int(sizeof(RecordHeader)) <= _data.length())
+    {
+        RecordHeader header;
+        memcpy(&header, _data.constData() + offset, sizeof(header));
+        if (offset + int(sizeof(header)) + header.payloadSize > _data.length())
+        {
+            log_warn_m << "Record file truncated: " << fileName;
+            break;
+        }
+        _offsets.append(offset);
+        offset += int(sizeof(header)) + header.payloadSize;
+    }
+    _loaded = true;
+
+    log_verbose_m << log_format("Loaded %? records from %?", _offsets.count(), fileName);
+}
+
+// Записи опроса состояний (чтение GET_REPORT). Время опроса в run()  зависит
+// от планирования потоков, поэтому такие записи могут пропускаться без учета
+// как расхождение
+static bool isPollRecord(const RecordHeader* header)
+{
+    return (header->op == quint8(Op::ControlTransfer)
+            || header->op == quint8(Op::AsyncTransfer))
+           && (header->requestType & LIBUSB_ENDPOINT_IN);
+}
+
+const RecordHeader* ReplayTransport::take(Op op, quint8 requestType,
+                                          quint8 request, quint8 arg,
+                                          int* index)
+{
+    const RecordHeader* header;
+    { //Block for QMutexLocker
+        QMutexLocker locker {&_lock}; (void) locker;
+        if (_position >= _offsets.count())
+        {
+            ++_mismatches;
+            log_error_m << "Replay records exhausted";
+            return nullptr;
+        }
+
+        auto match = [&](const RecordHeader* h)
+        {
+            return h->op == quint8(op)
+                   && h->requestType == requestType
+                   && h->request == request
+                   && h->arg == arg;
+        };
+
+        // При расхождении выполняется поиск ближайшей подходящей записи,
+        // чтобы одно расхождение не нарушало воспроизведение всех последу-
+        // ющих записей. Пропущенные записи, кроме записей опроса, учитываются
+        // как расхождение
+        int position = _position;
+        int skipped = 0;
+        const int last = qMin(_offsets.count(), _position + ReplayResyncWindow);
+        for (; position < last; ++position)
+        {
+            header = reinterpret_cast<const RecordHeader*>(
+                         _data.constData() + _offsets[position]);
+            if (match(header))
+                break;
+            if (!isPollRecord(header))
+                ++skipped;
+        }
+        if (position >= last)
+        {
+            header = reinterpret_cast<const RecordHeader*>(
+                         _data.constData() + _offsets[_position]);
+            ++_mismatches;
+            log_error_m << log_format(
+                "Replay mismatch at record %?. Expected op %?, recorded op %?",
+                int(_position), int(op), int(header->op));
+            return nullptr;
+        }
+        if (skipped)
+        {
+            _mismatches += skipped;
+            log_warn_m << log_format(
+                "Replay resynchronized at record %?. Skipped %? record(s)",
+                position, position - _position);
+        }
+        _position = position + 1;
+        if (index)
+            *index = position;
+    }
+
+    if (_speed > 0 && header->duration)
+        std::this_thread::sleep_for(microseconds(qint64(header->duration / _speed)));
+
+    return header;
+}
+
+const char* ReplayTransport::payload(const RecordHeader* header) const
+{
+    return reinterpret_cast<const char*>(header) + sizeof(RecordHeader);
+}
+
+int ReplayTransport::init()
+{
+    if (!_loaded)
+        return LIBUSB_ERROR_OTHER;
+
+    const RecordHeader* header = take(Op::Init);
+    return (header) ? header->result : LIBUSB_ERROR_OTHER;
+}
+
+int ReplayTransport::deviceList(QVector<DeviceInfo>& devices)
+{
+    devices.clear();
+    const RecordHeader* header = take(Op::DeviceList);
+    if (header == nullptr)
+        return LIBUSB_ERROR_OTHER;
+
+    int count = header->payloadSize / int(sizeof(DeviceRecord));
+    devices.reserve(count);
+    for (int i = 0; i < count; ++i)
+    {
+        DeviceRecord rec;
+        memcpy(&rec, payload(header) + i * sizeof(DeviceRecord), sizeof(rec));
+
+        DeviceInfo info;
+        info.index = rec.index;
+        info.busNumber = rec.busNumber;
+        info.deviceNumber = rec.deviceNumber;
+        info.vendorId = rec.vendorId;
+        info.productId = rec.productId;
+        info.iManufacturer = rec.iManufacturer;
+        info.iProduct = rec.iProduct;
+        devices.append(info);
+    }
+    return header->result;
+}
+
+int ReplayTransport::open(const DeviceInfo& info)
+{
+    const RecordHeader* header = take(Op::Open, 0, 0, quint8(info.index));
+    if (header == nullptr)
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    _open = (header->result == LIBUSB_SUCCESS);
+    return header->result;
+}
+
+int ReplayTransport::stringDescriptor(quint8 index, char* buff, int buffSize)
+{
+    const RecordHeader* header = take(Op::StringDescriptor, 0, 0, index);
+    if (header == nullptr)
+        return LIBUSB_ERROR_IO;
+
+    if (buffSize > 0)
+    {
+        int len = qMin(int(header->payloadSize), buffSize);
+        memcpy(buff, payload(header), len);
+        buff[qMin(len, buffSize - 1)] = '\0';
+    }
+    return header->result;
+}
+
+int ReplayTransport::checkActiveConfig()
+{
+    const RecordHeader* header = take(Op::CheckActiveConfig);
+    return (header) ? header->result : LIBUSB_ERROR_IO;
+}
+
+int ReplayTransport::setAutoDetachKernelDriver(bool val)
+{
+    const RecordHeader* header = take(Op::SetAutoDetach, 0, 0, quint8(val));
+    return (header) ? header->result : LIBUSB_ERROR_IO;
+}
+
+int ReplayTransport::claimInterface(int number)
+{
+    const RecordHeader* header = take(Op::ClaimInterface, 0, 0, quint8(number));
+    return (header) ? header->result : LIBUSB_ERROR_IO;
+}
+
+int ReplayTransport::releaseInterface(int number)
+{
+    const RecordHeader* header = take(Op::ReleaseInterface, 0, 0, quint8(number));
+    return (header) ? header->result : LIBUSB_ERROR_IO;
+}
+
+int ReplayTransport::controlTransfer(quint8 requestType, quint8 request,
+                                     quint16 /*value*/, quint16 /*index*/,
+                                     uchar* data, quint16 length, uint /*timeout*/)
+{
+    int index;
+    const RecordHeader* header =
+        take(Op::ControlTransfer, requestType, request, 0, &index);
+    if (header == nullptr)
+        return LIBUSB_ERROR_IO;
+
+    if (requestType & LIBUSB_ENDPOINT_IN)
+    {
+        memcpy(data, payload(header), qMin(int(header->payloadSize), int(length)));
+    }
+    else if (header->payloadSize != length
+             || memcmp(data, payload(header), length) != 0)
+    {
+        ++_mismatches;
+        log_warn_m << log_format(
+            "Replay data mismatch at record %?. Command differs from recorded",
+            index);
+    }
+    return header->result;
+}
+
+int ReplayTransport::submit(AsyncTransfer& transfer, uint /*timeout*/)
+{
+    transfer.submitTime = steady_clock::now();
+
+    const RecordHeader* header =
+        take(Op::AsyncTransfer, transfer.requestType, transfer.request);
+
+    transfer.result = (header) ? header->result : LIBUSB_ERROR_IO;
+    if (header && (transfer.requestType & LIBUSB_ENDPOINT_IN))
+        memcpy(transfer.data, payload(header),
+               qMin(int(header->payloadSize), int(sizeof(transfer.data))));
+
+    transfer.completeTime = steady_clock::now();
+    transfer.completed = 1;
+    return LIBUSB_SUCCESS;
+}
+
+} // namespace usb
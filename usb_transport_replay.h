@@ -0,0 +1,211 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#pragma once
+
+#include "usb_transport.h"
+
+#include <QtCore>
+#include <atomic>
+#include <memory>
+
+/**
+  Запись и воспроизведение обмена с USB-устройством.
+
+  RecordTransport передает все вызовы нижележащему транспорту и записывает их
+  (направление, запрос, данные, результат, длительность) в компактный двоичный
+  файл. ReplayTransport воспроизводит записанный файл: вызовы Relay получают
+  записанные результаты в исходном порядке с исходной или ускоренной скоростью.
+  Используется для воспроизведения проблем, зафиксированных на объекте, а также
+  для регрессионных проверок и замеров производительности без устройства.
+
+  Формат файла: сигнатура "URLYREC1", далее последовательность записей, каждая
+  запись - заголовок RecordHeader и данные размером payloadSize байт
+*/
+namespace usb {
+namespace replay {
+
+enum class Op : quint8
+{
+    Init              = 1,
+    DeviceList        = 2,
+    Open              = 3,
+    StringDescriptor  = 4,
+    CheckActiveConfig = 5,
+    SetAutoDetach     = 6,
+    ClaimInterface    = 7,
+    ReleaseInterface  = 8,
+    ControlTransfer   = 9,
+    AsyncTransfer     = 10
+};
+
+#pragma pack(push, 1)
+struct RecordHeader
+{
+    quint8  op;
+    quint8  requestType;
+    quint8  request;
+    quint8  arg;         // Индекс дескриптора, номер интерфейса, индекс устройства
+    qint32  result;
+    quint32 duration;    // Длительность вызова (в микросекундах)
+    quint16 payloadSize;
+};
+
+struct DeviceRecord
+{
+    qint16  index;
+    quint8  busNumber;
+    quint8  deviceNumber;
+    quint16 vendorId;
+    quint16 productId;
+    quint8  iManufacturer;
+    quint8  iProduct;
+};
+#pragma pack(pop)
+
+} // namespace replay
+
+class RecordTransport : public Transport
+{
+public:
+    // Транспорт transport переходит во владение RecordTransport
+    RecordTransport(Transport* transport, const QString& fileName);
+    ~RecordTransport();
+
+    bool isRecording() const {return _recording;}
+
+    int  init() override;
+    void deinit() override;
+    bool hotplugCapable() const override {return _transport->hotplugCapable();}
+
+    int  deviceList(QVector<DeviceInfo>&) override;
+    void freeDeviceList() override;
+
+    int  open(const DeviceInfo&) override;
+    void close() override;
+    bool isOpen() const override;
+
+    int stringDescriptor(quint8 index, char* buff, int buffSize) override;
+
+    int checkActiveConfig() override;
+    int setAutoDetachKernelDriver(bool) override;
+    int claimInterface(int number) override;
+    int releaseInterface(int number) override;
+
+    int controlTransfer(quint8 requestType, quint8 request,
+                        quint16 value, quint16 index,
+                        uchar* data, quint16 length, uint timeout) override;
+
+    int  submit(AsyncTransfer&, uint timeout) override;
+    void handleEvents(AsyncTransfer&, int timeout) override;
+    void cancel(AsyncTransfer&) override;
+    void release(AsyncTransfer&) override;
+    void processEvents() override {_transport->processEvents();}
+    bool pollFds(QVector<pollfd>& fds) override {return _transport->pollFds(fds);}
+    void interrupt() override {_transport->interrupt();}
+
+private:
+    DISABLE_DEFAULT_COPY(RecordTransport)
+
+    void write(replay::Op, quint8 requestType, quint8 request, quint8 arg,
+               int result, quint64 duration, const void* payload, int payloadSize);
+
+private:
+    std::unique_ptr<Transport> _transport;
+    QFile _file;
+    QMutex _fileLock;
+    bool _recording = {false};
+};
+
+class ReplayTransport : public Transport
+{
+public:
+    // Параметр speed задает коэффициент ускорения воспроизведения: 1.0 - исход-
+    // ная скорость, 0 - воспроизведение без задержек
+    ReplayTransport(const QString& fileName, double speed = 1.0);
+
+    bool isLoaded() const {return _loaded;}
+
+    // Количество записей в файле и номер следующей воспроизводимой записи
+    int count() const {return _offsets.count();}
+    int position() const {return _position;}
+    bool atEnd() const {return _position >= _offsets.count();}
+
+    // Количество расхождений между записью и фактическими вызовами
+    int mismatches() const {return _mismatches;}
+
+    int  init() override;
+    void deinit() override {}
+
+    int  deviceList(QVector<DeviceInfo>&) override;
+    void freeDeviceList() override {}
+
+    int  open(const DeviceInfo&) override;
+    void close() override {_open = false;}
+    bool isOpen() const override {return _open;}
+
+    int stringDescriptor(quint8 index, char* buff, int buffSize) override;
+
+    int checkActiveConfig() override;
+    int setAutoDetachKernelDriver(bool) override;
+    int claimInterface(int number) override;
+    int releaseInterface(int number) override;
+
+    int controlTransfer(quint8 requestType, quint8 request,
+                        quint16 value, quint16 index,
+                        uchar* data, quint16 length, uint timeout) override;
+
+    int  submit(AsyncTransfer&, uint timeout) override;
+    void handleEvents(AsyncTransfer&, int timeout) override {}
+    void cancel(AsyncTransfer&) override {}
+    void release(AsyncTransfer&) override {}
+
+private:
+    DISABLE_DEFAULT_COPY(ReplayTransport)
+
+    // Количество записей, просматриваемых при поиске подходящей записи после
+    // расхождения
+    static const int ReplayResyncWindow = 256;
+
+    // Извлекает следующую подходящую запись (см. ReplayResyncWindow). Возвра-
+    // щает nullptr если записи закончились или подходящая запись не найдена.
+    // В параметр index записывается номер извлеченной записи
+    const replay::RecordHeader* take(replay::Op, quint8 requestType = 0,
+                                     quint8 request = 0, quint8 arg = 0,
+                                     int* index = nullptr);
+    const char* payload(const replay::RecordHeader*) const;
+
+private:
+    QByteArray _data;
+    QVector<int> _offsets;
+    std::atomic_int _position = {0};
+    std::atomic_int _mismatches = {0};
+    double _speed = {1.0};
+    bool _loaded = {false};
+    bool _open = {false};
+    QMutex _lock;
+};
+
+} // namespace usb
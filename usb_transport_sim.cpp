@@ -0,0 +1,431 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#include "usb_transport_sim.h"
+
+#include <chrono>
+#include <string.h>
+#include <unistd.h>
+
+#define USB_RELAY_VENDOR_ID      0x16c0
+#define USB_RELAY_DEVICE_ID      0x05df
+
+#define USBRQ_HID_GET_REPORT     0x01
+#define USBRQ_HID_SET_REPORT     0x09
+
+namespace usb {
+
+// Индексы строковых дескрипторов имитируемой платы реле
+static const quint8 manufacturerIndex = 1;
+static const quint8 productIndex = 2;
+
+void SimBus::addDevice(quint16 vendorId, quint16 productId)
+{
+    QMutexLocker locker {&_lock}; (void) locker;
+
+    Device device;
+    device.info.index = _devices.count();
+    device.info.busNumber = 1 + _devices.count() / 127;
+    device.info.deviceNumber = 1 + _devices.count() % 127;
+    device.info.vendorId = vendorId;
+    device.info.productId = productId;
+    _devices.append(device);
+}
+
+void SimBus::addRelayBoard(const QString& serial, int relayCount)
+{
+    addDevice(USB_RELAY_VENDOR_ID, USB_RELAY_DEVICE_ID);
+
+    QMutexLocker locker {&_lock}; (void) locker;
+
+    Device& device = _devices.last();
+    device.info.iManufacturer = manufacturerIndex;
+    device.info.iProduct = productIndex;
+    device.relay = true;
+    device.relayCount = relayCount;
+
+    QByteArray val = serial.toLatin1();
+    for (int i = 0; i < 5; ++i)
+        device.serial[i] = (i < val.length()) ? val[i] : '0';
+}
+
+int SimBus::count() const
+{
+    QMutexLocker locker {&_lock}; (void) locker;
+    return _devices.count();
+}
+
+SimBus::Stats SimBus::stats() const
+{
+    Stats stats;
+    stats.deviceLists = _deviceLists;
+    stats.opens = _opens;
+    stats.stringDescriptors = _stringDescriptors;
+    stats.controlTransfers = _controlTransfers;
+    stats.claims = _claims;
+    return stats;
+}
+
+void SimBus::resetStats()
+{
+    _deviceLists = 0;
+    _opens = 0;
+    _stringDescriptors = 0;
+    _controlTransfers = 0;
+    _claims = 0;
+}
+
+static quint64 stateLogTime()
+{
+    using namespace std::chrono;
+    return quint64(duration_cast<nanoseconds>(
+                   steady_clock::now().time_since_epoch()).count());
+}
+
+void SimBus::setStateLog(bool enabled)
+{
+    QMutexLocker locker {&_lock}; (void) locker;
+
+    _stateLogEnabled = enabled;
+    _stateLog.clear();
+    if (!enabled)
+        return;
+
+    const quint64 time = stateLogTime();
+    for (const Device& device : _devices)
+        if (device.relay)
+            _stateLog.append({device.info.index, time, device.states});
+}
+
+QVector<SimBus::StateRecord> SimBus::stateLog() const
+{
+    QMutexLocker locker {&_lock}; (void) locker;
+    return _stateLog;
+}
+
+void SimBus::delay() const
+{
+    if (int usec = _transferDelay)
+        usleep(usec);
+}
+
+int SimBus::open(int index)
+{
+    ++_opens;
+    delay();
+
+    QMutexLocker locker {&_lock}; (void) locker;
+    if (index < 0 || index >= _devices.count())
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    // Посторонние устройства, как правило, недоступны без прав root
+    if (!_devices[index].relay)
+        return LIBUSB_ERROR_ACCESS;
+
+    return LIBUSB_SUCCESS;
+}
+
+void SimBus::close(int /*index*/)
+{}
+
+int SimBus::stringDescriptor(int index, quint8 descIndex, char* buff, int buffSize)
+{
+    ++_stringDescriptors;
+    delay();
+
+    QMutexLocker locker {&_lock}; (void) locker;
+    const Device& device = _devices[index];
+
+    QByteArray str;
+    if (descIndex == manufacturerIndex)
+        str = "www.dcttech.com";
+    else if (descIndex == productIndex)
+        str = "USBRelay" + QByteArray::number(device.relayCount);
+    else
+        return LIBUSB_ERROR_INVALID_PARAM;
+
+    int len = qMin(str.length(), buffSize - 1);
+    memcpy(buff, str.constData(), len);
+    buff[len] = '\0';
+    return len;
+}
+
+int SimBus::claimInterface(int index)
+{
+    ++_claims;
+
+    QMutexLocker locker {&_lock}; (void) locker;
+    Device& device = _devices[index];
+    if (device.claimed)
+        return LIBUSB_ERROR_BUSY;
+
+    device.claimed = true;
+    return LIBUSB_SUCCESS;
+}
+
+int SimBus::releaseInterface(int index)
+{
+    QMutexLocker locker {&_lock}; (void) locker;
+    _devices[index].claimed = false;
+    return LIBUSB_SUCCESS;
+}
+
+int SimBus::controlTransfer(int index, quint8 requestType, quint8 request,
+                            uchar* data, quint16 length)
+{
+    ++_controlTransfers;
+    delay();
+
+    if (length < 8)
+        return LIBUSB_ERROR_INVALID_PARAM;
+
+    QMutexLocker locker {&_lock}; (void) locker;
+    Device& device = _devices[index];
+    const quint8 allMask = quint8((1U << device.relayCount) - 1);
+
+    if ((requestType & LIBUSB_ENDPOINT_IN) && request == USBRQ_HID_GET_REPORT)
+    {
+        memset(data, 0, length);
+        memcpy(data, device.serial, 5);
+        data[7] = device.states;
+        return 8;
+    }
+    if (!(requestType & LIBUSB_ENDPOINT_IN) && request == USBRQ_HID_SET_REPORT)
+    {
+        const quint8 relayNumber = data[1];
+        const quint8 prevStates = device.states;
+        switch (data[0])
+        {
+            case 0xFF: // Включить реле по номеру
+            case 0xFD: // Выключить реле по номеру
+                if (relayNumber < 1 || relayNumber > device.relayCount)
+                    break;
+                if (data[0] == 0xFF)
+                    device.states |= quint8(1U << (relayNumber - 1));
+                else
+                    device.states &= ~quint8(1U << (relayNumber - 1));
+                break;
+
+            case 0xFE: // Включить все реле
+                device.states = allMask;
+                break;
+
+            case 0xFC: // Выключить все реле
+                device.states = 0;
+                break;
+
+            case 0xFA: // Установить серийный номер
+                memcpy(device.serial, data + 1, 5);
+                break;
+        }
+        if (_stateLogEnabled && device.states != prevStates)
+            _stateLog.append({index, stateLogTime(), device.states});
+        return 8;
+    }
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+SimTransport::SimTransport(std::shared_ptr<SimBus> bus) : _bus(bus)
+{}
+
+SimTransport::~SimTransport()
+{
+    close();
+}
+
+int SimTransport::deviceList(QVector<DeviceInfo>& devices)
+{
+    ++_bus->_deviceLists;
+
+    QMutexLocker locker {&_bus->_lock}; (void) locker;
+    devices.clear();
+    devices.reserve(_bus->_devices.count());
+    for (const SimBus::Device& device : _bus->_devices)
+        devices.append(device.info);
+
+    return devices.count();
+}
+
+bool SimTransport::takeDevice(Transport* transport)
+{
+    SimTransport* probe = dynamic_cast<SimTransport*>(transport);
+    if (probe == nullptr || probe->_bus != _bus)
+        return false;
+
+    close();
+    _deviceIndex = probe->_deviceIndex;
+    _claimed = probe->_claimed;
+    probe->_deviceIndex = -1;
+    probe->_claimed = false;
+    return true;
+}
+
+int SimTransport::open(const DeviceInfo& device)
+{
+    close();
+    int res = _bus->open(device.index);
+    if (res == LIBUSB_SUCCESS)
+        _deviceIndex = device.index;
+    return res;
+}
+
+void SimTransport::close()
+{
+    if (_deviceIndex < 0)
+        return;
+
+    if (_claimed)
+        releaseInterface(0);
+
+    // Неисполненные запросы завершаются так же, как при отключении устройства
+    for (AsyncTransfer* t : _pending)
+    {
+        t->result = LIBUSB_ERROR_NO_DEVICE;
+        t->completeTime = AsyncTransfer::TimePoint::clock::now();
+        t->completed = 1;
+    }
+    _pending.clear();
+
+    _bus->close(_deviceIndex);
+    _deviceIndex = -1;
+}
+
+int SimTransport::stringDescriptor(quint8 index, char* buff, int buffSize)
+{
+    if (_deviceIndex < 0)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    return _bus->stringDescriptor(_deviceIndex, index, buff, buffSize);
+}
+
+int SimTransport::checkActiveConfig()
+{
+    return (_deviceIndex >= 0) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int SimTransport::setAutoDetachKernelDriver(bool)
+{
+    return (_deviceIndex >= 0) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int SimTransport::claimInterface(int /*number*/)
+{
+    if (_deviceIndex < 0)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    int res = _bus->claimInterface(_deviceIndex);
+    _claimed = (res == LIBUSB_SUCCESS);
+    return res;
+}
+
+int SimTransport::releaseInterface(int /*number*/)
+{
+    if (_deviceIndex < 0)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    _claimed = false;
+    return _bus->releaseInterface(_deviceIndex);
+}
+
+int SimTransport::controlTransfer(quint8 requestType, quint8 request,
+                                  quint16 /*value*/, quint16 /*index*/,
+                                  uchar* data, quint16 length, uint /*timeout*/)
+{
+    if (_deviceIndex < 0)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    return _bus->controlTransfer(_deviceIndex, requestType, request, data, length);
+}
+
+int SimTransport::submit(AsyncTransfer& transfer, uint /*timeout*/)
+{
+    transfer.submitTime = AsyncTransfer::TimePoint::clock::now();
+    if (_deviceIndex < 0)
+    {
+        transfer.result = LIBUSB_ERROR_NO_DEVICE;
+        transfer.completeTime = transfer.submitTime;
+        transfer.completed = 1;
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    transfer.result = 0;
+    transfer.completed = 0;
+    transfer.impl = this;
+    _pending.append(&transfer);
+    return LIBUSB_SUCCESS;
+}
+
+void SimTransport::complete(AsyncTransfer& transfer)
+{
+    transfer.result = _bus->controlTransfer(_deviceIndex, transfer.requestType,
+                                            transfer.request, transfer.data,
+                                            transfer.length);
+    transfer.completeTime = AsyncTransfer::TimePoint::clock::now();
+    transfer.completed = 1;
+}
+
+void SimTransport::handleEvents(AsyncTransfer& transfer, int /*timeout*/)
+{
+    if (transfer.impl == nullptr || transfer.completed)
+        return;
+
+    // Запросы к устройству исполняются последовательно в порядке отправки
+    while (!_pending.isEmpty())
+    {
+        AsyncTransfer* t = _pending.first();
+        _pending.removeFirst();
+        complete(*t);
+        if (t == &transfer)
+            break;
+    }
+}
+
+void SimTransport::processEvents()
+{
+    while (!_pending.isEmpty())
+    {
+        AsyncTransfer* t = _pending.first();
+        _pending.removeFirst();
+        complete(*t);
+    }
+}
+
+void SimTransport::cancel(AsyncTransfer& transfer)
+{
+    if (transfer.impl == nullptr || transfer.completed)
+        return;
+
+    _pending.removeOne(&transfer);
+    transfer.result = LIBUSB_ERROR_INTERRUPTED;
+    transfer.completeTime = AsyncTransfer::TimePoint::clock::now();
+    transfer.completed = 1;
+}
+
+void SimTransport::release(AsyncTransfer& transfer)
+{
+    _pending.removeOne(&transfer);
+    transfer.impl = nullptr;
+}
+
+} // namespace usb
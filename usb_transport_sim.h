@@ -0,0 +1,172 @@
+/*****************************************************************************
+  The MIT License
+
+  Copyright © 2021 Pavel Karelin (hkarel), <hkarel@yandex.ru>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*****************************************************************************/
+
+#pragma once
+
+#include "usb_transport.h"
+
+#include <QtCore>
+#include <atomic>
+#include <memory>
+
+/**
+  Имитация USB-шины с произвольным набором устройств. Используется для замеров
+  производительности перечисления и захвата устройств, а также для нагрузочной
+  проверки драйвера без физических плат. Имитируются  как  посторонние  USB-
+  устройства, так и платы реле с протоколом, совпадающим с прошивкой USBRelayN
+*/
+namespace usb {
+
+class SimBus
+{
+public:
+    // Добавляет постороннее (не являющееся платой реле) устройство
+    void addDevice(quint16 vendorId, quint16 productId);
+
+    // Добавляет плату реле. Параметр relayCount: 1, 2, 4 или 8
+    void addRelayBoard(const QString& serial, int relayCount);
+
+    // Количество устройств на шине
+    int count() const;
+
+    // Имитируемая длительность одного обращения к устройству (в микросекун-
+    // дах): открытие, чтение дескриптора, control transfer
+    void setTransferDelay(int usec) {_transferDelay = usec;}
+    int transferDelay() const {return _transferDelay;}
+
+    // Счетчики обращений ко всем устройствам шины
+    struct Stats
+    {
+        quint64 deviceLists = {0};
+        quint64 opens = {0};
+        quint64 stringDescriptors = {0};
+        quint64 controlTransfers = {0};
+        quint64 claims = {0};
+    };
+    Stats stats() const;
+    void resetStats();
+
+    // Журнал изменений состояний реле. Время изменения фиксируется по часам
+    // std::chrono::steady_clock (в наносекундах) в момент исполнения команды
+    // имитируемой платой, независимо от учета состояний в драйвере. При вклю-
+    // чении журнала в него записываются текущие состояния всех плат
+    struct StateRecord
+    {
+        int     index;  // Индекс устройства
+        quint64 time;
+        quint8  states;
+    };
+    void setStateLog(bool enabled);
+    QVector<StateRecord> stateLog() const;
+
+private:
+    struct Device
+    {
+        DeviceInfo info;
+        bool   relay = {false};
+        char   serial[5] = {0};
+        int    relayCount = {0};
+        quint8 states = {0};
+        bool   claimed = {false};
+    };
+
+    int  open(int index);
+    void close(int index);
+    int  stringDescriptor(int index, quint8 descIndex, char* buff, int buffSize);
+    int  claimInterface(int index);
+    int  releaseInterface(int index);
+    int  controlTransfer(int index, quint8 requestType, quint8 request,
+                         uchar* data, quint16 length);
+    void delay() const;
+
+private:
+    mutable QMutex _lock;
+    QVector<Device> _devices;
+    bool _stateLogEnabled = {false};
+    QVector<StateRecord> _stateLog;
+    std::atomic_int _transferDelay = {0};
+
+    std::atomic<quint64> _deviceLists = {0};
+    std::atomic<quint64> _opens = {0};
+    std::atomic<quint64> _stringDescriptors = {0};
+    std::atomic<quint64> _controlTransfers = {0};
+    std::atomic<quint64> _claims = {0};
+
+    friend class SimTransport;
+};
+
+/**
+  Транспорт, работающий с имитируемой шиной SimBus. Одна шина может исполь-
+  зоваться несколькими транспортами (по одному на экземпляр Relay)
+*/
+class SimTransport : public Transport
+{
+public:
+    explicit SimTransport(std::shared_ptr<SimBus>);
+    ~SimTransport();
+
+    int  init() override {return LIBUSB_SUCCESS;}
+    void deinit() override {close();}
+
+    int  deviceList(QVector<DeviceInfo>&) override;
+    void freeDeviceList() override {}
+    Transport* createProbe() override {return new SimTransport(_bus);}
+    bool takeDevice(Transport*) override;
+
+    int  open(const DeviceInfo&) override;
+    void close() override;
+    bool isOpen() const override {return (_deviceIndex >= 0);}
+
+    int stringDescriptor(quint8 index, char* buff, int buffSize) override;
+
+    int checkActiveConfig() override;
+    int setAutoDetachKernelDriver(bool) override;
+    int claimInterface(int number) override;
+    int releaseInterface(int number) override;
+
+    int controlTransfer(quint8 requestType, quint8 request,
+                        quint16 value, quint16 index,
+                        uchar* data, quint16 length, uint timeout) override;
+
+    // Асинхронные запросы исполняются в порядке отправки при вызове handle-
+    // Events() (до указанного запроса включительно) или processEvents()
+    int  submit(AsyncTransfer&, uint timeout) override;
+    void handleEvents(AsyncTransfer&, int timeout) override;
+    void cancel(AsyncTransfer&) override;
+    void release(AsyncTransfer&) override;
+    void processEvents() override;
+
+private:
+    DISABLE_DEFAULT_COPY(SimTransport)
+
+    void complete(AsyncTransfer&);
+
+    std::shared_ptr<SimBus> _bus;
+    QVector<AsyncTransfer*> _pending;
+    int _deviceIndex = {-1};
+    bool _claimed = {false};
+};
+
+} // namespace usb